@@ -0,0 +1,173 @@
+// Settings applied while a given app has focus
+//
+// Profiles are stored as control transactions, so applying one on focus
+// change goes through the same setters as the control protocol and every
+// setting of it lands before the next frame is painted.
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+#include "appprofiles.hpp"
+#include "log.hpp"
+
+static LogScope profile_log("appprofiles");
+
+static std::unordered_map<uint32_t, gamescope_control_transaction_t> s_profiles;
+
+static bool parse_uint( const std::string &value, uint32_t *pOut )
+{
+	char *end = nullptr;
+	unsigned long ulValue = strtoul( value.c_str(), &end, 10 );
+	if ( value.empty() || *end != '\0' )
+		return false;
+
+	*pOut = (uint32_t)ulValue;
+	return true;
+}
+
+static bool parse_bool( const std::string &value, bool *pOut )
+{
+	uint32_t uValue;
+	if ( !parse_uint( value, &uValue ) || uValue > 1 )
+		return false;
+
+	*pOut = uValue != 0;
+	return true;
+}
+
+static bool parse_name( const std::string &value, const char *const *names, uint32_t count, uint32_t *pOut )
+{
+	for ( uint32_t i = 0; i < count; i++ )
+	{
+		if ( value == names[ i ] )
+		{
+			*pOut = i;
+			return true;
+		}
+	}
+	return parse_uint( value, pOut ) && *pOut < count;
+}
+
+static const char *const k_scalingFilterNames[] = { "linear", "nearest", "integer", "fsr", "nis", "sharp" };
+static const char *const k_blurModeNames[] = { "off", "cond", "always" };
+
+static bool parse_setting( gamescope_control_transaction_t *t, const std::string &key, const std::string &value )
+{
+	enum gamescope_control_setting setting;
+	bool bValid;
+
+	if ( key == "fps-limit" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_FPS_LIMIT;
+		bValid = parse_uint( value, &t->fpsLimit );
+	}
+	else if ( key == "dynamic-refresh" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_DYNAMIC_REFRESH;
+		bValid = parse_uint( value, &t->dynamicRefresh );
+	}
+	else if ( key == "low-latency" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_LOW_LATENCY;
+		bValid = parse_bool( value, &t->lowLatency );
+	}
+	else if ( key == "allow-tearing" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_ALLOW_TEARING;
+		bValid = parse_bool( value, &t->allowTearing );
+	}
+	else if ( key == "frame-pacing" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_FRAME_PACING;
+		bValid = parse_bool( value, &t->framePacing );
+	}
+	else if ( key == "scaling-filter" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_SCALING_FILTER;
+		bValid = parse_name( value, k_scalingFilterNames, 6, &t->scalingFilter );
+	}
+	else if ( key == "sharpness" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_SHARPNESS;
+		bValid = parse_uint( value, &t->sharpness ) && t->sharpness <= 20;
+	}
+	else if ( key == "blur-mode" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_BLUR_MODE;
+		bValid = parse_name( value, k_blurModeNames, 3, &t->blurMode );
+	}
+	else if ( key == "blur-radius" )
+	{
+		setting = GAMESCOPE_CONTROL_SETTING_BLUR_RADIUS;
+		bValid = parse_uint( value, &t->blurRadius );
+	}
+	else
+	{
+		return false;
+	}
+
+	if ( bValid )
+		t->mask |= 1u << setting;
+	return bValid;
+}
+
+bool appprofiles_load( const char *path )
+{
+	std::ifstream file( path );
+	if ( !file.is_open() )
+	{
+		profile_log.errorf( "Failed to open %s", path );
+		return false;
+	}
+
+	s_profiles.clear();
+
+	std::string line;
+	for ( uint32_t lineNumber = 1; std::getline( file, line ); lineNumber++ )
+	{
+		size_t comment = line.find( '#' );
+		if ( comment != std::string::npos )
+			line.resize( comment );
+
+		std::istringstream stream( line );
+		std::string word;
+		if ( !( stream >> word ) )
+			continue;
+
+		uint32_t appID;
+		if ( !parse_uint( word, &appID ) || appID == 0 )
+		{
+			profile_log.errorf( "%s:%u: expected an app ID, got '%s'", path, lineNumber, word.c_str() );
+			continue;
+		}
+
+		gamescope_control_transaction_t profile;
+		while ( stream >> word )
+		{
+			size_t equals = word.find( '=' );
+			if ( equals == std::string::npos ||
+				 !parse_setting( &profile, word.substr( 0, equals ), word.substr( equals + 1 ) ) )
+			{
+				profile_log.errorf( "%s:%u: ignoring '%s'", path, lineNumber, word.c_str() );
+			}
+		}
+
+		s_profiles[ appID ] = profile;
+	}
+
+	profile_log.infof( "Loaded %zu app profiles from %s", s_profiles.size(), path );
+	return true;
+}
+
+const gamescope_control_transaction_t *appprofiles_lookup( uint32_t appID )
+{
+	auto iter = s_profiles.find( appID );
+	if ( iter == s_profiles.end() )
+		return nullptr;
+
+	return &iter->second;
+}
@@ -0,0 +1,16 @@
+// Settings applied while a given app has focus
+
+#pragma once
+
+#include <cstdint>
+
+#include "control.hpp"
+
+// Read profiles from path, replacing any loaded before. One app per line:
+//   <app ID> <setting>=<value> ...
+// with settings named after the control protocol requests, e.g.
+//   1245620 scaling-filter=fsr sharpness=5 fps-limit=40 dynamic-refresh=40
+bool appprofiles_load( const char *path );
+
+// The settings for appID, nullptr if it has no profile.
+const gamescope_control_transaction_t *appprofiles_lookup( uint32_t appID );
@@ -0,0 +1,127 @@
+// Latency of client commits on their way to being shown
+//
+// A commit goes from the Wayland thread to steamcompmgr through a queue,
+// gets imported, waits on its fence on the image wait thread, and comes back
+// to steamcompmgr as done. Each stage is timed into a histogram with power
+// of two buckets, and every queue between them reports how deep it got, so
+// the point where a queue starts backing up shows in the log next to the
+// stage that caused it. Driven by a load like gamescope-commit-stress.
+
+#include <atomic>
+#include <algorithm>
+
+#include "commitstats.hpp"
+#include "log.hpp"
+
+bool g_bCommitStats = false;
+
+static LogScope commit_log("commits");
+
+// Bucket i counts durations below 2^i microseconds, the last one the rest
+static const uint32_t k_unBuckets = 24;
+static const uint64_t k_ulReportInterval = 1'000'000'000;
+
+static const char *const k_stageNames[ COMMIT_STAGE_COUNT ] = { "queue", "import", "fence", "ready" };
+static const char *const k_queueNames[ COMMIT_QUEUE_COUNT ] = { "wayland", "wait list", "done" };
+
+struct StageStats_t
+{
+	std::atomic<uint32_t> buckets[ k_unBuckets ];
+	std::atomic<uint64_t> ulMax;
+};
+
+static StageStats_t s_stages[ COMMIT_STAGE_COUNT ];
+static std::atomic<uint32_t> s_queueMax[ COMMIT_QUEUE_COUNT ];
+// Highest depth ever, to tell when a queue keeps growing
+static uint32_t s_queuePeak[ COMMIT_QUEUE_COUNT ];
+static uint64_t s_ulLastReport = 0;
+
+template <typename T>
+static void atomic_max( std::atomic<T> &value, T newValue )
+{
+	T oldValue = value.load( std::memory_order_relaxed );
+	while ( oldValue < newValue && !value.compare_exchange_weak( oldValue, newValue, std::memory_order_relaxed ) )
+		;
+}
+
+void commitstats_record( enum CommitStage stage, uint64_t ulDuration )
+{
+	if ( !g_bCommitStats )
+		return;
+
+	uint64_t ulMicros = ulDuration / 1000;
+	uint32_t unBucket = 0;
+	while ( unBucket < k_unBuckets - 1 && ulMicros >= ( 1ull << unBucket ) )
+		unBucket++;
+
+	s_stages[ stage ].buckets[ unBucket ].fetch_add( 1, std::memory_order_relaxed );
+	atomic_max( s_stages[ stage ].ulMax, ulDuration );
+}
+
+void commitstats_queue_depth( enum CommitQueue queue, uint32_t uDepth )
+{
+	if ( !g_bCommitStats )
+		return;
+
+	atomic_max( s_queueMax[ queue ], uDepth );
+}
+
+// Upper bound of the bucket the given fraction of samples falls in, in us
+static uint64_t percentile( const uint32_t *buckets, uint32_t unCount, float flFraction )
+{
+	uint32_t unTarget = std::max<uint32_t>( unCount * flFraction, 1 );
+	uint32_t unSeen = 0;
+	for ( uint32_t i = 0; i < k_unBuckets; i++ )
+	{
+		unSeen += buckets[ i ];
+		if ( unSeen >= unTarget )
+			return 1ull << i;
+	}
+	return 1ull << ( k_unBuckets - 1 );
+}
+
+void commitstats_report( uint64_t now )
+{
+	if ( !g_bCommitStats )
+		return;
+
+	if ( s_ulLastReport == 0 )
+		s_ulLastReport = now;
+	if ( now - s_ulLastReport < k_ulReportInterval )
+		return;
+
+	double flSeconds = ( now - s_ulLastReport ) / 1'000'000'000.0;
+	s_ulLastReport = now;
+
+	for ( uint32_t stage = 0; stage < COMMIT_STAGE_COUNT; stage++ )
+	{
+		uint32_t buckets[ k_unBuckets ];
+		uint32_t unCount = 0;
+		for ( uint32_t i = 0; i < k_unBuckets; i++ )
+		{
+			buckets[ i ] = s_stages[ stage ].buckets[ i ].exchange( 0, std::memory_order_relaxed );
+			unCount += buckets[ i ];
+		}
+		uint64_t ulMax = s_stages[ stage ].ulMax.exchange( 0, std::memory_order_relaxed );
+
+		if ( unCount == 0 )
+			continue;
+
+		commit_log.infof( "%-6s %7.1f/s  p50 <%lluus  p99 <%lluus  max %.2fms",
+			k_stageNames[ stage ], unCount / flSeconds,
+			(unsigned long long)percentile( buckets, unCount, 0.5f ),
+			(unsigned long long)percentile( buckets, unCount, 0.99f ),
+			ulMax / 1'000'000.0 );
+	}
+
+	for ( uint32_t queue = 0; queue < COMMIT_QUEUE_COUNT; queue++ )
+	{
+		uint32_t uMax = s_queueMax[ queue ].exchange( 0, std::memory_order_relaxed );
+		if ( uMax == 0 )
+			continue;
+
+		bool bGrowing = uMax > s_queuePeak[ queue ] && s_queuePeak[ queue ] != 0;
+		s_queuePeak[ queue ] = std::max( s_queuePeak[ queue ], uMax );
+		commit_log.infof( "%s queue depth %u%s", k_queueNames[ queue ], uMax, bGrowing ? ", new peak: backing up" : "" );
+	}
+}
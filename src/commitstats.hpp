@@ -0,0 +1,40 @@
+// Latency of client commits on their way to being shown
+
+#pragma once
+
+#include <cstdint>
+
+extern bool g_bCommitStats;
+
+enum CommitStage
+{
+	// Client commit to steamcompmgr picking it up
+	COMMIT_STAGE_QUEUE,
+	// Buffer import: Vulkan texture and DRM FB
+	COMMIT_STAGE_IMPORT,
+	// On the wait list until the buffer's fence signalled
+	COMMIT_STAGE_FENCE,
+	// Client commit to the commit being handled as done, ready to show
+	COMMIT_STAGE_READY,
+
+	COMMIT_STAGE_COUNT
+};
+
+enum CommitQueue
+{
+	// Commits picked up at once from a Wayland queue
+	COMMIT_QUEUE_WAYLAND,
+	// Commits waiting on their fence
+	COMMIT_QUEUE_WAIT_LIST,
+	// Done commits waiting on steamcompmgr
+	COMMIT_QUEUE_DONE,
+
+	COMMIT_QUEUE_COUNT
+};
+
+// Both are safe from any thread and cheap when stats are off.
+void commitstats_record( enum CommitStage stage, uint64_t ulDuration );
+void commitstats_queue_depth( enum CommitQueue queue, uint32_t uDepth );
+
+// Logs a report and starts over, once a second at most.
+void commitstats_report( uint64_t now );
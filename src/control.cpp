@@ -0,0 +1,319 @@
+#include "control.hpp"
+#include "wlserver.hpp"
+#include "steamcompmgr.hpp"
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define CONTROL_VERSION 1
+
+// Only touched with the wayland lock held
+static std::vector<struct wl_resource *> control_resources;
+static std::vector<struct wl_resource *> frame_stats_resources;
+
+static uint32_t last_input_counter = 0;
+static bool last_upscaler_active = false;
+static uint32_t last_render_width = 0;
+static uint32_t last_render_height = 0;
+
+static std::atomic<bool> frame_stats_wanted = { false };
+
+static std::mutex transactions_lock;
+static std::vector<gamescope_control_transaction_t> transactions;
+
+static void remove_resource(std::vector<struct wl_resource *> &resources, struct wl_resource *resource)
+{
+	resources.erase(std::remove(resources.begin(), resources.end(), resource), resources.end());
+}
+
+std::vector<gamescope_control_transaction_t> control_take_transactions()
+{
+	std::lock_guard<std::mutex> lock(transactions_lock);
+	std::vector<gamescope_control_transaction_t> ret;
+	ret.swap(transactions);
+	return ret;
+}
+
+bool control_wants_frame_stats()
+{
+	return frame_stats_wanted;
+}
+
+void control_send_frame_stats(const gamescope_control_frame_stats_t &stats)
+{
+	for (struct wl_resource *resource : frame_stats_resources) {
+		gamescope_control_frame_stats_send_frame(resource, stats.seq,
+			stats.vblankTime >> 32, stats.vblankTime & 0xFFFFFFFF,
+			(uint32_t)std::min<uint64_t>(stats.drawTime, UINT32_MAX),
+			stats.appID, stats.layerCount, stats.flags);
+	}
+}
+
+void control_update_feedback(uint32_t inputCounter, bool upscalerActive, uint32_t renderWidth, uint32_t renderHeight)
+{
+	for (struct wl_resource *resource : control_resources) {
+		if (inputCounter != last_input_counter)
+			gamescope_control_send_input_counter(resource, inputCounter);
+		if (upscalerActive != last_upscaler_active)
+			gamescope_control_send_upscaler_active(resource, upscalerActive);
+		if (renderWidth != last_render_width || renderHeight != last_render_height)
+			gamescope_control_send_preferred_render_size(resource, renderWidth, renderHeight);
+	}
+
+	last_input_counter = inputCounter;
+	last_upscaler_active = upscalerActive;
+	last_render_width = renderWidth;
+	last_render_height = renderHeight;
+}
+
+static gamescope_control_transaction_t *transaction_from_resource(struct wl_resource *resource)
+{
+	return (gamescope_control_transaction_t *)wl_resource_get_user_data(resource);
+}
+
+static void transaction_set(struct wl_resource *resource, enum gamescope_control_setting setting)
+{
+	transaction_from_resource(resource)->mask |= 1u << setting;
+}
+
+static bool transaction_copy_floats(struct wl_resource *resource, float *dst, size_t count, struct wl_array *array)
+{
+	if (array->size != count * sizeof(float)) {
+		wl_resource_post_error(resource, GAMESCOPE_CONTROL_TRANSACTION_ERROR_INVALID_VALUE,
+			"Expected %zu floats, got %zu bytes", count, array->size);
+		return false;
+	}
+
+	memcpy(dst, array->data, array->size);
+	return true;
+}
+
+static void transaction_handle_commit(struct wl_client *client, struct wl_resource *resource)
+{
+	{
+		std::lock_guard<std::mutex> lock(transactions_lock);
+		transactions.push_back(*transaction_from_resource(resource));
+	}
+
+	nudge_steamcompmgr();
+
+	wl_resource_destroy(resource);
+}
+
+static void transaction_handle_set_fps_limit(struct wl_client *client, struct wl_resource *resource, uint32_t fps)
+{
+	transaction_from_resource(resource)->fpsLimit = fps;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_FPS_LIMIT);
+}
+
+static void transaction_handle_set_dynamic_refresh(struct wl_client *client, struct wl_resource *resource, uint32_t refresh)
+{
+	transaction_from_resource(resource)->dynamicRefresh = refresh;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_DYNAMIC_REFRESH);
+}
+
+static void transaction_handle_set_vblank_red_zone(struct wl_client *client, struct wl_resource *resource, uint32_t red_zone)
+{
+	transaction_from_resource(resource)->vblankRedZone = red_zone;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_VBLANK_RED_ZONE);
+}
+
+static void transaction_handle_set_vblank_rate_of_decay(struct wl_client *client, struct wl_resource *resource, uint32_t percentage)
+{
+	if (percentage > 100) {
+		wl_resource_post_error(resource, GAMESCOPE_CONTROL_TRANSACTION_ERROR_INVALID_VALUE, "Rate of decay is a percentage");
+		return;
+	}
+
+	transaction_from_resource(resource)->vblankRateOfDecay = percentage;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_VBLANK_RATE_OF_DECAY);
+}
+
+static void transaction_handle_set_low_latency(struct wl_client *client, struct wl_resource *resource, uint32_t enabled)
+{
+	transaction_from_resource(resource)->lowLatency = !!enabled;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_LOW_LATENCY);
+}
+
+static void transaction_handle_set_allow_tearing(struct wl_client *client, struct wl_resource *resource, uint32_t enabled)
+{
+	transaction_from_resource(resource)->allowTearing = !!enabled;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_ALLOW_TEARING);
+}
+
+static void transaction_handle_set_frame_pacing(struct wl_client *client, struct wl_resource *resource, uint32_t enabled)
+{
+	transaction_from_resource(resource)->framePacing = !!enabled;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_FRAME_PACING);
+}
+
+static void transaction_handle_set_scaling_filter(struct wl_client *client, struct wl_resource *resource, uint32_t filter)
+{
+	if (filter > GAMESCOPE_CONTROL_SCALING_FILTER_SHARP) {
+		wl_resource_post_error(resource, GAMESCOPE_CONTROL_TRANSACTION_ERROR_INVALID_VALUE, "Unknown scaling filter %u", filter);
+		return;
+	}
+
+	transaction_from_resource(resource)->scalingFilter = filter;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_SCALING_FILTER);
+}
+
+static void transaction_handle_set_sharpness(struct wl_client *client, struct wl_resource *resource, uint32_t sharpness)
+{
+	if (sharpness > 20) {
+		wl_resource_post_error(resource, GAMESCOPE_CONTROL_TRANSACTION_ERROR_INVALID_VALUE, "Sharpness goes from 0 to 20");
+		return;
+	}
+
+	transaction_from_resource(resource)->sharpness = sharpness;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_SHARPNESS);
+}
+
+static void transaction_handle_set_color_linear_gain(struct wl_client *client, struct wl_resource *resource, struct wl_array *gains)
+{
+	if (transaction_copy_floats(resource, transaction_from_resource(resource)->colorLinearGain, 3, gains))
+		transaction_set(resource, GAMESCOPE_CONTROL_SETTING_COLOR_LINEAR_GAIN);
+}
+
+static void transaction_handle_set_color_gain(struct wl_client *client, struct wl_resource *resource, struct wl_array *gains)
+{
+	if (transaction_copy_floats(resource, transaction_from_resource(resource)->colorGain, 3, gains))
+		transaction_set(resource, GAMESCOPE_CONTROL_SETTING_COLOR_GAIN);
+}
+
+static void transaction_handle_set_color_linear_gain_blend(struct wl_client *client, struct wl_resource *resource, wl_fixed_t blend)
+{
+	transaction_from_resource(resource)->colorLinearGainBlend = wl_fixed_to_double(blend);
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_COLOR_LINEAR_GAIN_BLEND);
+}
+
+static void transaction_handle_set_color_matrix(struct wl_client *client, struct wl_resource *resource, struct wl_array *matrix)
+{
+	if (transaction_copy_floats(resource, transaction_from_resource(resource)->colorMatrix, 9, matrix))
+		transaction_set(resource, GAMESCOPE_CONTROL_SETTING_COLOR_MATRIX);
+}
+
+static void transaction_handle_set_color_gamma_exponent(struct wl_client *client, struct wl_resource *resource, struct wl_array *exponents)
+{
+	if (transaction_copy_floats(resource, transaction_from_resource(resource)->colorGammaExponent, 6, exponents))
+		transaction_set(resource, GAMESCOPE_CONTROL_SETTING_COLOR_GAMMA_EXPONENT);
+}
+
+static void transaction_handle_set_blur_mode(struct wl_client *client, struct wl_resource *resource, uint32_t mode)
+{
+	if (mode > GAMESCOPE_CONTROL_BLUR_MODE_ALWAYS) {
+		wl_resource_post_error(resource, GAMESCOPE_CONTROL_TRANSACTION_ERROR_INVALID_VALUE, "Unknown blur mode %u", mode);
+		return;
+	}
+
+	transaction_from_resource(resource)->blurMode = mode;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_BLUR_MODE);
+}
+
+static void transaction_handle_set_blur_radius(struct wl_client *client, struct wl_resource *resource, uint32_t radius)
+{
+	transaction_from_resource(resource)->blurRadius = radius;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_BLUR_RADIUS);
+}
+
+static void transaction_handle_set_blur_fade_duration(struct wl_client *client, struct wl_resource *resource, uint32_t duration)
+{
+	transaction_from_resource(resource)->blurFadeDuration = duration;
+	transaction_set(resource, GAMESCOPE_CONTROL_SETTING_BLUR_FADE_DURATION);
+}
+
+static const struct gamescope_control_transaction_interface transaction_impl = {
+	.commit = transaction_handle_commit,
+	.set_fps_limit = transaction_handle_set_fps_limit,
+	.set_dynamic_refresh = transaction_handle_set_dynamic_refresh,
+	.set_vblank_red_zone = transaction_handle_set_vblank_red_zone,
+	.set_vblank_rate_of_decay = transaction_handle_set_vblank_rate_of_decay,
+	.set_low_latency = transaction_handle_set_low_latency,
+	.set_allow_tearing = transaction_handle_set_allow_tearing,
+	.set_frame_pacing = transaction_handle_set_frame_pacing,
+	.set_scaling_filter = transaction_handle_set_scaling_filter,
+	.set_sharpness = transaction_handle_set_sharpness,
+	.set_color_linear_gain = transaction_handle_set_color_linear_gain,
+	.set_color_gain = transaction_handle_set_color_gain,
+	.set_color_linear_gain_blend = transaction_handle_set_color_linear_gain_blend,
+	.set_color_matrix = transaction_handle_set_color_matrix,
+	.set_color_gamma_exponent = transaction_handle_set_color_gamma_exponent,
+	.set_blur_mode = transaction_handle_set_blur_mode,
+	.set_blur_radius = transaction_handle_set_blur_radius,
+	.set_blur_fade_duration = transaction_handle_set_blur_fade_duration,
+};
+
+static void transaction_handle_resource_destroy(struct wl_resource *resource)
+{
+	// Never committed transactions are simply dropped
+	delete transaction_from_resource(resource);
+}
+
+static void frame_stats_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct gamescope_control_frame_stats_interface frame_stats_impl = {
+	.destroy = frame_stats_handle_destroy,
+};
+
+static void frame_stats_handle_resource_destroy(struct wl_resource *resource)
+{
+	remove_resource(frame_stats_resources, resource);
+	frame_stats_wanted = !frame_stats_resources.empty();
+}
+
+static void control_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void control_handle_create_transaction(struct wl_client *client, struct wl_resource *control_resource, uint32_t id)
+{
+	uint32_t version = wl_resource_get_version(control_resource);
+	struct wl_resource *resource = wl_resource_create(client, &gamescope_control_transaction_interface, version, id);
+	wl_resource_set_implementation(resource, &transaction_impl, new gamescope_control_transaction_t(), transaction_handle_resource_destroy);
+}
+
+static void control_handle_get_frame_stats(struct wl_client *client, struct wl_resource *control_resource, uint32_t id)
+{
+	uint32_t version = wl_resource_get_version(control_resource);
+	struct wl_resource *resource = wl_resource_create(client, &gamescope_control_frame_stats_interface, version, id);
+	wl_resource_set_implementation(resource, &frame_stats_impl, nullptr, frame_stats_handle_resource_destroy);
+
+	frame_stats_resources.push_back(resource);
+	frame_stats_wanted = true;
+}
+
+static const struct gamescope_control_interface control_impl = {
+	.destroy = control_handle_destroy,
+	.create_transaction = control_handle_create_transaction,
+	.get_frame_stats = control_handle_get_frame_stats,
+};
+
+static void control_handle_resource_destroy(struct wl_resource *resource)
+{
+	remove_resource(control_resources, resource);
+}
+
+static void control_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &gamescope_control_interface, version, id);
+	wl_resource_set_implementation(resource, &control_impl, nullptr, control_handle_resource_destroy);
+
+	control_resources.push_back(resource);
+
+	gamescope_control_send_upscaler_active(resource, last_upscaler_active);
+	gamescope_control_send_input_counter(resource, last_input_counter);
+	gamescope_control_send_preferred_render_size(resource, last_render_width, last_render_height);
+}
+
+void create_control_manager(struct wlserver_t *wlserver)
+{
+	wl_global_create(wlserver->display, &gamescope_control_interface, CONTROL_VERSION, nullptr, control_bind);
+}
@@ -0,0 +1,78 @@
+// Private control and telemetry protocol, for session managers
+
+#pragma once
+
+#include "wlserver.hpp"
+
+#include <vector>
+
+#include "gamescope-control-protocol.h"
+
+enum gamescope_control_setting
+{
+	GAMESCOPE_CONTROL_SETTING_FPS_LIMIT,
+	GAMESCOPE_CONTROL_SETTING_DYNAMIC_REFRESH,
+	GAMESCOPE_CONTROL_SETTING_VBLANK_RED_ZONE,
+	GAMESCOPE_CONTROL_SETTING_VBLANK_RATE_OF_DECAY,
+	GAMESCOPE_CONTROL_SETTING_LOW_LATENCY,
+	GAMESCOPE_CONTROL_SETTING_ALLOW_TEARING,
+	GAMESCOPE_CONTROL_SETTING_FRAME_PACING,
+	GAMESCOPE_CONTROL_SETTING_SCALING_FILTER,
+	GAMESCOPE_CONTROL_SETTING_SHARPNESS,
+	GAMESCOPE_CONTROL_SETTING_COLOR_LINEAR_GAIN,
+	GAMESCOPE_CONTROL_SETTING_COLOR_GAIN,
+	GAMESCOPE_CONTROL_SETTING_COLOR_LINEAR_GAIN_BLEND,
+	GAMESCOPE_CONTROL_SETTING_COLOR_MATRIX,
+	GAMESCOPE_CONTROL_SETTING_COLOR_GAMMA_EXPONENT,
+	GAMESCOPE_CONTROL_SETTING_BLUR_MODE,
+	GAMESCOPE_CONTROL_SETTING_BLUR_RADIUS,
+	GAMESCOPE_CONTROL_SETTING_BLUR_FADE_DURATION,
+};
+
+// A committed transaction, only the settings in mask were set
+struct gamescope_control_transaction_t
+{
+	uint32_t mask = 0;
+
+	uint32_t fpsLimit;
+	uint32_t dynamicRefresh;
+	uint32_t vblankRedZone;
+	uint32_t vblankRateOfDecay;
+	bool lowLatency;
+	bool allowTearing;
+	bool framePacing;
+	uint32_t scalingFilter;
+	uint32_t sharpness;
+	float colorLinearGain[3];
+	float colorGain[3];
+	float colorLinearGainBlend;
+	float colorMatrix[9];
+	float colorGammaExponent[6];
+	uint32_t blurMode;
+	uint32_t blurRadius;
+	uint32_t blurFadeDuration;
+
+	bool has(enum gamescope_control_setting setting) const { return mask & (1u << setting); }
+};
+
+struct gamescope_control_frame_stats_t
+{
+	uint32_t seq;
+	uint64_t vblankTime;
+	uint64_t drawTime;
+	uint32_t appID;
+	uint32_t layerCount;
+	uint32_t flags;
+};
+
+void create_control_manager(struct wlserver_t *wlserver);
+
+// Transactions committed since the last call, in order. Safe to call from any thread.
+std::vector<gamescope_control_transaction_t> control_take_transactions();
+
+// Cheap check for whether control_send_frame_stats has anyone to send to.
+bool control_wants_frame_stats();
+
+// Need the wlserver lock. Feedback is only sent when it changed.
+void control_send_frame_stats(const gamescope_control_frame_stats_t &stats);
+void control_update_feedback(uint32_t inputCounter, bool upscalerActive, uint32_t renderWidth, uint32_t renderHeight);
@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <poll.h>
+#include <sys/eventfd.h>
 
 extern "C" {
 #include <wlr/types/wlr_buffer.h>
@@ -29,6 +30,8 @@ extern "C" {
 #include "steamcompmgr.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <memory>
 #include <thread>
 
 struct drm_t g_DRM = {};
@@ -182,67 +185,92 @@ static struct plane *find_primary_plane(struct drm_t *drm)
 }
 
 static void drm_unlock_fb_internal( struct drm_t *drm, struct fb *fb );
+static void drm_free_fb_internal( struct drm_t *drm, struct fb *fb );
 
-static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+/* Drops a page-flip reference to fb. If that was the last one and something
+ * was deferred until then, fb is handed to drm_dispatch_flip_events. */
+static void drm_release_fb_ref( struct drm_t *drm, struct fb *fb )
 {
-	uint64_t flipcount = (uint64_t)data;
+	uint32_t old = fb->state.fetch_sub( 1 );
+	assert( ( old & FB_REFS_MASK ) != 0 );
 
-	if ( g_DRM.crtc->id != crtc_id )
+	if ( ( old & FB_REFS_MASK ) != 1 || ( old & ~FB_REFS_MASK ) == 0 )
 		return;
 
-	// This is the last vblank time
-	uint64_t vblanktime = sec * 1'000'000'000lu + usec * 1'000lu;
-	vblank_mark_possible_vblank(vblanktime);
-
-	// TODO: get the fbids_queued instance from data if we ever have more than one in flight
-
-	drm_verbose_log.debugf("page_flip_handler %" PRIu64, flipcount);
-	gpuvis_trace_printf("page_flip_handler %" PRIu64, flipcount);
+	// Only ever one consumer, which takes the whole list at once
+	struct fb *head = drm->deferred_fbs.load();
+	do
+		fb->next_deferred = head;
+	while ( !drm->deferred_fbs.compare_exchange_weak( head, fb ) );
+}
 
-	for ( uint32_t i = 0; i < g_DRM.fbids_on_screen.size(); i++ )
+/* Runs the actions deferred on an FB that no page-flip uses anymore */
+static void drm_run_deferred( struct drm_t *drm, struct fb *fb )
+{
+	uint32_t actions = fb->state.load();
+	while ( true )
 	{
-		uint32_t previous_fbid = g_DRM.fbids_on_screen[ i ];
-		assert( previous_fbid != 0 );
+		assert( ( actions & FB_REFS_MASK ) == 0 );
 
-		struct fb &previous_fb = get_fb( g_DRM, previous_fbid );
+		if ( actions & FB_DEFERRED_UNLOCK )
+		{
+			drm_verbose_log.debugf( "deferred unlock %u", fb->id );
+			drm_unlock_fb_internal( drm, fb );
+		}
 
-		if ( --previous_fb.n_refs == 0 )
+		if ( actions & FB_DEFERRED_FREE )
 		{
-			// we flipped away from this previous fbid, now safe to delete
-			std::lock_guard<std::mutex> lock( g_DRM.free_queue_lock );
+			drm_verbose_log.debugf( "deferred free %u", fb->id );
+			drm_free_fb_internal( drm, fb );
+			return;
+		}
 
-			for ( uint32_t i = 0; i < g_DRM.fbid_unlock_queue.size(); i++ )
-			{
-				if ( g_DRM.fbid_unlock_queue[ i ] == previous_fbid )
-				{
-					drm_verbose_log.debugf("deferred unlock %u", previous_fbid);
+		// Anything deferred while we were at it is ours to run too, nobody
+		// else will pick this FB up.
+		uint32_t remaining = fb->state.fetch_and( ~actions ) & ~actions;
+		if ( remaining == 0 )
+			return;
+		actions = remaining;
+	}
+}
 
-					drm_unlock_fb_internal( &g_DRM, &get_fb( g_DRM, previous_fbid ) );
+static void page_flip_handler(int fd, unsigned int frame, unsigned int sec, unsigned int usec, unsigned int crtc_id, void *data)
+{
+	uint64_t flipcount = (uint64_t)data;
 
-					g_DRM.fbid_unlock_queue.erase( g_DRM.fbid_unlock_queue.begin() + i );
-					break;
-				}
-			}
+	if ( g_DRM.crtc->id != crtc_id )
+		return;
 
-			for ( uint32_t i = 0; i < g_DRM.fbid_free_queue.size(); i++ )
-			{
-				if ( g_DRM.fbid_free_queue[ i ] == previous_fbid )
-				{
-					drm_verbose_log.debugf( "deferred free %u", previous_fbid );
+	// This is the last vblank time
+	// Async flips complete immediately, so their timestamp says nothing about
+	// when the next vblank will happen.
+	uint64_t vblanktime = sec * 1'000'000'000lu + usec * 1'000lu;
+	if ( !g_DRM.fbs_queued_async )
+		vblank_mark_possible_vblank(vblanktime);
 
-					drm_drop_fbid( &g_DRM, previous_fbid );
+	// TODO: get the fbs_queued instance from data if we ever have more than one in flight
 
-					g_DRM.fbid_free_queue.erase( g_DRM.fbid_free_queue.begin() + i );
-					break;
-				}
-			}
-		}
-	}
+	drm_verbose_log.debugf("page_flip_handler %" PRIu64, flipcount);
+	gpuvis_trace_printf("page_flip_handler %" PRIu64, flipcount);
+
+	// We flipped away from these, the ones nobody else uses are now safe to
+	// unlock or delete
+	for ( uint32_t i = 0; i < g_DRM.fbs_on_screen_count; i++ )
+		drm_release_fb_ref( &g_DRM, g_DRM.fbs_on_screen[ i ] );
+
+	g_DRM.fbs_on_screen = g_DRM.fbs_queued;
+	g_DRM.fbs_on_screen_count = g_DRM.fbs_queued_count;
+	g_DRM.fbs_queued_count = 0;
 
-	g_DRM.fbids_on_screen = g_DRM.fbids_queued;
-	g_DRM.fbids_queued.clear();
+	g_DRM.flip_vblank_time = vblanktime;
+	g_DRM.flip_sequence = frame;
+	g_DRM.flip_pending = false;
 
-	g_DRM.flip_lock.unlock();
+	// Everything that may block, like unlocking client buffers and sending
+	// presentation feedback, is left to the compositor thread.
+	uint64_t one = 1;
+	if ( write( g_DRM.flip_event_fd, &one, sizeof( one ) ) < 0 )
+		drm_log.errorf_errno( "failed to signal flip completion" );
 }
 
 void flip_handler_thread_run(void)
@@ -254,24 +282,31 @@ void flip_handler_thread_run(void)
 		.events = POLLIN,
 	};
 
+	drmEventContext evctx = {
+		.version = 3,
+		.page_flip_handler2 = page_flip_handler,
+	};
+
 	while ( true )
 	{
 		int ret = poll( &pollfd, 1, -1 );
 		if ( ret < 0 ) {
+			if ( errno == EINTR )
+				continue;
+
 			drm_log.errorf_errno( "polling for DRM events failed" );
 			break;
 		}
 
-		drmEventContext evctx = {
-			.version = 3,
-			.page_flip_handler2 = page_flip_handler,
-		};
 		drmHandleEvent(g_DRM.fd, &evctx);
 	}
 }
 
 static const drmModePropertyRes *get_prop(struct drm_t *drm, uint32_t prop_id)
 {
+	// Shared between the compositor and probe threads
+	std::lock_guard<std::mutex> lock(drm->props_lock);
+
 	if (drm->props.count(prop_id) > 0) {
 		return drm->props[prop_id];
 	}
@@ -310,6 +345,54 @@ static bool get_object_properties(struct drm_t *drm, uint32_t obj_id, uint32_t o
 	return true;
 }
 
+#define EDID_ID(a, b, c) (((a & 0x1f) << 10) | ((b & 0x1f) << 5) | (c & 0x1f))
+
+struct edid_data_t
+{
+	uint16_t make;
+	char model[16];
+	char serial[16];
+};
+
+// from wlroots... mostly
+void parse_edid(edid_data_t *output, const uint8_t *data, size_t len) {
+	if (!data || len < 128) {
+		output->make = 0;
+		snprintf(output->model, sizeof(output->model), "<Unknown>");
+		return;
+	}
+
+	output->make = (data[8] << 8) | data[9];
+
+	uint16_t model = data[10] | (data[11] << 8);
+	snprintf(output->model, sizeof(output->model), "0x%04X", model);
+
+	uint32_t serial = data[12] | (data[13] << 8) | (data[14] << 8) | (data[15] << 8);
+	snprintf(output->serial, sizeof(output->serial), "0x%08X", serial);
+
+	for (size_t i = 72; i <= 108; i += 18) {
+		uint16_t flag = (data[i] << 8) | data[i + 1];
+		if (flag == 0 && data[i + 3] == 0xFC) {
+			sprintf(output->model, "%.13s", &data[i + 5]);
+
+			// Monitor names are terminated by newline if they're too short
+			char *nl = strchr(output->model, '\n');
+			if (nl) {
+				*nl = '\0';
+			}
+		} else if (flag == 0 && data[i + 3] == 0xFF) {
+			sprintf(output->serial, "%.13s", &data[i + 5]);
+
+			// Monitor serial numbers are terminated by newline if they're too
+			// short
+			char *nl = strchr(output->serial, '\n');
+			if (nl) {
+				*nl = '\0';
+			}
+		}
+	}
+}
+
 static bool compare_modes( drmModeModeInfo mode1, drmModeModeInfo mode2 )
 {
 	if (mode1.type & DRM_MODE_TYPE_PREFERRED)
@@ -325,76 +408,93 @@ static bool compare_modes( drmModeModeInfo mode1, drmModeModeInfo mode2 )
 	return mode1.vrefresh > mode2.vrefresh;
 }
 
-static bool refresh_state( drm_t *drm )
+struct drm_object_props_t
 {
-	drmModeRes *resources = drmModeGetResources(drm->fd);
-	if (resources == nullptr) {
-		drm_log.errorf_errno("drmModeGetResources failed");
-		return false;
-	}
+	std::map<std::string, const drmModePropertyRes *> props;
+	std::map<std::string, uint64_t> values;
+};
 
-	// Add connectors which appeared
-	for (int i = 0; i < resources->count_connectors; i++) {
-		uint32_t conn_id = resources->connectors[i];
+// Everything refreshed on hotplug, fetched without touching the drm_t state
+// the compositor thread is using
+struct drm_probe_t
+{
+	std::map< uint32_t, struct connector > connectors;
 
-		if (drm->connectors.count(conn_id) == 0) {
-			struct connector conn = { .id = conn_id };
-			drm->connectors[conn_id] = conn;
+	/* Same order as drm_t::crtcs and drm_t::planes */
+	std::vector< drm_object_props_t > crtcs;
+	std::vector< drm_object_props_t > planes;
+
+	~drm_probe_t()
+	{
+		for (auto &kv : connectors) {
+			free(kv.second.name);
+			drmModeFreeConnector(kv.second.connector);
 		}
 	}
+};
 
-	// Remove connectors which disappeared
-	auto it = drm->connectors.begin();
-	while (it != drm->connectors.end()) {
-		struct connector *conn = &it->second;
+static bool probe_steam_deck_display(struct drm_t *drm, const struct connector *conn)
+{
+	auto it = conn->initial_prop_values.find("EDID");
+	if (it == conn->initial_prop_values.end())
+		return false;
 
-		bool found = false;
-		for (int j = 0; j < resources->count_connectors; j++) {
-			if (resources->connectors[j] == conn->id) {
-				found = true;
-				break;
-			}
-		}
+	drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(drm->fd, it->second);
+	if (!blob) {
+		drm_log.errorf_errno("drmModeGetPropertyBlob(EDID) failed");
+		return false;
+	}
 
-		if (!found) {
-			if (drm->connector == conn) {
-				drm_log.infof("current connector '%s' disconnected", conn->name);
-				drm->connector = nullptr;
-			}
+	edid_data_t edid_data = {};
+	parse_edid( &edid_data, (const unsigned char *)blob->data, blob->length );
 
-			free(conn->name);
-			drmModeFreeConnector(conn->connector);
-			it = drm->connectors.erase(it);
-		} else {
-			it++;
-		}
+	bool is_steam_deck_display =
+		( edid_data.make == EDID_ID( 'W', 'L', 'C' ) && !strncmp( edid_data.model, "ANX7530 U", sizeof( edid_data.model ) ) ) ||
+		( edid_data.make == EDID_ID( 'A', 'N', 'X' ) && !strncmp( edid_data.model, "ANX7530 U", sizeof( edid_data.model ) ) ) ||
+		( edid_data.make == EDID_ID( 'V', 'L', 'V' ) && !strncmp( edid_data.model, "ANX7530 U", sizeof( edid_data.model ) ) ) ||
+		( edid_data.make == EDID_ID( 'V', 'L', 'V' ) && !strncmp( edid_data.model, "Jupiter", sizeof( edid_data.model ) ) );
+
+	drmModeFreePropertyBlob(blob);
+
+	return is_steam_deck_display;
+}
+
+/* Does all the ioctls, some drivers take seconds to probe a connector.
+ * Safe to call from any thread. */
+static struct drm_probe_t *probe_state( struct drm_t *drm )
+{
+	drmModeRes *resources = drmModeGetResources(drm->fd);
+	if (resources == nullptr) {
+		drm_log.errorf_errno("drmModeGetResources failed");
+		return nullptr;
+	}
+
+	std::unique_ptr< struct drm_probe_t > probe( new drm_probe_t() );
+
+	for (int i = 0; i < resources->count_connectors; i++) {
+		uint32_t conn_id = resources->connectors[i];
+		struct connector conn = { .id = conn_id };
+		probe->connectors[conn_id] = conn;
 	}
 
 	drmModeFreeResources(resources);
 
-	// Re-probe connectors props and status
-	for (auto &kv : drm->connectors) {
+	for (auto &kv : probe->connectors) {
 		struct connector *conn = &kv.second;
 		if (!get_object_properties(drm, conn->id, DRM_MODE_OBJECT_CONNECTOR, conn->props, conn->initial_prop_values)) {
-			return false;
+			return nullptr;
 		}
 
-		if (conn->connector != nullptr)
-			drmModeFreeConnector(conn->connector);
-
 		conn->connector = drmModeGetConnector(drm->fd, conn->id);
 		if (conn->connector == nullptr) {
 			drm_log.errorf_errno("drmModeGetConnector failed");
-			return false;
+			return nullptr;
 		}
 
 		/* sort modes by preference: preferred flag, then highest area, then
 		 * highest refresh rate */
 		std::stable_sort(conn->connector->modes, conn->connector->modes + conn->connector->count_modes, compare_modes);
 
-		if ( conn->name != nullptr )
-			continue;
-
 		const char *type_str = "Unknown";
 		if ( connector_types.count( conn->connector->connector_type ) > 0 )
 			type_str = connector_types[ conn->connector->connector_type ];
@@ -405,13 +505,66 @@ static bool refresh_state( drm_t *drm )
 		conn->name = strdup(name);
 
 		conn->possible_crtcs = get_connector_possible_crtcs(drm, conn->connector);
+
+		conn->is_steam_deck_display = probe_steam_deck_display(drm, conn);
 	}
 
+	probe->crtcs.resize(drm->crtcs.size());
 	for (size_t i = 0; i < drm->crtcs.size(); i++) {
-		struct crtc *crtc = &drm->crtcs[i];
-		if (!get_object_properties(drm, crtc->id, DRM_MODE_OBJECT_CRTC, crtc->props, crtc->initial_prop_values)) {
-			return false;
+		if (!get_object_properties(drm, drm->crtcs[i].id, DRM_MODE_OBJECT_CRTC, probe->crtcs[i].props, probe->crtcs[i].values)) {
+			return nullptr;
+		}
+	}
+
+	probe->planes.resize(drm->planes.size());
+	for (size_t i = 0; i < drm->planes.size(); i++) {
+		if (!get_object_properties(drm, drm->planes[i].id, DRM_MODE_OBJECT_PLANE, probe->planes[i].props, probe->planes[i].values)) {
+			return nullptr;
+		}
+	}
+
+	return probe.release();
+}
+
+/* Cheap, swaps in what probe_state fetched. Only on the compositor thread,
+ * or before it started. */
+static void apply_probe( struct drm_t *drm, struct drm_probe_t *probe )
+{
+	// Remove connectors which disappeared
+	auto it = drm->connectors.begin();
+	while (it != drm->connectors.end()) {
+		struct connector *conn = &it->second;
+
+		if (probe->connectors.count(conn->id) == 0) {
+			if (drm->connector == conn) {
+				drm_log.infof("current connector '%s' disconnected", conn->name);
+				drm->connector = nullptr;
+			}
+
+			free(conn->name);
+			drmModeFreeConnector(conn->connector);
+			it = drm->connectors.erase(it);
+		} else {
+			it++;
 		}
+	}
+
+	// Update the others in place, drm->connector stays valid
+	for (auto &kv : probe->connectors) {
+		auto existing = drm->connectors.find(kv.first);
+		if (existing != drm->connectors.end()) {
+			free(existing->second.name);
+			drmModeFreeConnector(existing->second.connector);
+		}
+
+		drm->connectors[kv.first] = kv.second;
+	}
+	probe->connectors.clear();
+
+	for (size_t i = 0; i < drm->crtcs.size(); i++) {
+		struct crtc *crtc = &drm->crtcs[i];
+		crtc->props = std::move(probe->crtcs[i].props);
+		crtc->initial_prop_values = std::move(probe->crtcs[i].values);
 
 		crtc->has_gamma_lut = (crtc->props.find( "GAMMA_LUT" ) != crtc->props.end());
 		if (!crtc->has_gamma_lut)
@@ -428,12 +581,70 @@ static bool refresh_state( drm_t *drm )
 
 	for (size_t i = 0; i < drm->planes.size(); i++) {
 		struct plane *plane = &drm->planes[i];
-		if (!get_object_properties(drm, plane->id, DRM_MODE_OBJECT_PLANE, plane->props, plane->initial_prop_values)) {
-			return false;
+		plane->props = std::move(probe->planes[i].props);
+		plane->initial_prop_values = std::move(probe->planes[i].values);
+	}
+}
+
+static const int k_nProbeMaxRetries = 4;
+static const std::chrono::milliseconds k_probeRetryDelay( 100 );
+
+static void probe_thread_run( struct drm_t *drm )
+{
+	pthread_setname_np( pthread_self(), "gamescope-probe" );
+
+	int nRetries = 0;
+	while ( true )
+	{
+		{
+			std::unique_lock< std::mutex > lock( drm->probe_lock );
+			drm->probe_cv.wait( lock, [drm] { return drm->probe_requested; } );
+			drm->probe_requested = false;
+		}
+
+		struct drm_probe_t *probe = probe_state( drm );
+
+		if ( probe == nullptr )
+		{
+			// Usually a connector that went away mid-probe. Nothing else is
+			// going to ask again until the next hotplug, so back off and retry,
+			// unless a newer request comes in first.
+			if ( nRetries >= k_nProbeMaxRetries )
+			{
+				drm_log.errorf( "Connector probe failed %d times, giving up until the next hotplug", nRetries + 1 );
+				nRetries = 0;
+				continue;
+			}
+
+			std::chrono::milliseconds delay = k_probeRetryDelay * ( 1 << nRetries );
+			nRetries++;
+			drm_log.errorf( "Connector probe failed, retrying in %lldms", (long long)delay.count() );
+
+			std::unique_lock< std::mutex > lock( drm->probe_lock );
+			drm->probe_cv.wait_for( lock, delay, [drm] { return drm->probe_requested; } );
+			drm->probe_requested = true;
+			continue;
 		}
+
+		nRetries = 0;
+
+		{
+			std::unique_lock< std::mutex > lock( drm->probe_lock );
+			// Nobody picked up the last one, this one is newer anyway
+			delete drm->probe_result;
+			drm->probe_result = probe;
+		}
+
+		drm->probe_ready = true;
+		nudge_steamcompmgr();
 	}
+}
 
-	return true;
+void drm_request_probe( struct drm_t *drm )
+{
+	std::unique_lock< std::mutex > lock( drm->probe_lock );
+	drm->probe_requested = true;
+	drm->probe_cv.notify_one();
 }
 
 static bool get_resources(struct drm_t *drm)
@@ -478,8 +689,12 @@ static bool get_resources(struct drm_t *drm)
 
 	drmModeFreePlaneResources(plane_resources);
 
-	if (!refresh_state(drm))
+	// Nothing to keep painting on yet, so just wait for it
+	struct drm_probe_t *probe = probe_state(drm);
+	if (probe == nullptr)
 		return false;
+	apply_probe(drm, probe);
+	delete probe;
 
 	for (size_t i = 0; i < drm->crtcs.size(); i++) {
 		struct crtc *crtc = &drm->crtcs[i];
@@ -684,6 +899,11 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh)
 		drm->allow_modifiers = true;
 	}
 
+	if (drmGetCap(drm->fd, DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap) == 0 && cap != 0) {
+		drm->supports_async_flips = true;
+	}
+	drm_log.infof("async page flips %s", drm->supports_async_flips ? "supported" : "unsupported");
+
 	if (!get_resources(drm)) {
 		return false;
 	}
@@ -730,9 +950,18 @@ bool init_drm(struct drm_t *drm, int width, int height, int refresh)
 
 	drm->kms_in_fence_fd = -1;
 
+	drm->flip_event_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	if ( drm->flip_event_fd < 0 ) {
+		drm_log.errorf_errno( "eventfd failed" );
+		return false;
+	}
+
 	std::thread flip_handler_thread( flip_handler_thread_run );
 	flip_handler_thread.detach();
 
+	std::thread probe_thread( probe_thread_run, drm );
+	probe_thread.detach();
+
 	if (g_bUseLayers) {
 		liftoff_log_set_priority(g_bDebugLayers ? LIFTOFF_DEBUG : LIFTOFF_ERROR);
 	}
@@ -843,21 +1072,32 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 // 	add_crtc_property(req, drm->crtc_id, "OUT_FENCE_PTR",
 // 					  (uint64_t)(unsigned long)&drm->kms_out_fence_fd);
 
-	drm->flip_lock.lock();
+	// Only one flip in flight at a time
+	drm_wait_for_flip( drm );
 
 	// Do it before the commit, as otherwise the pageflip handler could
 	// potentially beat us to the refcount checks.
+	assert( drm->fbids_in_req.size() <= drm->fbs_queued.size() );
+	drm->fbs_queued_count = 0;
 	for ( uint32_t i = 0; i < drm->fbids_in_req.size(); i++ )
 	{
 		struct fb &fb = get_fb( g_DRM, drm->fbids_in_req[ i ] );
 		assert( fb.held_refs );
-		fb.n_refs++;
+		fb.state++;
+		drm->fbs_queued[ drm->fbs_queued_count++ ] = &fb;
 	}
+	drm->fbs_queued_async = ( drm->flags & DRM_MODE_PAGE_FLIP_ASYNC ) != 0;
 
-	assert( drm->fbids_queued.size() == 0 );
-	drm->fbids_queued = drm->fbids_in_req;
+	assert( drm->feedbacks_queued.size() == 0 );
+	drm->feedbacks_queued.swap( drm->feedbacks_in_req );
+	drm->feedback_flags_queued = WLSERVER_PRESENTATION_HW_CLOCK | WLSERVER_PRESENTATION_HW_COMPLETION;
+	if ( !( drm->flags & DRM_MODE_PAGE_FLIP_ASYNC ) )
+		drm->feedback_flags_queued |= WLSERVER_PRESENTATION_VSYNC;
+	if ( drm->zero_copy_in_req )
+		drm->feedback_flags_queued |= WLSERVER_PRESENTATION_ZERO_COPY;
 
 	g_DRM.flipcount++;
+	drm->flip_pending = true;
 
 	drm_verbose_log.debugf("flip commit %" PRIu64, (uint64_t)g_DRM.flipcount);
 	gpuvis_trace_printf( "flip commit %" PRIu64, (uint64_t)g_DRM.flipcount );
@@ -870,10 +1110,11 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 		if ( ret != -EBUSY && ret != -EACCES )
 		{
 			drm_log.errorf( "fatal flip error, aborting" );
-			drm->flip_lock.unlock();
 			abort();
 		}
 
+		drm->flip_pending = false;
+
 		drm->pending = drm->current;
 
 		for ( size_t i = 0; i < drm->crtcs.size(); i++ )
@@ -882,16 +1123,24 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 		}
 
 		// Undo refcount if the commit didn't actually work
-		for ( uint32_t i = 0; i < drm->fbids_in_req.size(); i++ )
-		{
-			get_fb( g_DRM, drm->fbids_in_req[ i ] ).n_refs--;
-		}
+		for ( uint32_t i = 0; i < drm->fbs_queued_count; i++ )
+			drm_release_fb_ref( drm, drm->fbs_queued[ i ] );
 
-		drm->fbids_queued.clear();
+		drm->fbs_queued_count = 0;
+
+		std::vector< struct wlr_presentation_feedback * > feedbacks;
+		feedbacks.swap( drm->feedbacks_queued );
 
 		g_DRM.flipcount--;
 
-		drm->flip_lock.unlock();
+		// These frames will never be seen
+		if ( !feedbacks.empty() )
+		{
+			wlserver_lock();
+			for ( struct wlr_presentation_feedback *feedback : feedbacks )
+				wlserver_presentation_feedback_discard( feedback );
+			wlserver_unlock();
+		}
 
 		goto out;
 	} else {
@@ -918,10 +1167,6 @@ int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 	// not when it is successfully queued.
 	g_uVblankDrawTimeNS = get_time_in_nanos() - g_SteamCompMgrVBlankTime;
 
-	// Wait for flip handler to unlock
-	drm->flip_lock.lock();
-	drm->flip_lock.unlock();
-
 // 	if (drm->kms_in_fence_fd != -1) {
 // 		close(drm->kms_in_fence_fd);
 // 		drm->kms_in_fence_fd = -1;
@@ -936,6 +1181,66 @@ out:
 	return ret;
 }
 
+void drm_wait_for_flip( struct drm_t *drm )
+{
+	while ( drm->flip_pending )
+	{
+		struct pollfd pollfd = {
+			.fd = drm->flip_event_fd,
+			.events = POLLIN,
+		};
+
+		if ( poll( &pollfd, 1, -1 ) < 0 && errno != EINTR )
+		{
+			drm_log.errorf_errno( "polling for flip completion failed" );
+			break;
+		}
+
+		// Consumes the event, a stale one can't keep us spinning
+		if ( pollfd.revents & POLLIN )
+			drm_dispatch_flip_events( drm );
+	}
+
+	drm_dispatch_flip_events( drm );
+}
+
+void drm_dispatch_flip_events( struct drm_t *drm )
+{
+	uint64_t count;
+	if ( read( drm->flip_event_fd, &count, sizeof( count ) ) < 0 && errno != EAGAIN )
+		drm_log.errorf_errno( "failed to read flip completion" );
+
+	struct fb *fb = drm->deferred_fbs.exchange( nullptr );
+	while ( fb != nullptr )
+	{
+		// Might be gone after running its actions
+		struct fb *next = fb->next_deferred;
+		drm_run_deferred( drm, fb );
+		fb = next;
+	}
+
+	if ( drm->flip_pending || drm->feedbacks_queued.empty() )
+		return;
+
+	std::vector< struct wlr_presentation_feedback * > feedbacks;
+	feedbacks.swap( drm->feedbacks_queued );
+
+	uint32_t refresh = g_nOutputRefresh > 0 ? 1'000'000'000u / g_nOutputRefresh : 0;
+
+	wlserver_lock();
+	wlserver_presentation_feedback_presented( feedbacks, drm->flip_vblank_time, drm->flip_sequence, refresh, drm->feedback_flags_queued );
+	wlserver_unlock();
+}
+
+/* Hands over the feedback of the surfaces shown by the next drm_commit, to be
+ * sent once the flip completes */
+void drm_set_presentation_feedback( struct drm_t *drm, std::vector< struct wlr_presentation_feedback * > feedbacks, bool zero_copy )
+{
+	assert( drm->feedbacks_in_req.empty() );
+	drm->feedbacks_in_req = std::move( feedbacks );
+	drm->zero_copy_in_req = zero_copy;
+}
+
 uint32_t drm_fbid_from_dmabuf( struct drm_t *drm, struct wlr_buffer *buf, struct wlr_dmabuf_attributes *dma_buf )
 {
 	uint32_t fb_id = 0;
@@ -992,7 +1297,8 @@ uint32_t drm_fbid_from_dmabuf( struct drm_t *drm, struct wlr_buffer *buf, struct
 		fb.buf = buf;
 		if (!buf)
 			fb.held_refs++;
-		fb.n_refs = 0;
+		fb.state = 0;
+		fb.next_deferred = nullptr;
 	}
 
 out:
@@ -1028,14 +1334,24 @@ void drm_drop_fbid( struct drm_t *drm, uint32_t fbid )
 
 	fb.held_refs = 0;
 
-	if ( fb.n_refs != 0 )
-	{
-		std::lock_guard<std::mutex> lock( drm->free_queue_lock );
-		drm->fbid_free_queue.push_back( fbid );
+	/* Still used by a page-flip, freed once it's done with it */
+	if ( fb.state.fetch_or( FB_DEFERRED_FREE ) != 0 )
 		return;
+
+	drm_run_deferred( drm, &fb );
+}
+
+static void drm_free_fb_internal( struct drm_t *drm, struct fb *fb )
+{
+	uint32_t fbid = fb->id;
+
+	// Forget it before KMS can hand out the same ID again
+	{
+		std::lock_guard<std::mutex> lock( drm->fb_map_mutex );
+		drm->fb_map.erase( fbid );
 	}
 
-	if (drmModeRmFB( drm->fd, fbid ) != 0 )
+	if ( drmModeRmFB( drm->fd, fbid ) != 0 )
 	{
 		drm_log.errorf_errno( "drmModeRmFB failed" );
 	}
@@ -1044,7 +1360,7 @@ void drm_drop_fbid( struct drm_t *drm, uint32_t fbid )
 static void drm_unlock_fb_internal( struct drm_t *drm, struct fb *fb )
 {
 	assert( fb->held_refs == 0 );
-	assert( fb->n_refs == 0 );
+	assert( ( fb->state & FB_REFS_MASK ) == 0 );
 
 	if ( fb->buf != nullptr )
 	{
@@ -1057,10 +1373,15 @@ static void drm_unlock_fb_internal( struct drm_t *drm, struct fb *fb )
 void drm_lock_fbid( struct drm_t *drm, uint32_t fbid )
 {
 	struct fb &fb = get_fb( *drm, fbid );
-	assert( fb.n_refs == 0 );
 
 	if ( fb.held_refs++ == 0 )
 	{
+		/* Unlocked while a page-flip still used it, and the deferred unlock
+		 * hasn't run yet: take that back, the buffer is still locked. If the
+		 * FB already sits on deferred_fbs, it'll find nothing left to do. */
+		if ( fb.state.fetch_and( ~FB_DEFERRED_UNLOCK ) & FB_DEFERRED_UNLOCK )
+			return;
+
 		if ( fb.buf != nullptr )
 		{
 			wlserver_lock();
@@ -1078,16 +1399,13 @@ void drm_unlock_fbid( struct drm_t *drm, uint32_t fbid )
 	if ( --fb.held_refs != 0 )
 		return;
 
-	if ( fb.n_refs != 0 )
-	{
-		std::lock_guard<std::mutex> lock( drm->free_queue_lock );
-		drm->fbid_unlock_queue.push_back( fbid );
+	/* Still used by a page-flip, unlocked once it's done with it */
+	if ( fb.state.fetch_or( FB_DEFERRED_UNLOCK ) != 0 )
 		return;
-	}
 
 	/* FB isn't being used in any page-flip, free it immediately */
 	drm_verbose_log.debugf("free fbid %u", fbid);
-	drm_unlock_fb_internal( drm, &fb );
+	drm_run_deferred( drm, &fb );
 }
 
 /* Prepares an atomic commit without using libliftoff */
@@ -1118,26 +1436,28 @@ drm_prepare_basic( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 
 	add_plane_property(req, drm->primary, "FB_ID", fb_id);
 	add_plane_property(req, drm->primary, "CRTC_ID", drm->crtc->id);
-	add_plane_property(req, drm->primary, "SRC_X", 0);
-	add_plane_property(req, drm->primary, "SRC_Y", 0);
-
-	const uint16_t srcWidth = frameInfo->layers[ 0 ].tex->width();
-	const uint16_t srcHeight = frameInfo->layers[ 0 ].tex->height();
+	const vec2_t srcOffset = frameInfo->layers[ 0 ].srcOffset;
+	const float srcWidth = frameInfo->layers[ 0 ].srcWidth();
+	const float srcHeight = frameInfo->layers[ 0 ].srcHeight();
 
-	add_plane_property(req, drm->primary, "SRC_W", srcWidth << 16);
-	add_plane_property(req, drm->primary, "SRC_H", srcHeight << 16);
+	// 16.16 fixed point
+	add_plane_property(req, drm->primary, "SRC_X", uint64_t( srcOffset.x * 65536.0 ));
+	add_plane_property(req, drm->primary, "SRC_Y", uint64_t( srcOffset.y * 65536.0 ));
+	add_plane_property(req, drm->primary, "SRC_W", uint64_t( srcWidth * 65536.0 ));
+	add_plane_property(req, drm->primary, "SRC_H", uint64_t( srcHeight * 65536.0 ));
 
-	gpuvis_trace_printf ( "legacy flip fb_id %u src %ix%i", fb_id,
+	gpuvis_trace_printf ( "legacy flip fb_id %u src %.1fx%.1f", fb_id,
 						 srcWidth, srcHeight );
 
-	int64_t crtcX = frameInfo->layers[ 0 ].offset.x * -1;
-	int64_t crtcY = frameInfo->layers[ 0 ].offset.y * -1;
+	int64_t crtcX = ( srcOffset.x / frameInfo->layers[ 0 ].scale.x ) - frameInfo->layers[ 0 ].offset.x;
+	int64_t crtcY = ( srcOffset.y / frameInfo->layers[ 0 ].scale.y ) - frameInfo->layers[ 0 ].offset.y;
 	int64_t crtcW = srcWidth / frameInfo->layers[ 0 ].scale.x;
 	int64_t crtcH = srcHeight / frameInfo->layers[ 0 ].scale.y;
 
 	if ( g_bRotated )
 	{
-		int64_t imageH = frameInfo->layers[ 0 ].tex->contentHeight() / frameInfo->layers[ 0 ].scale.y;
+		float contentHeight = frameInfo->layers[ 0 ].srcSize.y ? srcHeight : frameInfo->layers[ 0 ].tex->contentHeight();
+		int64_t imageH = contentHeight / frameInfo->layers[ 0 ].scale.y;
 
 		int64_t tmp = crtcX;
 		crtcX = g_nOutputHeight - imageH - crtcY;
@@ -1157,7 +1477,7 @@ drm_prepare_basic( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 
 	// TODO: disable all planes except drm->primary
 
-	unsigned test_flags = (drm->flags & DRM_MODE_ATOMIC_ALLOW_MODESET) | DRM_MODE_ATOMIC_TEST_ONLY;
+	unsigned test_flags = (drm->flags & (DRM_MODE_ATOMIC_ALLOW_MODESET | DRM_MODE_PAGE_FLIP_ASYNC)) | DRM_MODE_ATOMIC_TEST_ONLY;
 	int ret = drmModeAtomicCommit( drm->fd, drm->req, test_flags, NULL );
 
 	if ( ret != 0 && ret != -EINVAL && ret != -ERANGE ) {
@@ -1211,6 +1531,13 @@ static drm_color_range drm_get_color_range(EStreamColorspace colorspace)
 static int
 drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 {
+	// Only the dynamic blit goes past this, we have no more liftoff layers
+	if ( frameInfo->layerCount > k_nMaxLayers )
+	{
+		drm_verbose_log.debugf( "can NOT drm present %i layers", frameInfo->layerCount );
+		return -EINVAL;
+	}
+
 	for ( int i = 0; i < k_nMaxLayers; i++ )
 	{
 		if ( i < frameInfo->layerCount )
@@ -1227,21 +1554,24 @@ drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 			liftoff_layer_set_property( drm->lo_layers[ i ], "zpos", frameInfo->layers[ i ].zpos );
 			liftoff_layer_set_property( drm->lo_layers[ i ], "alpha", frameInfo->layers[ i ].opacity * 0xffff);
 
-			const uint16_t srcWidth = frameInfo->layers[ i ].tex->width();
-			const uint16_t srcHeight = frameInfo->layers[ i ].tex->height();
+			const vec2_t srcOffset = frameInfo->layers[ i ].srcOffset;
+			const float srcWidth = frameInfo->layers[ i ].srcWidth();
+			const float srcHeight = frameInfo->layers[ i ].srcHeight();
 
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_X", 0);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_Y", 0);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_W", srcWidth << 16);
-			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_H", srcHeight << 16);
+			// 16.16 fixed point
+			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_X", uint64_t( srcOffset.x * 65536.0 ));
+			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_Y", uint64_t( srcOffset.y * 65536.0 ));
+			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_W", uint64_t( srcWidth * 65536.0 ));
+			liftoff_layer_set_property( drm->lo_layers[ i ], "SRC_H", uint64_t( srcHeight * 65536.0 ));
 
-			int32_t crtcX = -frameInfo->layers[ i ].offset.x;
-			int32_t crtcY = -frameInfo->layers[ i ].offset.y;
+			int32_t crtcX = ( srcOffset.x / frameInfo->layers[ i ].scale.x ) - frameInfo->layers[ i ].offset.x;
+			int32_t crtcY = ( srcOffset.y / frameInfo->layers[ i ].scale.y ) - frameInfo->layers[ i ].offset.y;
 			uint64_t crtcW = srcWidth / frameInfo->layers[ i ].scale.x;
 			uint64_t crtcH = srcHeight / frameInfo->layers[ i ].scale.y;
 
 			if (g_bRotated) {
-				int64_t imageH = frameInfo->layers[ i ].tex->contentHeight() / frameInfo->layers[ i ].scale.y;
+				float contentHeight = frameInfo->layers[ i ].srcSize.y ? srcHeight : frameInfo->layers[ i ].tex->contentHeight();
+				int64_t imageH = contentHeight / frameInfo->layers[ i ].scale.y;
 
 				const int32_t x = crtcX;
 				const uint64_t w = crtcW;
@@ -1286,8 +1616,10 @@ drm_prepare_liftoff( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 }
 
 /* Prepares an atomic commit for the provided scene-graph. Returns false on
- * error or if the scene-graph can't be presented directly. */
-int drm_prepare( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
+ * error or if the scene-graph can't be presented directly.
+ * If async is set, the flip is done immediately without waiting for vblank
+ * (tearing). Callers should retry with a synchronous flip if that fails. */
+int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo )
 {
 	drm_update_gamma_lut(drm);
 	drm_update_degamma_lut(drm);
@@ -1305,6 +1637,16 @@ int drm_prepare( struct drm_t *drm, const struct FrameInfo_t *frameInfo )
 	// We do internal refcounting with these events
 	flags |= DRM_MODE_PAGE_FLIP_EVENT;
 
+	// Async flips can only change FB_ID, so anything touching the CRTC has to
+	// go through a regular flip.
+	bool crtc_dirty = needs_modeset ||
+		drm->pending.gamma_lut_id != drm->current.gamma_lut_id ||
+		drm->pending.degamma_lut_id != drm->current.degamma_lut_id ||
+		drm->pending.ctm_id != drm->current.ctm_id;
+
+	if ( async && !crtc_dirty && drm->supports_async_flips )
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
 	if ( needs_modeset ) {
 		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
 
@@ -1428,11 +1770,22 @@ void drm_rollback( struct drm_t *drm )
 
 bool drm_poll_state( struct drm_t *drm )
 {
-	bool out_of_date = drm->out_of_date.exchange(false);
-	if ( !out_of_date )
+	bool probe_ready = drm->probe_ready.exchange(false);
+	if ( !probe_ready )
+		return false;
+
+	struct drm_probe_t *probe;
+	{
+		std::unique_lock< std::mutex > lock( drm->probe_lock );
+		probe = drm->probe_result;
+		drm->probe_result = nullptr;
+	}
+
+	if ( probe == nullptr )
 		return false;
 
-	refresh_state( drm );
+	apply_probe( drm, probe );
+	delete probe;
 
 	setup_best_connector(drm);
 
@@ -1826,54 +2179,6 @@ bool drm_set_mode( struct drm_t *drm, const drmModeModeInfo *mode )
 	return true;
 }
 
-#define EDID_ID(a, b, c) (((a & 0x1f) << 10) | ((b & 0x1f) << 5) | (c & 0x1f))
-
-struct edid_data_t
-{
-	uint16_t make;
-	char model[16];
-	char serial[16];
-};
-
-// from wlroots... mostly
-void parse_edid(edid_data_t *output, const uint8_t *data, size_t len) {
-	if (!data || len < 128) {
-		output->make = 0;
-		snprintf(output->model, sizeof(output->model), "<Unknown>");
-		return;
-	}
-
-	output->make = (data[8] << 8) | data[9];
-
-	uint16_t model = data[10] | (data[11] << 8);
-	snprintf(output->model, sizeof(output->model), "0x%04X", model);
-
-	uint32_t serial = data[12] | (data[13] << 8) | (data[14] << 8) | (data[15] << 8);
-	snprintf(output->serial, sizeof(output->serial), "0x%08X", serial);
-
-	for (size_t i = 72; i <= 108; i += 18) {
-		uint16_t flag = (data[i] << 8) | data[i + 1];
-		if (flag == 0 && data[i + 3] == 0xFC) {
-			sprintf(output->model, "%.13s", &data[i + 5]);
-
-			// Monitor names are terminated by newline if they're too short
-			char *nl = strchr(output->model, '\n');
-			if (nl) {
-				*nl = '\0';
-			}
-		} else if (flag == 0 && data[i + 3] == 0xFF) {
-			sprintf(output->serial, "%.13s", &data[i + 5]);
-
-			// Monitor serial numbers are terminated by newline if they're too
-			// short
-			char *nl = strchr(output->serial, '\n');
-			if (nl) {
-				*nl = '\0';
-			}
-		}
-	}
-}
-
 bool drm_set_refresh( struct drm_t *drm, int refresh )
 {
 	int width = g_nOutputWidth;
@@ -1901,32 +2206,8 @@ bool drm_set_refresh( struct drm_t *drm, int refresh )
 			break;
 		case DRM_MODE_GENERATE_FIXED:
 			{
-				bool is_steam_deck_display = false;
-				if ( drm->connector->props.find( "EDID" ) != drm->connector->props.end() )
-				{
-					uint64_t blob_id = drm->connector->initial_prop_values["EDID"];
-
-					drmModePropertyBlobRes *blob = drmModeGetPropertyBlob(drm->fd, blob_id);
-					if (blob) {
-						edid_data_t edid_data = {};
-						parse_edid( &edid_data, (const unsigned char *)blob->data, blob->length );
-
-						is_steam_deck_display = 
-							( edid_data.make == EDID_ID( 'W', 'L', 'C' ) && !strncmp( edid_data.model, "ANX7530 U", sizeof( edid_data.model ) ) ) ||
-							( edid_data.make == EDID_ID( 'A', 'N', 'X' ) && !strncmp( edid_data.model, "ANX7530 U", sizeof( edid_data.model ) ) ) ||
-							( edid_data.make == EDID_ID( 'V', 'L', 'V' ) && !strncmp( edid_data.model, "ANX7530 U", sizeof( edid_data.model ) ) ) ||
-							( edid_data.make == EDID_ID( 'V', 'L', 'V' ) && !strncmp( edid_data.model, "Jupiter", sizeof( edid_data.model ) ) );
-
-						drmModeFreePropertyBlob(blob);
-					}
-					else
-					{
-						drm_log.errorf_errno("drmModeGetPropertyBlob(EDID) failed");
-					}
-				}
-
 				const drmModeModeInfo *preferred_mode = find_mode(connector, 0, 0, 0);
-				generate_fixed_mode( &mode, preferred_mode, refresh, is_steam_deck_display );
+				generate_fixed_mode( &mode, preferred_mode, refresh, drm->connector->is_steam_deck_display );
 				break;
 			}
 		}
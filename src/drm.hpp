@@ -23,6 +23,11 @@ enum drm_color_range {
 	DRM_COLOR_RANGE_MAX,
 };
 
+// Only in newer kernel and libdrm headers
+#ifndef DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP
+#define DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP 0x15
+#endif
+
 #include <wayland-server-core.h>
 
 extern "C" {
@@ -35,7 +40,9 @@ extern "C" {
 
 #include <unordered_map>
 #include <utility>
+#include <array>
 #include <atomic>
+#include <condition_variable>
 #include <map>
 #include <mutex>
 #include <vector>
@@ -66,10 +73,13 @@ struct connector {
 	char *name;
 	drmModeConnector *connector;
 	uint32_t possible_crtcs;
+	bool is_steam_deck_display;
 	std::map<std::string, const drmModePropertyRes *> props;
 	std::map<std::string, uint64_t> initial_prop_values;
 };
 
+struct drm_probe_t;
+
 struct fb {
 	uint32_t id;
 	/* Client buffer, if any */
@@ -78,10 +88,18 @@ struct fb {
 	 * doesn't need to be atomic as it's only ever
 	 * modified/read from the steamcompmgr thread */
 	int held_refs;
-	/* Number of page-flips using the FB */
-	std::atomic< uint32_t > n_refs;
+	/* Number of page-flips using the FB in the low bits, FB_DEFERRED_*
+	 * actions to run once that drops to zero in the high bits. Changed
+	 * from any thread, so only ever as a whole with atomic ops. */
+	std::atomic< uint32_t > state;
+	/* Next in drm_t::deferred_fbs */
+	struct fb *next_deferred;
 };
 
+#define FB_REFS_MASK 0x00ffffffu
+#define FB_DEFERRED_UNLOCK 0x01000000u
+#define FB_DEFERRED_FREE 0x02000000u
+
 struct drm_t {
 	int fd;
 
@@ -89,6 +107,7 @@ struct drm_t {
 
 	uint64_t cursor_width, cursor_height;
 	bool allow_modifiers;
+	bool supports_async_flips;
 	struct wlr_drm_format_set formats;
 
 	std::vector< struct plane > planes;
@@ -96,6 +115,7 @@ struct drm_t {
 	std::map< uint32_t, struct connector > connectors;
 
 	std::map< uint32_t, drmModePropertyRes * > props;
+	std::mutex props_lock;
 	
 	struct plane *primary;
 	struct crtc *crtc;
@@ -133,26 +153,50 @@ struct drm_t {
 
 	/* FBs in the atomic request, but not yet submitted to KMS */
 	std::vector < uint32_t > fbids_in_req;
-	/* FBs submitted to KMS, but not yet displayed on screen */
-	std::vector < uint32_t > fbids_queued;
-	/* FBs currently on screen */
-	std::vector < uint32_t > fbids_on_screen;
-	
+	/* FBs submitted to KMS, but not yet displayed on screen, then FBs
+	 * currently on screen. Owned by the flip handler while flip_pending is
+	 * set, fixed size so it never has to allocate. */
+	std::array < struct fb *, k_nMaxLayers > fbs_queued;
+	uint32_t fbs_queued_count;
+	/* Whether the flip in flight is async, flags moves on with the next
+	 * prepare before it completes. */
+	bool fbs_queued_async;
+	std::array < struct fb *, k_nMaxLayers > fbs_on_screen;
+	uint32_t fbs_on_screen_count;
+
+	/* Presentation feedback for what's in the request, then for the flip in flight */
+	std::vector < struct wlr_presentation_feedback * > feedbacks_in_req;
+	std::vector < struct wlr_presentation_feedback * > feedbacks_queued;
+	bool zero_copy_in_req;
+	uint32_t feedback_flags_queued;
+
+	/* Set from the commit until the flip handler is done with the flip,
+	 * flip_event_fd is signalled when it gets cleared. The vblank time and
+	 * sequence of the flip are only valid after. */
+	std::atomic < bool > flip_pending;
+	int flip_event_fd;
+	uint64_t flip_vblank_time;
+	unsigned int flip_sequence;
+
+	/* FBs with deferred actions that the last page-flip using them let go
+	 * of, run by drm_dispatch_flip_events */
+	std::atomic < struct fb * > deferred_fbs;
+
 	std::unordered_map< uint32_t, struct fb > fb_map;
 	std::mutex fb_map_mutex;
-	
-	std::mutex free_queue_lock;
-	std::vector< uint32_t > fbid_unlock_queue;
-	std::vector< uint32_t > fbid_free_queue;
-	
-	std::mutex flip_lock;
-	
+
 	std::atomic < uint64_t > flipcount;
 
 	std::atomic < bool > paused;
-	std::atomic < bool > out_of_date;
 	std::atomic < bool > needs_modeset;
 
+	/* Connectors are probed on their own thread, the result is picked up by drm_poll_state */
+	std::mutex probe_lock;
+	std::condition_variable probe_cv;
+	bool probe_requested;
+	struct drm_probe_t *probe_result;
+	std::atomic < bool > probe_ready;
+
 	std::unordered_map< std::string, int > connector_priorities;
 };
 
@@ -176,8 +220,15 @@ extern enum drm_mode_generation g_drmModeGeneration;
 bool init_drm(struct drm_t *drm, int width, int height, int refresh);
 void finish_drm(struct drm_t *drm);
 int drm_commit(struct drm_t *drm, const struct FrameInfo_t *frameInfo );
-int drm_prepare( struct drm_t *drm, const struct FrameInfo_t *frameInfo );
+/* Blocks until KMS is done with the last commit, e.g. before drawing into an
+ * image it might still be scanning out */
+void drm_wait_for_flip( struct drm_t *drm );
+/* Handles completed flips, when flip_event_fd is readable */
+void drm_dispatch_flip_events( struct drm_t *drm );
+void drm_set_presentation_feedback( struct drm_t *drm, std::vector< struct wlr_presentation_feedback * > feedbacks, bool zero_copy );
+int drm_prepare( struct drm_t *drm, bool async, const struct FrameInfo_t *frameInfo );
 void drm_rollback( struct drm_t *drm );
+void drm_request_probe(struct drm_t *drm);
 bool drm_poll_state(struct drm_t *drm);
 uint32_t drm_fbid_from_dmabuf( struct drm_t *drm, struct wlr_buffer *buf, struct wlr_dmabuf_attributes *dma_buf );
 void drm_lock_fbid( struct drm_t *drm, uint32_t fbid );
@@ -0,0 +1,195 @@
+// Even out the cadence of games running at a steady rate below refresh
+//
+// A game running at 40fps on a 60Hz panel should alternate between frames
+// held for 2 and 1 vblanks. Without help, whether a frame makes a given vblank
+// depends on exactly when it finished, so frame time jitter near a vblank
+// boundary turns that into runs like 2,2,1,1 or a 3, which read as judder.
+// We keep a smoothed timeline of when the app's frames should be ready and
+// only let a frame out once that timeline, plus a small jitter margin, says
+// it's due. Frames then land on vblanks picked by the steady timeline rather
+// than by their individual finish times, at the cost of that margin in latency.
+
+#include <cmath>
+#include <algorithm>
+
+#include "framepacing.hpp"
+#include "main.hpp"
+#include "log.hpp"
+
+#include "gpuvis_trace_utils.h"
+
+static LogScope pacing_log("framepacing");
+
+bool g_bFramePacing = false;
+
+// Weight of a new sample in the app frame time and jitter averages
+static const double k_flSmoothing = 0.1;
+// Gaps longer than this are stalls (loading, focus changes), not a frame rate
+static const uint64_t k_ulMaxFrameInterval = 250'000'000;
+// Only pace apps well below refresh, closer to it the odd 2-vblank frame
+// can't be placed any better than where it naturally lands...
+static const double k_flMinIntervalRatio = 1.4;
+// ...and steady enough for a fixed cadence to make sense.
+static const double k_flMaxJitterRatio = 0.15;
+// How strongly the smoothed timeline is pulled towards actual frame times
+static const double k_flPhaseGain = 0.05;
+// Margin added to the smoothed timeline, in units of measured jitter
+static const double k_flJitterMargin = 2.0;
+// How quickly past cadence errors are forgotten, per presented frame
+static const double k_flTimelineDecay = 0.9;
+// Cadence error, in refresh intervals, past which a frame counts as judder
+static const double k_flJudderThreshold = 0.75;
+
+static uint64_t s_ulLastFrameReady = 0;
+static double s_flAppInterval = 0.0;
+static double s_flAppJitter = 0.0;
+static double s_flTimeline = 0.0;
+static uint64_t s_ulPendingDue = 0;
+
+static uint64_t s_ulLastPresent = 0;
+static double s_flTimelineError = 0.0;
+static double s_flPacingErrorSum = 0.0;
+static uint32_t s_uJudderFrames = 0;
+static uint32_t s_uPresentedFrames = 0;
+
+static double refresh_interval( void )
+{
+	const int refresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+	if ( refresh <= 0 )
+		return 0.0;
+	return 1'000'000'000.0 / refresh;
+}
+
+void framepacing_frame_ready( uint64_t now )
+{
+	if ( s_ulLastFrameReady != 0 )
+	{
+		uint64_t interval = now - s_ulLastFrameReady;
+		if ( interval < k_ulMaxFrameInterval )
+		{
+			if ( s_flAppInterval == 0.0 )
+				s_flAppInterval = interval;
+
+			double deviation = std::fabs( interval - s_flAppInterval );
+			s_flAppInterval += ( interval - s_flAppInterval ) * k_flSmoothing;
+			s_flAppJitter += ( deviation - s_flAppJitter ) * k_flSmoothing;
+		}
+		else
+		{
+			framepacing_reset();
+		}
+	}
+
+	s_ulLastFrameReady = now;
+
+	if ( s_flTimeline == 0.0 || s_flAppInterval == 0.0 )
+	{
+		s_flTimeline = now;
+	}
+	else
+	{
+		double flPredicted = s_flTimeline + s_flAppInterval;
+		s_flTimeline = flPredicted + ( now - flPredicted ) * k_flPhaseGain;
+	}
+
+	double flMargin = std::min( s_flAppJitter * k_flJitterMargin, refresh_interval() / 2.0 );
+	s_ulPendingDue = uint64_t( s_flTimeline + flMargin );
+}
+
+bool framepacing_active( void )
+{
+	if ( !g_bFramePacing || s_flAppInterval == 0.0 )
+		return false;
+
+	double flRefreshInterval = refresh_interval();
+	if ( flRefreshInterval == 0.0 )
+		return false;
+
+	if ( s_flAppInterval < flRefreshInterval * k_flMinIntervalRatio )
+		return false;
+
+	if ( s_flAppJitter > s_flAppInterval * k_flMaxJitterRatio )
+		return false;
+
+	return true;
+}
+
+bool framepacing_should_present( uint64_t vblanktime, bool bFramePending )
+{
+	if ( !framepacing_active() )
+		return true;
+
+	if ( !bFramePending )
+		return false;
+
+	if ( vblanktime >= s_ulPendingDue )
+		return true;
+
+	// Never hold a frame for so long that the next one shows up before it
+	// got out, that would drop a frame and be far worse than the judder.
+	double flNextFrame = s_ulLastFrameReady + s_flAppInterval - s_flAppJitter * k_flJitterMargin;
+	if ( vblanktime + refresh_interval() >= flNextFrame )
+		return true;
+
+	gpuvis_trace_printf( "framepacing: holding early frame" );
+	return false;
+}
+
+void framepacing_mark_presented( uint64_t vblanktime )
+{
+	uint64_t lastPresent = s_ulLastPresent;
+	s_ulLastPresent = vblanktime;
+
+	double flRefreshInterval = refresh_interval();
+	if ( lastPresent == 0 || vblanktime <= lastPresent || s_flAppInterval == 0.0 || flRefreshInterval == 0.0 )
+		return;
+
+	uint64_t duration = vblanktime - lastPresent;
+	if ( duration >= k_ulMaxFrameInterval )
+	{
+		s_flTimelineError = 0.0;
+		return;
+	}
+
+	// How far presentation has drifted from the app's own steady timeline
+	// over the last few frames. An even N:M cadence keeps this within a
+	// fraction of a refresh; runs like 2,2,1,1 or a 3 push it past that.
+	s_flTimelineError = s_flTimelineError * k_flTimelineDecay + ( double( duration ) - s_flAppInterval );
+
+	if ( std::fabs( s_flTimelineError ) > flRefreshInterval * k_flJudderThreshold )
+	{
+		s_uJudderFrames++;
+		gpuvis_trace_printf( "framepacing: judder, %.2fms off cadence", s_flTimelineError / 1'000'000.0 );
+	}
+
+	s_flPacingErrorSum += std::fabs( s_flTimelineError );
+	s_uPresentedFrames++;
+}
+
+void framepacing_take_stats( FramePacingStats_t *pStats )
+{
+	pStats->flAppFrameTimeMS = s_flAppInterval / 1'000'000.0;
+	pStats->flPacingErrorMS = s_uPresentedFrames ? s_flPacingErrorSum / s_uPresentedFrames / 1'000'000.0 : 0.0;
+	pStats->uJudderFrames = s_uJudderFrames;
+	pStats->uPresentedFrames = s_uPresentedFrames;
+	pStats->bPacing = framepacing_active();
+
+	pacing_log.debugf( "app frametime %.2fms, pacing error %.2fms, %u/%u frames judder (%s)",
+		pStats->flAppFrameTimeMS, pStats->flPacingErrorMS, pStats->uJudderFrames, pStats->uPresentedFrames,
+		pStats->bPacing ? "paced" : "not paced" );
+
+	s_flPacingErrorSum = 0.0;
+	s_uJudderFrames = 0;
+	s_uPresentedFrames = 0;
+}
+
+void framepacing_reset( void )
+{
+	s_ulLastFrameReady = 0;
+	s_flAppInterval = 0.0;
+	s_flAppJitter = 0.0;
+	s_flTimeline = 0.0;
+	s_ulPendingDue = 0;
+	s_ulLastPresent = 0;
+	s_flTimelineError = 0.0;
+}
@@ -0,0 +1,37 @@
+// Even out the cadence of games running at a steady rate below refresh
+
+#pragma once
+
+#include <cstdint>
+
+struct FramePacingStats_t
+{
+	// Smoothed interval between frames of the focused app
+	float flAppFrameTimeMS;
+	// Mean distance of presented frames from the app's steady timeline
+	float flPacingErrorMS;
+	// Frames presented far enough off that timeline to be visible judder
+	uint32_t uJudderFrames;
+	uint32_t uPresentedFrames;
+	bool bPacing;
+};
+
+extern bool g_bFramePacing;
+
+// A new frame of the focused app is ready to be displayed.
+void framepacing_frame_ready( uint64_t now );
+
+// Whether the focused app is currently being paced.
+bool framepacing_active( void );
+
+// Whether a frame that is ready should go out on the vblank at vblanktime,
+// or be held back for a later one.
+bool framepacing_should_present( uint64_t vblanktime, bool bFramePending );
+
+// A new frame of the focused app was presented on the vblank at vblanktime.
+void framepacing_mark_presented( uint64_t vblanktime );
+
+// Fetch the metrics accumulated since the last call and reset them.
+void framepacing_take_stats( FramePacingStats_t *pStats );
+
+void framepacing_reset( void );
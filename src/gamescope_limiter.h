@@ -0,0 +1,48 @@
+// Shared memory page for game-side frame limiters
+//
+// When GAMESCOPE_LIMITER_FILE is set, steamcompmgr maps it and updates this
+// page every vblank. A layer in the game maps the same file and sleeps right
+// before queueing a present (or before sampling input) so its frame lands
+// just ahead of the vblank gamescope paints for, instead of gamescope holding
+// back frame callbacks.
+//
+// Reading: retry while seq is odd or changed across the read.
+// All times are CLOCK_MONOTONIC nanoseconds.
+
+#pragma once
+
+#include <stdint.h>
+
+#define GAMESCOPE_LIMITER_MAGIC 0x4d494c47 // "GLIM"
+#define GAMESCOPE_LIMITER_VERSION 1
+
+// How recently a layer has to have presented for gamescope to leave
+// limiting to it.
+#define GAMESCOPE_LIMITER_CLIENT_TIMEOUT_NS 500000000ull
+
+struct gamescope_limiter_page_t
+{
+	// First for layers that only read this flag. Non-zero when a frame
+	// limit applies to app_id.
+	uint32_t limiter_enabled;
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+
+	// Steam app ID of the focused window the limit applies to, 0 if none.
+	uint32_t app_id;
+	uint32_t target_fps;
+	// Present at most once per target_interval_ns, 0 if not limited.
+	uint64_t target_interval_ns;
+	uint64_t refresh_interval_ns;
+	// Predicted time of the next vblank.
+	uint64_t next_vblank_ns;
+	// A frame has to be ready this long before a vblank to be shown on it.
+	uint64_t present_margin_ns;
+
+	// Written by the layer, read by gamescope.
+	uint32_t client_app_id;
+	uint32_t client_pid;
+	// Last time the layer let a present through.
+	uint64_t client_present_ns;
+};
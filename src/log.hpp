@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdarg.h>
+
 #ifdef __GNUC__
 #define ATTRIB_PRINTF(start, end) __attribute__((format(printf, start, end)))
 #else
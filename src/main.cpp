@@ -43,6 +43,7 @@ const struct option *gamescope_options = (struct option[]){
 	{ "nearest-neighbor-filter", no_argument, nullptr, 'n' },
 	{ "fsr-upscaling", no_argument, nullptr, 'U' },
 	{ "nis-upscaling", no_argument, nullptr, 'Y' },
+	{ "sharp-upscaling", no_argument, nullptr, 0 },
 	{ "sharpness", required_argument, nullptr, 0 },
 	{ "fsr-sharpness", required_argument, nullptr, 0 },
 	{ "rt", no_argument, nullptr, 0 },
@@ -61,6 +62,7 @@ const struct option *gamescope_options = (struct option[]){
 
 	// wlserver options
 	{ "xwayland-count", required_argument, nullptr, 0 },
+	{ "expose-wayland", no_argument, nullptr, 0 },
 
 	// steamcompmgr options
 	{ "cursor", required_argument, nullptr, 0 },
@@ -75,8 +77,15 @@ const struct option *gamescope_options = (struct option[]){
 	{ "steam", no_argument, nullptr, 'e' },
 	{ "force-composition", no_argument, nullptr, 'c' },
 	{ "composite-debug", no_argument, nullptr, 0 },
+	{ "dynamic-composite", no_argument, nullptr, 0 },
 	{ "disable-xres", no_argument, nullptr, 'x' },
 	{ "fade-out-duration", required_argument, nullptr, 0 },
+	{ "frame-pacing", no_argument, nullptr, 0 },
+	{ "background-fps", required_argument, nullptr, 0 },
+	{ "steam-background-fps", required_argument, nullptr, 0 },
+	{ "app-profiles", required_argument, nullptr, 0 },
+	{ "commit-stats", no_argument, nullptr, 0 },
+	{ "metrics-socket", required_argument, nullptr, 0 },
 
 	{} // keep last
 };
@@ -96,14 +105,22 @@ const char usage[] =
 	"  -n, --nearest-neighbor-filter  use nearest neighbor filtering\n"
 	"  -U  --fsr-upscaling            use AMD FidelityFX™ Super Resolution 1.0 for upscaling\n"
 	"  -Y  --nis-upscaling            use NVIDIA Image Scaling v1.0.2 for upscaling\n"
+	"  --sharp-upscaling              use single-pass sharp bilinear for upscaling (low power)\n"
 	"  --sharpness --fsr-sharpness    upscaler sharpness from 0 (max) to 20 (min)\n"
 	"  --cursor                       path to default cursor image\n"
+	"  --frame-pacing                 even out frame cadence of games below refresh rate\n"
 	"  -R, --ready-fd                 notify FD when ready\n"
 	"  --rt                           Use realtime scheduling\n"
 	"  -T, --stats-path               write statistics to path\n"
 	"  -C, --hide-cursor-delay        hide cursor image after delay\n"
 	"  -e, --steam                    enable Steam integration\n"
 	" --xwayland-count                create N xwayland servers\n"
+	"  --background-fps               frame rate of games on Xwayland servers without focus, 0 pauses them\n"
+	"  --steam-background-fps         frame rate of the Steam client while a game has focus, 0 pauses it\n"
+	"  --app-profiles                 path to per-app settings, applied while the app has focus\n"
+	"  --commit-stats                 log client commit latency per stage and queue depths every second\n"
+	"  --metrics-socket               serve frame timing metrics in the Prometheus text format on a Unix socket\n"
+	"  --expose-wayland               let clients connect to gamescope as native Wayland clients\n"
 	"\n"
 	"Nested mode options:\n"
 	"  -o, --nested-unfocused-refresh game refresh rate when unfocused\n"
@@ -120,10 +137,11 @@ const char usage[] =
 	"  --debug-layers                 debug libliftoff\n"
 	"  --debug-focus                  debug XWM focus\n"
 	"  --synchronous-x11              force X11 connection synchronization\n"
-	"  --debug-hud                    paint HUD with debug info\n"
+	"  --debug-hud                    paint HUD with frame statistics, also toggled by GAMESCOPE_DEBUG_HUD\n"
 	"  --debug-events                 debug X11 events\n"
 	"  --force-composition            disable direct scan-out\n"
 	"  --composite-debug              draw frame markers on alternating corners of the screen when compositing\n"
+	"  --dynamic-composite            use one composite pipeline for any layer setup instead of specializing\n"
 	"  --disable-xres                 disable XRes for PID lookup\n"
 	"\n"
 	"Keyboard shortcuts:\n"
@@ -131,6 +149,7 @@ const char usage[] =
 	"  Super + N                      toggle nearest neighbour filtering\n"
 	"  Super + U                      toggle FSR upscaling\n"
 	"  Super + Y                      toggle NIS upscaling\n"
+	"  Super + K                      toggle sharp bilinear upscaling\n"
 	"  Super + I                      increase FSR sharpness by 1\n"
 	"  Super + O                      decrease FSR sharpness by 1\n"
 	"  Super + S                      take a screenshot\n"
@@ -158,6 +177,7 @@ int g_upscalerSharpness = 2;
 bool g_bBorderlessOutputWindow = false;
 
 int g_nXWaylandCount = 1;
+bool g_bExposeWayland = false;
 
 bool g_bNiceCap = false;
 int g_nOldNice = 0;
@@ -357,8 +377,12 @@ int main(int argc, char **argv)
 					g_bDebugLayers = true;
 				} else if (strcmp(opt_name, "xwayland-count") == 0) {
 					g_nXWaylandCount = atoi( optarg );
+				} else if (strcmp(opt_name, "expose-wayland") == 0) {
+					g_bExposeWayland = true;
 				} else if (strcmp(opt_name, "composite-debug") == 0) {
 					g_bIsCompositeDebug = true;
+				} else if (strcmp(opt_name, "dynamic-composite") == 0) {
+					g_bDynamicComposite = true;
 				} else if (strcmp(opt_name, "default-touch-mode") == 0) {
 					g_nDefaultTouchClickMode = (enum wlserver_touch_click_mode) atoi( optarg );
 					g_nTouchClickMode = g_nDefaultTouchClickMode;
@@ -367,6 +391,8 @@ int main(int argc, char **argv)
 				} else if (strcmp(opt_name, "sharpness") == 0 ||
 						   strcmp(opt_name, "fsr-sharpness") == 0) {
 					g_upscalerSharpness = atoi( optarg );
+				} else if (strcmp(opt_name, "sharp-upscaling") == 0) {
+					g_upscaler = GamescopeUpscaler::SHARP;
 				} else if (strcmp(opt_name, "rt") == 0) {
 					g_bRt = true;
 				}
@@ -537,6 +563,8 @@ int main(int argc, char **argv)
 		setenv("STEAM_GAME_DISPLAY_0", base_server->get_nested_display_name(), 1);
 	}
 	setenv("GAMESCOPE_WAYLAND_DISPLAY", wlserver_get_wl_display_name(), 1);
+	if ( g_bExposeWayland )
+		setenv("WAYLAND_DISPLAY", wlserver_get_wl_display_name(), 1);
 
 #if HAVE_PIPEWIRE
 	if ( !init_pipewire() )
@@ -26,7 +26,8 @@ enum class GamescopeUpscaler : uint32_t
 {
     BLIT = 0,
     FSR,
-    NIS
+    NIS,
+    SHARP
 };
 
 extern GamescopeUpscaler g_upscaler;
@@ -43,6 +44,7 @@ extern int g_nOldPolicy;
 extern struct sched_param g_schedOldParam;
 
 extern int g_nXWaylandCount;
+extern bool g_bExposeWayland;
 
 void restore_fd_limit( void );
 bool BIsNested( void );
@@ -0,0 +1,282 @@
+// Frame timing counters, served in the Prometheus text format
+//
+// Everything recorded on the paint and commit paths is a relaxed atomic
+// increment into fixed storage, so keeping metrics on costs nothing anyone
+// would measure. The text is only put together when something connects to
+// the socket: a raw client (socat) just reads it, an HTTP one (curl
+// --unix-socket, or a scraper behind a proxy) gets it as a response.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.hpp"
+#include "log.hpp"
+
+bool g_bMetrics = false;
+
+static LogScope metrics_log("metrics");
+
+// Bucket i counts durations up to 2^i microseconds, the last one the rest
+static const uint32_t k_unBuckets = 22;
+
+// Histograms sharing a name go next to each other and differ by label, like
+// the counters below
+struct HistogramInfo_t
+{
+	const char *pName;
+	const char *pLabels;
+	const char *pHelp;
+};
+
+static const HistogramInfo_t k_histograms[ METRIC_HISTOGRAM_COUNT ] =
+{
+	{ "gamescope_paint_seconds", nullptr, "Time from the vblank to the frame being ready." },
+	{ "gamescope_composite_seconds", "pipeline=\"specialized\"", "Time from composite submission to the GPU finishing it, by the pipeline of the last pass." },
+	{ "gamescope_composite_seconds", "pipeline=\"dynamic\"", nullptr },
+	{ "gamescope_commit_to_scanout_seconds", nullptr, "Time from a client commit to the first frame showing it going out." },
+};
+
+// Counters sharing a name go next to each other and differ by label
+struct CounterInfo_t
+{
+	const char *pName;
+	const char *pLabels;
+	const char *pHelp;
+};
+
+static const CounterInfo_t k_counters[ METRIC_COUNTER_COUNT ] =
+{
+	{ "gamescope_frames_total", "path=\"composite\"", "Frames painted, by whether they were composited or scanned out." },
+	{ "gamescope_frames_total", "path=\"scanout\"", nullptr },
+	{ "gamescope_missed_vblanks_total", nullptr, "Frames that were not ready by the vblank they were painted for." },
+	{ "gamescope_buffer_imports_total", "cache=\"miss\"", "Client buffers committed, by whether they had been imported before." },
+	{ "gamescope_buffer_imports_total", "cache=\"hit\"", nullptr },
+	{ "gamescope_cursor_textures_total", "cache=\"hit\"", "Cursor images shown, by whether their texture was cached." },
+	{ "gamescope_cursor_textures_total", "cache=\"miss\"", nullptr },
+};
+
+struct Histogram_t
+{
+	std::atomic<uint64_t> buckets[ k_unBuckets ];
+	std::atomic<uint64_t> ulSum;
+};
+
+static Histogram_t s_histograms[ METRIC_HISTOGRAM_COUNT ];
+static std::atomic<uint64_t> s_counters[ METRIC_COUNTER_COUNT ];
+static std::atomic<uint32_t> s_uPlanes;
+
+void metrics_observe( enum MetricHistogram histogram, uint64_t ulDuration )
+{
+	if ( !g_bMetrics )
+		return;
+
+	uint32_t unBucket = 0;
+	while ( unBucket < k_unBuckets - 1 && ulDuration > ( 1000ull << unBucket ) )
+		unBucket++;
+
+	s_histograms[ histogram ].buckets[ unBucket ].fetch_add( 1, std::memory_order_relaxed );
+	s_histograms[ histogram ].ulSum.fetch_add( ulDuration, std::memory_order_relaxed );
+}
+
+void metrics_count( enum MetricCounter counter )
+{
+	if ( !g_bMetrics )
+		return;
+
+	s_counters[ counter ].fetch_add( 1, std::memory_order_relaxed );
+}
+
+void metrics_set_planes( uint32_t uPlanes )
+{
+	if ( !g_bMetrics )
+		return;
+
+	s_uPlanes.store( uPlanes, std::memory_order_relaxed );
+}
+
+static void appendf( std::string &out, const char *format, ... ) ATTRIB_PRINTF(2, 3);
+
+static void appendf( std::string &out, const char *format, ... )
+{
+	char buf[ 256 ];
+
+	va_list args;
+	va_start( args, format );
+	int len = vsnprintf( buf, sizeof( buf ), format, args );
+	va_end( args );
+
+	if ( len > 0 )
+		out.append( buf, std::min<size_t>( len, sizeof( buf ) - 1 ) );
+}
+
+static std::string format_metrics( void )
+{
+	std::string out;
+
+	for ( uint32_t i = 0; i < METRIC_HISTOGRAM_COUNT; i++ )
+	{
+		const HistogramInfo_t &info = k_histograms[ i ];
+		if ( info.pHelp )
+			appendf( out, "# HELP %s %s\n# TYPE %s histogram\n", info.pName, info.pHelp, info.pName );
+
+		// Labels go ahead of le on the buckets, and alone on the totals
+		const char *pLabels = info.pLabels ? info.pLabels : "";
+		const char *pSep = info.pLabels ? "," : "";
+
+		// Buckets are cumulative in the exposition format
+		uint64_t ulCount = 0;
+		for ( uint32_t unBucket = 0; unBucket < k_unBuckets; unBucket++ )
+		{
+			ulCount += s_histograms[ i ].buckets[ unBucket ].load( std::memory_order_relaxed );
+			if ( unBucket < k_unBuckets - 1 )
+				appendf( out, "%s_bucket{%s%sle=\"%g\"} %llu\n", info.pName, pLabels, pSep, ( 1ull << unBucket ) / 1'000'000.0, (unsigned long long)ulCount );
+			else
+				appendf( out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", info.pName, pLabels, pSep, (unsigned long long)ulCount );
+		}
+
+		uint64_t ulSum = s_histograms[ i ].ulSum.load( std::memory_order_relaxed );
+		if ( info.pLabels )
+		{
+			appendf( out, "%s_sum{%s} %.9f\n", info.pName, pLabels, ulSum / 1'000'000'000.0 );
+			appendf( out, "%s_count{%s} %llu\n", info.pName, pLabels, (unsigned long long)ulCount );
+		}
+		else
+		{
+			appendf( out, "%s_sum %.9f\n", info.pName, ulSum / 1'000'000'000.0 );
+			appendf( out, "%s_count %llu\n", info.pName, (unsigned long long)ulCount );
+		}
+	}
+
+	for ( uint32_t i = 0; i < METRIC_COUNTER_COUNT; i++ )
+	{
+		const CounterInfo_t &info = k_counters[ i ];
+		if ( info.pHelp )
+			appendf( out, "# HELP %s %s\n# TYPE %s counter\n", info.pName, info.pHelp, info.pName );
+
+		unsigned long long ulValue = s_counters[ i ].load( std::memory_order_relaxed );
+		if ( info.pLabels )
+			appendf( out, "%s{%s} %llu\n", info.pName, info.pLabels, ulValue );
+		else
+			appendf( out, "%s %llu\n", info.pName, ulValue );
+	}
+
+	appendf( out, "# HELP gamescope_scanout_planes Planes used by the last frame that was scanned out.\n" );
+	appendf( out, "# TYPE gamescope_scanout_planes gauge\n" );
+	appendf( out, "gamescope_scanout_planes %u\n", s_uPlanes.load( std::memory_order_relaxed ) );
+
+	return out;
+}
+
+// HTTP clients send their request right away, anything that stays quiet for
+// a moment is taken to want the bare text.
+static bool client_wants_http( int fd )
+{
+	struct pollfd pollFd = { fd, POLLIN, 0 };
+	if ( poll( &pollFd, 1, 100 ) <= 0 )
+		return false;
+
+	char buf[ 1024 ];
+	ssize_t len = recv( fd, buf, sizeof( buf ), 0 );
+	return len >= 4 && memcmp( buf, "GET ", 4 ) == 0;
+}
+
+static void send_all( int fd, const std::string &data )
+{
+	size_t offset = 0;
+	while ( offset < data.size() )
+	{
+		ssize_t ret = send( fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL );
+		if ( ret < 0 && errno == EINTR )
+			continue;
+		if ( ret <= 0 )
+			return;
+		offset += ret;
+	}
+}
+
+static void metrics_thread_main( int listenFd )
+{
+	pthread_setname_np( pthread_self(), "gamescope-mtrc" );
+
+	while ( true )
+	{
+		int fd = accept4( listenFd, nullptr, nullptr, SOCK_CLOEXEC );
+		if ( fd < 0 )
+		{
+			if ( errno != EINTR && errno != ECONNABORTED )
+			{
+				metrics_log.errorf_errno( "accept failed" );
+				sleep( 1 );
+			}
+			continue;
+		}
+
+		bool bHttp = client_wants_http( fd );
+		std::string body = format_metrics();
+
+		if ( bHttp )
+		{
+			std::string header;
+			appendf( header, "HTTP/1.0 200 OK\r\n"
+				"Content-Type: text/plain; version=0.0.4\r\n"
+				"Content-Length: %zu\r\n"
+				"Connection: close\r\n\r\n", body.size() );
+			send_all( fd, header );
+		}
+		send_all( fd, body );
+
+		close( fd );
+	}
+}
+
+bool metrics_init( const char *path )
+{
+	struct sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if ( strlen( path ) >= sizeof( addr.sun_path ) )
+	{
+		metrics_log.errorf( "Socket path too long: %s", path );
+		return false;
+	}
+	strcpy( addr.sun_path, path );
+
+	// Left behind by a previous run, but don't clobber anything else
+	struct stat st;
+	if ( stat( path, &st ) == 0 && S_ISSOCK( st.st_mode ) )
+		unlink( path );
+
+	int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+	if ( fd < 0 )
+	{
+		metrics_log.errorf_errno( "socket failed" );
+		return false;
+	}
+
+	if ( bind( fd, (struct sockaddr *)&addr, sizeof( addr ) ) != 0 || listen( fd, 4 ) != 0 )
+	{
+		metrics_log.errorf_errno( "Failed to listen on %s", path );
+		close( fd );
+		return false;
+	}
+
+	g_bMetrics = true;
+
+	std::thread metricsThread( metrics_thread_main, fd );
+	metricsThread.detach();
+
+	metrics_log.infof( "Serving metrics on %s", path );
+	return true;
+}
@@ -0,0 +1,44 @@
+// Frame timing counters, served in the Prometheus text format
+
+#pragma once
+
+#include <cstdint>
+
+extern bool g_bMetrics;
+
+enum MetricHistogram
+{
+	// Time from the vblank we woke up for to the frame being ready
+	METRIC_PAINT_TIME,
+	// Composite submission until the GPU finished it, by whether the frame
+	// ended with a specialized pipeline or the dynamic blit
+	METRIC_COMPOSITE_TIME,
+	METRIC_COMPOSITE_TIME_DYNAMIC,
+	// Client commit to the first frame showing it going out
+	METRIC_COMMIT_TO_SCANOUT,
+
+	METRIC_HISTOGRAM_COUNT
+};
+
+enum MetricCounter
+{
+	METRIC_FRAMES_COMPOSITED,
+	METRIC_FRAMES_SCANOUT,
+	METRIC_MISSED_VBLANKS,
+	// Buffers imported for the first time, and ones we already had
+	METRIC_BUFFER_IMPORTS,
+	METRIC_BUFFER_IMPORT_CACHE_HITS,
+	METRIC_CURSOR_CACHE_HITS,
+	METRIC_CURSOR_CACHE_MISSES,
+
+	METRIC_COUNTER_COUNT
+};
+
+// Serve metrics on a Unix socket at path, one scrape per connection.
+bool metrics_init( const char *path );
+
+// All are safe from any thread and cheap when metrics are off.
+void metrics_observe( enum MetricHistogram histogram, uint64_t ulDuration );
+void metrics_count( enum MetricCounter counter );
+// Layers of the last frame that went out on planes without compositing
+void metrics_set_planes( uint32_t uPlanes );
@@ -0,0 +1,274 @@
+// Frame statistics drawn by gamescope itself, above everything else
+//
+// Seeing frame times used to need mangoapp running as an external overlay,
+// which brings its own commits and layer and usually forces composition.
+// Instead we keep a few counters and a ring of app frame times, rasterize
+// them with a tiny built-in font into a small image a few times a second,
+// and put that on screen as one more layer. It is flippable, so it can get
+// a plane of its own rather than making us composite.
+
+#include <cstdio>
+#include <cctype>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include "perfhud.hpp"
+#include "rendervulkan.hpp"
+#include "main.hpp"
+
+bool g_bPerfHud = false;
+
+static const uint32_t k_unHudWidth = 256;
+static const uint32_t k_unHudHeight = 96;
+
+// 3x5 glyphs, drawn at twice their size
+static const uint32_t k_unGlyphScale = 2;
+static const uint32_t k_unGlyphAdvance = 4 * k_unGlyphScale;
+static const uint32_t k_unLineHeight = 6 * k_unGlyphScale;
+static const uint32_t k_unTextLines = 4;
+static const uint32_t k_unMargin = 4;
+
+static const uint32_t k_unGraphTop = k_unMargin + k_unTextLines * k_unLineHeight + 2;
+static const uint32_t k_unGraphHeight = k_unHudHeight - k_unGraphTop - k_unMargin;
+// Frame time at the top of the graph
+static const uint64_t k_ulGraphMaxFrameTime = 50'000'000;
+static const uint32_t k_unBarWidth = 2;
+static const uint32_t k_unHistory = ( k_unHudWidth - 2 * k_unMargin ) / k_unBarWidth;
+
+// Redrawing and uploading every frame would cost more than it's worth
+static const uint64_t k_ulRedrawInterval = 100'000'000;
+// Gaps longer than this are stalls, not frame times
+static const uint64_t k_ulMaxAppFrameTime = 1'000'000'000;
+
+static const uint32_t k_unColorBackground = 0xc0000000;
+static const uint32_t k_unColorText = 0xffffffff;
+static const uint32_t k_unColorBar = 0xff40e040;
+static const uint32_t k_unColorSlowBar = 0xffff4040;
+static const uint32_t k_unColorRefreshLine = 0xff808080;
+
+// Rows top to bottom, 3 bits each with the leftmost pixel highest, from ' ' to 'Z'
+static const uint16_t k_glyphs[] = {
+	0,                  // ' '
+	0b010010010000010,  // !
+	0, 0, 0,
+	0b101001010100101,  // %
+	0, 0, 0, 0, 0, 0, 0,
+	0b000000111000000,  // -
+	0b000000000000010,  // .
+	0b001001010100100,  // /
+	0b111101101101111,  // 0
+	0b010110010010111,  // 1
+	0b110001010100111,  // 2
+	0b110001010001110,  // 3
+	0b101101111001001,  // 4
+	0b111100110001110,  // 5
+	0b011100111101111,  // 6
+	0b111001010010010,  // 7
+	0b111101111101111,  // 8
+	0b111101111001110,  // 9
+	0b000010000010000,  // :
+	0, 0, 0, 0, 0, 0,
+	0b010101111101101,  // A
+	0b110101110101110,  // B
+	0b011100100100011,  // C
+	0b110101101101110,  // D
+	0b111100110100111,  // E
+	0b111100110100100,  // F
+	0b011100101101011,  // G
+	0b101101111101101,  // H
+	0b111010010010111,  // I
+	0b001001001101010,  // J
+	0b101101110101101,  // K
+	0b100100100100111,  // L
+	0b101111111101101,  // M
+	0b110101101101101,  // N
+	0b010101101101010,  // O
+	0b110101110100100,  // P
+	0b010101101110011,  // Q
+	0b110101110101101,  // R
+	0b011100010001110,  // S
+	0b111010010010010,  // T
+	0b101101101101111,  // U
+	0b101101101101010,  // V
+	0b101101111111101,  // W
+	0b101101010101101,  // X
+	0b101101010010010,  // Y
+	0b111001010100111,  // Z
+};
+
+static_assert( sizeof( k_glyphs ) / sizeof( k_glyphs[0] ) == 'Z' - ' ' + 1, "Missing glyphs" );
+
+static std::vector<uint32_t> s_pixels;
+static std::shared_ptr<CVulkanTexture> s_pTextures[2];
+static uint32_t s_unNextTexture = 0;
+static std::shared_ptr<CVulkanTexture> s_pCurrentTexture;
+static uint64_t s_ulLastRedraw = 0;
+
+static uint64_t s_ulAppFrameTimes[ k_unHistory ] = {};
+static uint32_t s_unAppFrameIndex = 0;
+static uint64_t s_ulLastAppFrame = 0;
+
+// Accumulated since the last redraw
+static uint32_t s_unFrames = 0;
+static uint32_t s_unCompositedFrames = 0;
+static uint64_t s_ulDrawTimeSum = 0;
+static uint32_t s_unAppFrames = 0;
+static uint64_t s_ulAppFrameTimeSum = 0;
+
+static uint32_t s_unMissedVBlanks = 0;
+static PerfHudFrame_t s_lastFrame = {};
+
+void perfhud_app_frame( uint64_t now )
+{
+	uint64_t ulFrameTime = now - s_ulLastAppFrame;
+	bool bValid = s_ulLastAppFrame != 0 && ulFrameTime < k_ulMaxAppFrameTime;
+	s_ulLastAppFrame = now;
+
+	if ( !g_bPerfHud || !bValid )
+		return;
+
+	s_ulAppFrameTimes[ s_unAppFrameIndex ] = ulFrameTime;
+	s_unAppFrameIndex = ( s_unAppFrameIndex + 1 ) % k_unHistory;
+
+	s_unAppFrames++;
+	s_ulAppFrameTimeSum += ulFrameTime;
+}
+
+void perfhud_frame_painted( const PerfHudFrame_t &frame )
+{
+	if ( !g_bPerfHud )
+		return;
+
+	s_unFrames++;
+	if ( frame.bComposited )
+		s_unCompositedFrames++;
+	s_ulDrawTimeSum += frame.ulDrawTime;
+	if ( frame.bMissedVBlank )
+		s_unMissedVBlanks++;
+
+	s_lastFrame = frame;
+}
+
+static void fill_rect( uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint32_t color )
+{
+	for ( uint32_t j = y; j < std::min( y + height, k_unHudHeight ); j++ )
+	{
+		for ( uint32_t i = x; i < std::min( x + width, k_unHudWidth ); i++ )
+			s_pixels[ j * k_unHudWidth + i ] = color;
+	}
+}
+
+static void draw_text( uint32_t line, const char *pText )
+{
+	uint32_t x = k_unMargin;
+	uint32_t y = k_unMargin + line * k_unLineHeight;
+
+	for ( const char *c = pText; *c && x + k_unGlyphAdvance <= k_unHudWidth; c++, x += k_unGlyphAdvance )
+	{
+		int ch = toupper( (unsigned char)*c );
+		if ( ch < ' ' || ch > 'Z' )
+			continue;
+
+		uint16_t glyph = k_glyphs[ ch - ' ' ];
+		for ( uint32_t row = 0; row < 5; row++ )
+		{
+			for ( uint32_t col = 0; col < 3; col++ )
+			{
+				if ( glyph & ( 1u << ( 14 - row * 3 - col ) ) )
+					fill_rect( x + col * k_unGlyphScale, y + row * k_unGlyphScale, k_unGlyphScale, k_unGlyphScale, k_unColorText );
+			}
+		}
+	}
+}
+
+static void draw_hud( uint64_t ulElapsed )
+{
+	s_pixels.assign( k_unHudWidth * k_unHudHeight, k_unColorBackground );
+
+	char line[ 64 ];
+	double flSeconds = ulElapsed / 1'000'000'000.0;
+
+	double flAppFrameTime = s_unAppFrames ? s_ulAppFrameTimeSum / (double)s_unAppFrames : 0.0;
+	snprintf( line, sizeof( line ), "FPS %5.1f  APP %5.1f", s_unFrames / flSeconds, s_unAppFrames / flSeconds );
+	draw_text( 0, line );
+
+	double flDrawTime = s_unFrames ? s_ulDrawTimeSum / (double)s_unFrames : 0.0;
+	snprintf( line, sizeof( line ), "APP %5.2fMS  DRAW %4.2fMS", flAppFrameTime / 1'000'000.0, flDrawTime / 1'000'000.0 );
+	draw_text( 1, line );
+
+	uint32_t unCompositedPercent = s_unFrames ? s_unCompositedFrames * 100 / s_unFrames : 0;
+	snprintf( line, sizeof( line ), "%s  LAYERS %u  COMP %u%%",
+		s_lastFrame.bComposited ? "COMPOSITE" : "SCANOUT", s_lastFrame.uLayerCount, unCompositedPercent );
+	draw_text( 2, line );
+
+	snprintf( line, sizeof( line ), "MISSED VBLANKS %u", s_unMissedVBlanks );
+	draw_text( 3, line );
+
+	// Frame time graph, oldest on the left, with a line at the refresh interval
+	const int refresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+	uint64_t ulRefreshInterval = refresh > 0 ? 1'000'000'000ul / refresh : 0;
+
+	for ( uint32_t i = 0; i < k_unHistory; i++ )
+	{
+		uint64_t ulFrameTime = s_ulAppFrameTimes[ ( s_unAppFrameIndex + i ) % k_unHistory ];
+		if ( ulFrameTime == 0 )
+			continue;
+
+		uint32_t unHeight = std::min<uint64_t>( ulFrameTime, k_ulGraphMaxFrameTime ) * k_unGraphHeight / k_ulGraphMaxFrameTime;
+		unHeight = std::max( unHeight, 1u );
+		// Frames well over the average are what stutter looks like
+		uint32_t color = ulFrameTime > flAppFrameTime * 1.5 && flAppFrameTime > 0.0 ? k_unColorSlowBar : k_unColorBar;
+		fill_rect( k_unMargin + i * k_unBarWidth, k_unGraphTop + k_unGraphHeight - unHeight, k_unBarWidth, unHeight, color );
+	}
+
+	if ( ulRefreshInterval && ulRefreshInterval < k_ulGraphMaxFrameTime )
+	{
+		uint32_t y = k_unGraphTop + k_unGraphHeight - ulRefreshInterval * k_unGraphHeight / k_ulGraphMaxFrameTime;
+		fill_rect( k_unMargin, y, k_unHistory * k_unBarWidth, 1, k_unColorRefreshLine );
+	}
+}
+
+std::shared_ptr<CVulkanTexture> perfhud_get_texture( uint64_t now )
+{
+	if ( !g_bPerfHud )
+	{
+		s_pCurrentTexture = nullptr;
+		return nullptr;
+	}
+
+	if ( s_pCurrentTexture && now - s_ulLastRedraw < k_ulRedrawInterval )
+		return s_pCurrentTexture;
+
+	draw_hud( s_ulLastRedraw && s_pCurrentTexture ? now - s_ulLastRedraw : k_ulRedrawInterval );
+	s_ulLastRedraw = now;
+
+	s_unFrames = 0;
+	s_unCompositedFrames = 0;
+	s_ulDrawTimeSum = 0;
+	s_unAppFrames = 0;
+	s_ulAppFrameTimeSum = 0;
+
+	// Alternate between two images, so we never write one that's on screen
+	std::shared_ptr<CVulkanTexture> &pTexture = s_pTextures[ s_unNextTexture ];
+	s_unNextTexture = ( s_unNextTexture + 1 ) % 2;
+
+	if ( pTexture == nullptr )
+	{
+		CVulkanTexture::createFlags texCreateFlags;
+		if ( BIsNested() == false )
+		{
+			texCreateFlags.bFlippable = true;
+			texCreateFlags.bLinear = true;
+		}
+
+		pTexture = vulkan_create_texture_from_bits( k_unHudWidth, k_unHudHeight, k_unHudWidth, k_unHudHeight, DRM_FORMAT_ARGB8888, texCreateFlags, s_pixels.data() );
+	}
+	else
+	{
+		vulkan_update_texture_from_bits( pTexture, DRM_FORMAT_ARGB8888, s_pixels.data() );
+	}
+
+	s_pCurrentTexture = pTexture;
+	return s_pCurrentTexture;
+}
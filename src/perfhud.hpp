@@ -0,0 +1,28 @@
+// Frame statistics drawn by gamescope itself, above everything else
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+
+class CVulkanTexture;
+
+extern bool g_bPerfHud;
+
+struct PerfHudFrame_t
+{
+	// Time from the vblank we woke up for to the frame being ready
+	uint64_t ulDrawTime;
+	uint32_t uLayerCount;
+	bool bComposited;
+	bool bMissedVBlank;
+};
+
+// A new frame of the focused app was committed.
+void perfhud_app_frame( uint64_t now );
+
+// paint_all put a frame on screen.
+void perfhud_frame_painted( const PerfHudFrame_t &frame );
+
+// The HUD image, redrawn when it went stale. nullptr if the HUD is off.
+std::shared_ptr<CVulkanTexture> perfhud_get_texture( uint64_t now );
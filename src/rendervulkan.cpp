@@ -8,7 +8,10 @@
 #include <algorithm>
 #include <array>
 #include <bitset>
+#include <condition_variable>
+#include <mutex>
 #include <thread>
+#include <pthread.h>
 #include <vulkan/vulkan_core.h>
 
 // Used to remove the config struct alignment specified by the NIS header
@@ -21,11 +24,16 @@
 #include "steamcompmgr.hpp"
 #include "sdlwindow.hpp"
 #include "log.hpp"
+#include "wlserver.hpp"
+#include "metrics.hpp"
 
 #include "cs_composite_blit.h"
+#include "cs_composite_blit_dynamic.h"
 #include "cs_composite_blur.h"
 #include "cs_composite_blur_cond.h"
+#include "cs_composite_partial.h"
 #include "cs_composite_rcas.h"
+#include "cs_composite_sharp.h"
 #include "cs_easu.h"
 #include "cs_easu_fp16.h"
 #include "cs_gaussian_blur_horizontal.h"
@@ -52,6 +60,7 @@ VKAPI_ATTR PFN_vkVoidFunction VKAPI_CALL vkGetInstanceProcAddr(
 
 
 bool g_bIsCompositeDebug = false;
+bool g_bDynamicComposite = false;
 
 struct VulkanOutput_t
 {
@@ -67,9 +76,15 @@ struct VulkanOutput_t
 	uint32_t nOutImage; // swapchain index in nested mode, or ping/pong between two RTs
 	std::vector<std::shared_ptr<CVulkanTexture>> outputImages;
 
+	// Layers composited on their own to go on an overlay plane, ping/pong too
+	uint32_t nPartialImage;
+	std::array<std::shared_ptr<CVulkanTexture>, 2> partialImages;
+
 	VkFormat outputFormat;
 
 	std::array<std::shared_ptr<CVulkanTexture>, 8> pScreenshotImages;
+	// Screenshots of frames that weren't composited get composited here
+	std::shared_ptr<CVulkanTexture> screenshotCompositeImage;
 
 	// NIS and FSR
 	std::shared_ptr<CVulkanTexture> tmpOutput;
@@ -88,6 +103,9 @@ enum ShaderType {
 	SHADER_TYPE_EASU,
 	SHADER_TYPE_RCAS,
 	SHADER_TYPE_NIS,
+	SHADER_TYPE_SHARP,
+	SHADER_TYPE_PARTIAL,
+	SHADER_TYPE_BLIT_DYNAMIC,
 
 	SHADER_TYPE_COUNT
 };
@@ -301,6 +319,33 @@ struct TextureState
 	}
 };
 
+struct LayerTableEntry_t
+{
+	vec2_t scale;
+	vec2_t offset;
+	vec2_t texSize;
+	vec2_t srcMin;
+	vec2_t srcMax;
+	float opacity;
+	uint32_t texIndex;
+	uint32_t formatClass;
+	uint32_t flags;
+};
+
+// Matches layer_table_t in cs_composite_blit_dynamic.comp, std430
+struct LayerTable_t
+{
+	uint32_t layerCount;
+	uint32_t flags;
+	uint32_t frameId;
+	uint32_t pad;
+	LayerTableEntry_t layers[VKR_LAYER_TABLE_SIZE];
+};
+
+static_assert(sizeof(LayerTableEntry_t) == 56, "Layer table entries must match std430");
+static_assert(offsetof(LayerTable_t, layers) == 16, "Layer table header must match std430");
+static_assert(k_nMaxDynamicLayers == VKR_LAYER_TABLE_SIZE, "Every layer of a frame needs a layer table entry");
+
 class CVulkanCmdBuffer
 {
 public:
@@ -319,10 +364,16 @@ public:
 	void setTextureSrgb(uint32_t slot, bool srgb);
 	void setSamplerNearest(uint32_t slot, bool nearest);
 	void setSamplerUnnormalized(uint32_t slot, bool unnormalized);
+	// Part of the texture in slot that may be sampled, all of it by default
+	void setSourceRect(uint32_t slot, vec2_t offset, vec2_t size);
 	void bindTarget(std::shared_ptr<CVulkanTexture> target);
 	void clearState();
 	template<class PushData, class... Args>
 	void pushConstants(Args&&... args);
+	void setLayerTable(const struct FrameInfo_t *frameInfo, uint32_t flags);
+	// Rewrites the offset of a layer in the last layer table dispatched, for
+	// changes that come in after recording. Only until submission.
+	void updateLayerOffset(int index, const FrameInfo_t::Layer_t *layer);
 	void bindPipeline(VkPipeline pipeline);
 	void dispatch(uint32_t x, uint32_t y = 1, uint32_t z = 1);
 	void copyImage(std::shared_ptr<CVulkanTexture> src, std::shared_ptr<CVulkanTexture> dst);
@@ -346,7 +397,12 @@ private:
 	std::array<CVulkanTexture *, VKR_SAMPLER_SLOTS> m_boundTextures;
 	std::bitset<VKR_SAMPLER_SLOTS> m_useSrgb;
 	std::array<SamplerState, VKR_SAMPLER_SLOTS> m_samplerState;
+	std::array<vec2_t, VKR_SAMPLER_SLOTS> m_srcMin;
+	std::array<vec2_t, VKR_SAMPLER_SLOTS> m_srcMax;
 	CVulkanTexture *m_target;
+	bool m_bHasLayerTable;
+	LayerTable_t m_layerTable;
+	LayerTable_t *m_pDispatchedLayerTable;
 };
 
 #define VULKAN_INSTANCE_FUNCTIONS \
@@ -433,6 +489,8 @@ public:
 	std::unique_ptr<CVulkanCmdBuffer> commandBuffer();
 	uint64_t submit( std::unique_ptr<CVulkanCmdBuffer> cmdBuf);
 	void wait(uint64_t sequence);
+	// Doesn't recycle command buffers, so it's fine from any thread
+	void waitOnly(uint64_t sequence);
 	void waitIdle();
 	void garbageCollect();
 	inline VkDescriptorSet descriptorSet()
@@ -441,6 +499,19 @@ public:
 		m_currentDescriptorSet = (m_currentDescriptorSet + 1) % m_descriptorSets.size();
 		return ret;
 	}
+	// Same deal as the descriptor sets, rotates through a few and relies on
+	// us waiting on each submit.
+	inline LayerTable_t *layerTable(VkDescriptorBufferInfo *bufferInfo)
+	{
+		VkDeviceSize offset = m_currentLayerTable * m_layerTableStride;
+		m_currentLayerTable = (m_currentLayerTable + 1) % m_descriptorSets.size();
+		*bufferInfo = {
+			.buffer = m_layerTableBuffer,
+			.offset = offset,
+			.range = sizeof(LayerTable_t),
+		};
+		return (LayerTable_t *)((uint8_t *)m_layerTableData + offset);
+	}
 
 	inline VkDevice device() { return m_device; }
 	inline VkPhysicalDevice physDev() {return m_physDev; }
@@ -456,6 +527,7 @@ public:
 	inline bool hasDrmPrimaryDevId() {return m_bHasDrmPrimaryDevId;}
 	inline dev_t primaryDevId() {return m_drmPrimaryDevId;}
 	inline bool supportsFp16() {return m_bSupportsFp16;}
+	inline bool supportsDynamicIndexing() {return m_bSupportsDynamicIndexing;}
 
 	#define VK_FUNC(x) PFN_vk##x x = nullptr;
 	struct
@@ -495,6 +567,7 @@ private:
 	dev_t m_drmPrimaryDevId = 0;
 
 	bool m_bSupportsFp16 = false;
+	bool m_bSupportsDynamicIndexing = false;
 	bool m_bHasDrmPrimaryDevId = false;
 	bool m_bSupportsModifiers = false;
 	bool m_bInitialized = false;
@@ -517,6 +590,12 @@ private:
 	VkDeviceMemory m_uploadBufferMemory;
 	void *m_uploadBufferData;
 
+	VkBuffer m_layerTableBuffer;
+	VkDeviceMemory m_layerTableMemory;
+	void *m_layerTableData;
+	VkDeviceSize m_layerTableStride;
+	uint32_t m_currentLayerTable = 0;
+
 
 	VkSemaphore m_scratchTimelineSemaphore;
 	std::atomic<uint64_t> m_submissionSeqNo = { 0 };
@@ -749,6 +828,14 @@ bool CVulkanDevice::createDevice()
 		vk.GetPhysicalDeviceFeatures2( physDev(), &features2 );
 
 		m_bSupportsFp16 = vulkan12Features.shaderFloat16 && features2.features.shaderInt16;
+		m_bSupportsDynamicIndexing = features2.features.shaderSampledImageArrayDynamicIndexing;
+	}
+
+	if ( g_bDynamicComposite && !m_bSupportsDynamicIndexing )
+	{
+		vk_log.infof( "The vulkan driver can't index sampler arrays dynamically,"
+		              " using specialized composite pipelines." );
+		g_bDynamicComposite = false;
 	}
 
 	float queuePriorities = 1.0f;
@@ -788,6 +875,7 @@ bool CVulkanDevice::createDevice()
 	VkPhysicalDeviceFeatures2 features2 = {
 		.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
 		.features = {
+			.shaderSampledImageArrayDynamicIndexing = m_bSupportsDynamicIndexing,
 			.shaderInt16 = m_bSupportsFp16,
 		},
 	};
@@ -915,7 +1003,7 @@ bool CVulkanDevice::createLayouts()
 	for (auto& sampler : ycbcrSamplers)
 		sampler = m_ycbcrSampler;
 
-	std::array<VkDescriptorSetLayoutBinding, 3> layoutBindings = {
+	std::array<VkDescriptorSetLayoutBinding, 4> layoutBindings = {
 		VkDescriptorSetLayoutBinding {
 			.binding = 0,
 			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
@@ -935,6 +1023,12 @@ bool CVulkanDevice::createLayouts()
 			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
 			.pImmutableSamplers = ycbcrSamplers.data(),
 		},
+		VkDescriptorSetLayoutBinding {
+			.binding = 3,
+			.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			.descriptorCount = 1,
+			.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+		},
 	};
 
 	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo =
@@ -990,7 +1084,7 @@ bool CVulkanDevice::createPools()
 		return false;
 	}
 
-	VkDescriptorPoolSize poolSizes[2] {
+	VkDescriptorPoolSize poolSizes[3] {
 		{
 			VK_DESCRIPTOR_TYPE_STORAGE_IMAGE,
 			uint32_t(m_descriptorSets.size()) * 1,
@@ -999,6 +1093,10 @@ bool CVulkanDevice::createPools()
 			VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
 			uint32_t(m_descriptorSets.size()) * 2 * VKR_SAMPLER_SLOTS,
 		},
+		{
+			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+			uint32_t(m_descriptorSets.size()) * 1,
+		},
 	};
 	
 	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {
@@ -1033,6 +1131,9 @@ bool CVulkanDevice::createShaders()
 	SHADER(BLUR_COND, cs_composite_blur_cond);
 	SHADER(BLUR_FIRST_PASS, cs_gaussian_blur_horizontal);
 	SHADER(RCAS, cs_composite_rcas);
+	SHADER(SHARP, cs_composite_sharp);
+	SHADER(PARTIAL, cs_composite_partial);
+	SHADER(BLIT_DYNAMIC, cs_composite_blit_dynamic);
 	if (m_bSupportsFp16)
 	{
 		SHADER(EASU, cs_easu_fp16);
@@ -1124,6 +1225,52 @@ bool CVulkanDevice::createScratchResources()
 		return false;
 	}
 
+	// Make and map the layer tables for the dynamic blit
+
+	VkPhysicalDeviceProperties props;
+	vk.GetPhysicalDeviceProperties( physDev(), &props );
+	VkDeviceSize alignment = props.limits.minStorageBufferOffsetAlignment;
+	m_layerTableStride = ( sizeof(LayerTable_t) + alignment - 1 ) / alignment * alignment;
+
+	VkBufferCreateInfo layerTableCreateInfo = {
+		.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		.size = m_layerTableStride * m_descriptorSets.size(),
+		.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+	};
+
+	res = vk.CreateBuffer( device(), &layerTableCreateInfo, nullptr, &m_layerTableBuffer );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkCreateBuffer failed" );
+		return false;
+	}
+
+	vk.GetBufferMemoryRequirements(device(), m_layerTableBuffer, &memRequirements);
+
+	memTypeIndex = findMemoryType(VK_MEMORY_PROPERTY_HOST_COHERENT_BIT|VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, memRequirements.memoryTypeBits );
+	if ( memTypeIndex == ~0u )
+	{
+		vk_log.errorf( "findMemoryType failed" );
+		return false;
+	}
+
+	VkMemoryAllocateInfo layerTableAllocInfo = {
+		.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+		.allocationSize = memRequirements.size,
+		.memoryTypeIndex = memTypeIndex,
+	};
+
+	vk.AllocateMemory( device(), &layerTableAllocInfo, nullptr, &m_layerTableMemory );
+
+	vk.BindBufferMemory( device(), m_layerTableBuffer, m_layerTableMemory, 0 );
+
+	res = vk.MapMemory( device(), m_layerTableMemory, 0, VK_WHOLE_SIZE, 0, (void**)&m_layerTableData );
+	if ( res != VK_SUCCESS )
+	{
+		vk_errorf( res, "vkMapMemory failed" );
+		return false;
+	}
+
 	VkSemaphoreTypeCreateInfo timelineCreateInfo = {
 		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
 		.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
@@ -1245,17 +1392,24 @@ VkPipeline CVulkanDevice::compilePipeline(uint32_t layerCount, uint32_t ycbcrMas
 
 void CVulkanDevice::compileAllPipelines()
 {
+	uint64_t startTime = get_time_in_nanos();
+	uint32_t pipelineCount = 0;
 
+	// The dynamic blit covers all variants of the blit and partial ones
+	uint32_t blitLayerCount = g_bDynamicComposite ? 0 : k_nMaxLayers;
 
 	std::array<PipelineInfo_t, SHADER_TYPE_COUNT> pipelineInfos;
 #define SHADER(type, layer_count, max_ycbcr, max_radius, blur_layers) pipelineInfos[SHADER_TYPE_##type] = {SHADER_TYPE_##type, layer_count, max_ycbcr, max_radius, blur_layers}
-	SHADER(BLIT, k_nMaxLayers, k_nMaxYcbcrMask, 1, 1);
+	SHADER(BLIT, blitLayerCount, k_nMaxYcbcrMask, 1, 1);
 	SHADER(BLUR, k_nMaxLayers, k_nMaxYcbcrMask, kMaxBlurRadius, k_nMaxBlurLayers);
 	SHADER(BLUR_COND, k_nMaxLayers, k_nMaxYcbcrMask, kMaxBlurRadius, k_nMaxBlurLayers);
 	SHADER(BLUR_FIRST_PASS, 1, 2, kMaxBlurRadius, 1);
 	SHADER(RCAS, k_nMaxLayers, k_nMaxYcbcrMask, 1, 1);
 	SHADER(EASU, 1, 1, 1, 1);
 	SHADER(NIS, 1, 1, 1, 1);
+	SHADER(SHARP, k_nMaxLayers, k_nMaxYcbcrMask, 1, 1);
+	SHADER(PARTIAL, blitLayerCount, k_nMaxYcbcrMask, 1, 1);
+	SHADER(BLIT_DYNAMIC, g_bDynamicComposite ? 1 : 0, 1, 1, 1);
 #undef SHADER
 
 	for (auto& info : pipelineInfos) {
@@ -1269,6 +1423,7 @@ void CVulkanDevice::compileAllPipelines()
 							continue;
 
 						VkPipeline newPipeline = compilePipeline(layerCount, ycbcrMask, radius, info.shaderType, blur_layers);
+						pipelineCount++;
 						{
 							std::lock_guard<std::mutex> lock(m_pipelineMutex);
 							PipelineInfo_t key = {info.shaderType, layerCount, ycbcrMask, radius, blur_layers};
@@ -1281,6 +1436,9 @@ void CVulkanDevice::compileAllPipelines()
 			}
 		}
 	}
+
+	vk_log.infof( "Compiled %u pipelines in %.1fms", pipelineCount,
+	              ( get_time_in_nanos() - startTime ) / 1000000.0 );
 }
 
 VkPipeline CVulkanDevice::pipeline(ShaderType type, uint32_t layerCount, uint32_t ycbcrMask, uint32_t radius, uint32_t blur_layers)
@@ -1401,6 +1559,12 @@ void CVulkanDevice::garbageCollect( void )
 }
 
 void CVulkanDevice::wait(uint64_t sequence)
+{
+	waitOnly(sequence);
+	resetCmdBuffers(sequence);
+}
+
+void CVulkanDevice::waitOnly(uint64_t sequence)
 {
 	VkSemaphoreWaitInfo waitInfo = {
 		.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
@@ -1412,7 +1576,6 @@ void CVulkanDevice::wait(uint64_t sequence)
 	VkResult res = vk.WaitSemaphores(device(), &waitInfo, ~0ull);
 	if (res != VK_SUCCESS)
 		assert( 0 );
-	resetCmdBuffers(sequence);
 }
 
 void CVulkanDevice::waitIdle()
@@ -1478,8 +1641,19 @@ void CVulkanCmdBuffer::end()
 void CVulkanCmdBuffer::bindTexture(uint32_t slot, std::shared_ptr<CVulkanTexture> texture)
 {
 	m_boundTextures[slot] = texture.get();
+	m_srcMin[slot] = { 0.0f, 0.0f };
+	m_srcMax[slot] = { 0.0f, 0.0f };
 	if (texture)
+	{
 		m_textureRefs.emplace(texture.get(), texture);
+		m_srcMax[slot] = { float(texture->width()), float(texture->height()) };
+	}
+}
+
+void CVulkanCmdBuffer::setSourceRect(uint32_t slot, vec2_t offset, vec2_t size)
+{
+	m_srcMin[slot] = offset;
+	m_srcMax[slot] = { offset.x + size.x, offset.y + size.y };
 }
 
 void CVulkanCmdBuffer::setTextureSrgb(uint32_t slot, bool srgb)
@@ -1512,8 +1686,12 @@ void CVulkanCmdBuffer::clearState()
 	for (auto& sampler : m_samplerState)
 		sampler = {};
 
+	m_srcMin.fill({});
+	m_srcMax.fill({});
 	m_target = nullptr;
 	m_useSrgb.reset();
+	m_bHasLayerTable = false;
+	m_pDispatchedLayerTable = nullptr;
 }
 
 template<class PushData, class... Args>
@@ -1542,7 +1720,22 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 
 	VkDescriptorSet descriptorSet = m_device->descriptorSet();
 
-	std::array<VkWriteDescriptorSet, 3> writeDescriptorSets;
+	VkDescriptorBufferInfo layerTableDescriptor;
+	LayerTable_t *layerTable = m_device->layerTable(&layerTableDescriptor);
+	if (m_bHasLayerTable)
+	{
+		memcpy(layerTable, &m_layerTable, sizeof(m_layerTable));
+		m_pDispatchedLayerTable = layerTable;
+	}
+
+	// Every composite shader clips its layers to these
+	for (uint32_t i = 0; i < VKR_LAYER_TABLE_SIZE; i++)
+	{
+		layerTable->layers[i].srcMin = m_srcMin[i];
+		layerTable->layers[i].srcMax = m_srcMax[i];
+	}
+
+	std::array<VkWriteDescriptorSet, 4> writeDescriptorSets;
 	std::array<VkDescriptorImageInfo, VKR_SAMPLER_SLOTS> imageDescriptors = {};
 	std::array<VkDescriptorImageInfo, VKR_SAMPLER_SLOTS> ycbcrImageDescriptors = {};
 	VkDescriptorImageInfo targetDescriptor = {
@@ -1580,6 +1773,16 @@ void CVulkanCmdBuffer::dispatch(uint32_t x, uint32_t y, uint32_t z)
 		.pImageInfo = ycbcrImageDescriptors.data(),
 	};
 
+	writeDescriptorSets[3] = {
+		.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+		.dstSet = descriptorSet,
+		.dstBinding = 3,
+		.dstArrayElement = 0,
+		.descriptorCount = 1,
+		.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		.pBufferInfo = &layerTableDescriptor,
+	};
+
 	for (uint32_t i = 0; i < VKR_SAMPLER_SLOTS; i++)
 	{
 		imageDescriptors[i].sampler = m_device->sampler(m_samplerState[i]);
@@ -2613,6 +2816,7 @@ bool vulkan_remake_swapchain( void )
 	// Delete screenshot image to be remade if needed
 	for (auto& pScreenshotImage : pOutput->pScreenshotImages)
 		pScreenshotImage = nullptr;
+	pOutput->screenshotCompositeImage = nullptr;
 
 	bool bRet = vulkan_make_swapchain( pOutput );
 	assert( bRet ); // Something has gone horribly wrong!
@@ -2647,6 +2851,22 @@ static bool vulkan_make_output_images( VulkanOutput_t *pOutput )
 		return false;
 	}
 
+	// Full size so they never need reallocating, only the top-left corner
+	// covering the composited layers gets written and scanned out.
+	CVulkanTexture::createFlags partialImageFlags;
+	partialImageFlags.bFlippable = true;
+	partialImageFlags.bStorage = true;
+
+	for ( auto &pPartialImage : pOutput->partialImages )
+	{
+		pPartialImage = std::make_shared<CVulkanTexture>();
+		if ( !pPartialImage->BInit( g_nOutputWidth, g_nOutputHeight, DRM_FORMAT_ARGB8888, partialImageFlags ) )
+		{
+			vk_log.errorf( "failed to allocate partial composition buffer for KMS" );
+			return false;
+		}
+	}
+
 	return true;
 }
 
@@ -2656,10 +2876,12 @@ bool vulkan_remake_output_images( void )
 	g_device.waitIdle();
 
 	pOutput->nOutImage = 0;
+	pOutput->nPartialImage = 0;
 
 	// Delete screenshot image to be remade if needed
 	for (auto& pScreenshotImage : pOutput->pScreenshotImages)
 		pScreenshotImage = nullptr;
+	pOutput->screenshotCompositeImage = nullptr;
 
 	bool bRet = vulkan_make_output_images( pOutput );
 	assert( bRet );
@@ -2755,6 +2977,95 @@ bool vulkan_make_output( void )
 	return true;
 }
 
+// Intermediate images FSR, NIS and blur render to, by size. A few are kept
+// so going back to a size doesn't allocate again, and they are made ahead of
+// time on a thread of their own, so the first upscaled or blurred frame
+// doesn't wait on an allocation. Most recently used last.
+static const size_t k_nMaxTmpImages = 3;
+static std::mutex g_tmpImageLock;
+static std::condition_variable g_tmpImageCond;
+static std::vector<std::shared_ptr<CVulkanTexture>> g_tmpImages;
+static std::vector<std::pair<uint32_t, uint32_t>> g_tmpImageRequests;
+
+static std::shared_ptr<CVulkanTexture> create_tmp_image( uint32_t width, uint32_t height )
+{
+	CVulkanTexture::createFlags createFlags;
+	createFlags.bSampled = true;
+	createFlags.bStorage = true;
+
+	std::shared_ptr<CVulkanTexture> pImage = std::make_shared<CVulkanTexture>();
+	if ( !pImage->BInit( width, height, DRM_FORMAT_ARGB8888, createFlags, nullptr ) )
+	{
+		vk_log.errorf( "failed to create %ux%u intermediate image", width, height );
+		return nullptr;
+	}
+
+	return pImage;
+}
+
+// With g_tmpImageLock held
+static std::shared_ptr<CVulkanTexture> find_tmp_image( uint32_t width, uint32_t height )
+{
+	for ( auto iter = g_tmpImages.begin(); iter != g_tmpImages.end(); iter++ )
+	{
+		if ( (*iter)->width() == width && (*iter)->height() == height )
+		{
+			std::shared_ptr<CVulkanTexture> pImage = *iter;
+			g_tmpImages.erase( iter );
+			g_tmpImages.push_back( pImage );
+			return pImage;
+		}
+	}
+
+	return nullptr;
+}
+
+// With g_tmpImageLock held
+static bool has_tmp_image( uint32_t width, uint32_t height )
+{
+	for ( const auto &pImage : g_tmpImages )
+	{
+		if ( pImage->width() == width && pImage->height() == height )
+			return true;
+	}
+
+	return false;
+}
+
+// With g_tmpImageLock held
+static void add_tmp_image( std::shared_ptr<CVulkanTexture> pImage )
+{
+	if ( g_tmpImages.size() >= k_nMaxTmpImages )
+		g_tmpImages.erase( g_tmpImages.begin() );
+
+	g_tmpImages.push_back( std::move( pImage ) );
+}
+
+static void tmp_image_thread_main( void )
+{
+	pthread_setname_np( pthread_self(), "gamescope-tmpimg" );
+
+	std::unique_lock<std::mutex> lock( g_tmpImageLock );
+	for (;;)
+	{
+		g_tmpImageCond.wait( lock, []{ return !g_tmpImageRequests.empty(); } );
+
+		uint32_t width = g_tmpImageRequests.front().first;
+		uint32_t height = g_tmpImageRequests.front().second;
+
+		// Only creating the image, it's transitioned on first use like any
+		// other, so this doesn't need the command pool.
+		lock.unlock();
+		std::shared_ptr<CVulkanTexture> pImage = create_tmp_image( width, height );
+		lock.lock();
+
+		g_tmpImageRequests.erase( g_tmpImageRequests.begin() );
+		// A composite may have needed it first and made its own
+		if ( pImage && !has_tmp_image( width, height ) )
+			add_tmp_image( std::move( pImage ) );
+	}
+}
+
 static void update_tmp_images( uint32_t width, uint32_t height )
 {
 	if ( g_output.tmpOutput != nullptr
@@ -2764,20 +3075,45 @@ static void update_tmp_images( uint32_t width, uint32_t height )
 		return;
 	}
 
-	CVulkanTexture::createFlags createFlags;
-	createFlags.bSampled = true;
-	createFlags.bStorage = true;
-
-	g_output.tmpOutput = std::make_shared<CVulkanTexture>();
-	bool bSuccess = g_output.tmpOutput->BInit( width, height, DRM_FORMAT_ARGB8888, createFlags, nullptr );
+	std::shared_ptr<CVulkanTexture> pImage;
+	{
+		std::lock_guard<std::mutex> lock( g_tmpImageLock );
+		pImage = find_tmp_image( width, height );
+	}
 
-	if ( !bSuccess )
+	if ( pImage == nullptr )
 	{
-		vk_log.errorf( "failed to create fsr output" );
-		return;
+		// Nobody saw this one coming, or it's still being made
+		pImage = create_tmp_image( width, height );
+		if ( pImage == nullptr )
+			return;
+
+		std::lock_guard<std::mutex> lock( g_tmpImageLock );
+		add_tmp_image( pImage );
 	}
+
+	g_output.tmpOutput = pImage;
 }
 
+void vulkan_prepare_tmp_images( uint32_t width, uint32_t height )
+{
+	if ( width == 0 || height == 0 )
+		return;
+
+	std::lock_guard<std::mutex> lock( g_tmpImageLock );
+
+	if ( has_tmp_image( width, height ) )
+		return;
+
+	for ( const auto &request : g_tmpImageRequests )
+	{
+		if ( request.first == width && request.second == height )
+			return;
+	}
+
+	g_tmpImageRequests.push_back( std::make_pair( width, height ) );
+	g_tmpImageCond.notify_one();
+}
 
 static bool init_nis_data()
 {
@@ -2809,6 +3145,9 @@ bool vulkan_init( void )
 	if (!init_nis_data())
 		return false;
 
+	std::thread tmpImageThread( tmp_image_thread_main );
+	tmpImageThread.detach();
+
 	return true;
 }
 
@@ -2846,6 +3185,17 @@ std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_bits( uint32_t width,
 	return pTex;
 }
 
+void vulkan_update_texture_from_bits( std::shared_ptr<CVulkanTexture> pTex, uint32_t drmFormat, void *bits )
+{
+	memcpy( g_device.uploadBufferData(), bits, pTex->width() * pTex->height() * DRMFormatGetBPP(drmFormat) );
+
+	auto cmdBuffer = g_device.commandBuffer();
+
+	cmdBuffer->copyBufferToImage(g_device.uploadBuffer(), 0, 0, pTex);
+
+	g_device.submit(std::move(cmdBuffer));
+}
+
 bool float_is_integer(float x)
 {
 	return fabsf(ceilf(x) - x) <= 0.0001f;
@@ -2909,6 +3259,37 @@ struct BlitPushData_t
 	}
 };
 
+void CVulkanCmdBuffer::setLayerTable(const struct FrameInfo_t *frameInfo, uint32_t flags)
+{
+	m_layerTable.layerCount = frameInfo->layerCount;
+	m_layerTable.flags = flags;
+	m_layerTable.frameId = s_frameId++;
+	m_layerTable.pad = 0;
+
+	for (int i = 0; i < frameInfo->layerCount; i++) {
+		const FrameInfo_t::Layer_t *layer = &frameInfo->layers[i];
+		LayerTableEntry_t *entry = &m_layerTable.layers[i];
+		entry->scale = layer->scale;
+		entry->offset = layer->offsetPixelCenter();
+		entry->texSize = { float(layer->tex->width()), float(layer->tex->height()) };
+		entry->opacity = layer->opacity;
+		entry->texIndex = i;
+		entry->formatClass = layer->tex->format() == VK_FORMAT_G8_B8R8_2PLANE_420_UNORM ? VKR_LAYER_FORMAT_YCBCR : VKR_LAYER_FORMAT_RGB;
+		entry->flags = layer->blackBorder ? VKR_LAYER_FLAG_BORDER : 0;
+	}
+
+	m_bHasLayerTable = true;
+}
+
+void CVulkanCmdBuffer::updateLayerOffset(int index, const FrameInfo_t::Layer_t *layer)
+{
+	if (m_pDispatchedLayerTable == nullptr || index >= (int)m_pDispatchedLayerTable->layerCount)
+		return;
+
+	// Host coherent, visible to the GPU once submitted
+	m_pDispatchedLayerTable->layers[index].offset = layer->offsetPixelCenter();
+}
+
 struct uvec4_t
 {
 	uint32_t  x;
@@ -2994,6 +3375,7 @@ void bind_all_layers(CVulkanCmdBuffer* cmdBuffer, const struct FrameInfo_t *fram
 
 		bool nearest = bForceNearest | !layer->linearFilter;
 		cmdBuffer->bindTexture(i, layer->tex);
+		cmdBuffer->setSourceRect(i, layer->srcOffset, { layer->srcWidth(), layer->srcHeight() });
 		cmdBuffer->setTextureSrgb(i, false);
 		cmdBuffer->setSamplerNearest(i, nearest);
 		cmdBuffer->setSamplerUnnormalized(i, true);
@@ -3004,8 +3386,63 @@ void bind_all_layers(CVulkanCmdBuffer* cmdBuffer, const struct FrameInfo_t *fram
 	}
 }
 
+bool FrameInfo_t::latchCursor()
+{
+	if ( !cursorLatch.valid )
+		return false;
+
+	wlserver_cursor_t cursor;
+	if ( !wlserver_get_cursor( cursorLatch.serial, &cursor ) )
+		return false;
+
+	// Past the surface the layer was placed for, or only the X server knows
+	// where the pointer went. Leave it to the next frame.
+	if ( cursor.bNeedsXQuery || cursor.surface != cursorLatch.surface )
+	{
+		cursorLatch.valid = false;
+		return false;
+	}
+
+	cursorLatch.serial = cursor.serial;
+
+	Layer_t *layer = &layers[ cursorLatch.layer ];
+	layer->offset.x = -( cursorLatch.origin.x + cursor.x * cursorLatch.scale );
+	layer->offset.y = -( cursorLatch.origin.y + cursor.y * cursorLatch.scale );
+	return true;
+}
+
+// Binds the blit or partial pipeline for frameInfo, or the dynamic blit and
+// its layer table if we aren't specializing on layers.
+static void bind_composite_blit(CVulkanCmdBuffer* cmdBuffer, ShaderType type, const struct FrameInfo_t *frameInfo)
+{
+	if ( g_bDynamicComposite )
+	{
+		cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT_DYNAMIC) );
+		cmdBuffer->setLayerTable( frameInfo, type == SHADER_TYPE_PARTIAL ? VKR_LAYER_TABLE_KEEP_ALPHA : 0 );
+	}
+	else
+	{
+		cmdBuffer->bindPipeline( g_device.pipeline(type, frameInfo->layerCount, frameInfo->ycbcrMask()) );
+		cmdBuffer->pushConstants<BlitPushData_t>(frameInfo);
+	}
+	bind_all_layers(cmdBuffer, frameInfo);
+}
+
 bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture )
 {
+	// The pointer may have moved while we waited on the previous flip
+	struct FrameInfo_t latchedFrameInfo = {};
+	bool bCursorInLayerTable = false;
+	// Which pipeline did the last pass, so the two can be told apart in the
+	// composite time metrics
+	bool bDynamicBlit = false;
+	if ( frameInfo->cursorLatch.valid )
+	{
+		latchedFrameInfo = *frameInfo;
+		latchedFrameInfo.latchCursor();
+		frameInfo = &latchedFrameInfo;
+	}
+
 	auto compositeImage = g_output.outputImages[ g_output.nOutImage ];
 
 	auto cmdBuffer = g_device.commandBuffer();
@@ -3078,11 +3515,26 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 		nisFrameInfo.layers[0].tex = g_output.tmpOutput;
 		nisFrameInfo.layers[0].scale.x = 1.0f;
 		nisFrameInfo.layers[0].scale.y = 1.0f;
+		nisFrameInfo.layers[0].srcOffset = {};
+		nisFrameInfo.layers[0].srcSize = {};
+
+		bind_composite_blit(cmdBuffer.get(), SHADER_TYPE_BLIT, &nisFrameInfo);
+		cmdBuffer->bindTarget(compositeImage);
+		bDynamicBlit = g_bDynamicComposite;
+
+		int pixelsPerGroup = 8;
 
-		cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT, nisFrameInfo.layerCount, nisFrameInfo.ycbcrMask()));
-		bind_all_layers(cmdBuffer.get(), &nisFrameInfo);
+		cmdBuffer->dispatch(div_roundup(currentOutputWidth, pixelsPerGroup), div_roundup(currentOutputHeight, pixelsPerGroup));
+	}
+	else if ( frameInfo->useSharpLayer0 )
+	{
+		// Single pass straight into the composite image, no tmpOutput.
+		cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_SHARP, frameInfo->layerCount, frameInfo->ycbcrMask()));
+		bind_all_layers(cmdBuffer.get(), frameInfo);
+		// The sharp bilinear kernel relies on the sampler doing the blending.
+		cmdBuffer->setSamplerNearest(0, false);
 		cmdBuffer->bindTarget(compositeImage);
-		cmdBuffer->pushConstants<BlitPushData_t>(&nisFrameInfo);
+		cmdBuffer->pushConstants<BlitPushData_t>(frameInfo);
 
 		int pixelsPerGroup = 8;
 
@@ -3103,7 +3555,9 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 		cmdBuffer->bindTarget(g_output.tmpOutput);
 		for (uint32_t i = 0; i < blur_layer_count; i++)
 		{
-			cmdBuffer->bindTexture(i, frameInfo->layers[i].tex);
+			const FrameInfo_t::Layer_t *layer = &frameInfo->layers[i];
+			cmdBuffer->bindTexture(i, layer->tex);
+			cmdBuffer->setSourceRect(i, layer->srcOffset, { layer->srcWidth(), layer->srcHeight() });
 			cmdBuffer->setTextureSrgb(i, false);
 			cmdBuffer->setSamplerUnnormalized(i, true);
 			cmdBuffer->setSamplerNearest(i, false);
@@ -3127,10 +3581,10 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 	}
 	else
 	{
-		cmdBuffer->bindPipeline( g_device.pipeline(SHADER_TYPE_BLIT, frameInfo->layerCount, frameInfo->ycbcrMask()));
-		bind_all_layers(cmdBuffer.get(), frameInfo);
+		bind_composite_blit(cmdBuffer.get(), SHADER_TYPE_BLIT, frameInfo);
 		cmdBuffer->bindTarget(compositeImage);
-		cmdBuffer->pushConstants<BlitPushData_t>(frameInfo);
+		bDynamicBlit = g_bDynamicComposite;
+		bCursorInLayerTable = bDynamicBlit && frameInfo == &latchedFrameInfo;
 
 		int pixelsPerGroup = 8;
 
@@ -3142,8 +3596,15 @@ bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVul
 		cmdBuffer->copyImage(compositeImage, pScreenshotTexture);
 	}
 
+	// The dynamic blit reads layer positions from host memory, so the cursor
+	// can still move up to submission.
+	if ( bCursorInLayerTable && latchedFrameInfo.latchCursor() )
+		cmdBuffer->updateLayerOffset( latchedFrameInfo.cursorLatch.layer, &latchedFrameInfo.layers[ latchedFrameInfo.cursorLatch.layer ] );
+
+	uint64_t submitTime = get_time_in_nanos();
 	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
 	g_device.wait(sequence);
+	metrics_observe( bDynamicBlit ? METRIC_COMPOSITE_TIME_DYNAMIC : METRIC_COMPOSITE_TIME, get_time_in_nanos() - submitTime );
 
 	if ( BIsNested() == false )
 	{
@@ -3158,6 +3619,99 @@ std::shared_ptr<CVulkanTexture> vulkan_get_last_output_image( void )
 	return g_output.outputImages[ !g_output.nOutImage ];
 }
 
+std::shared_ptr<CVulkanTexture> vulkan_composite_partial( const struct FrameInfo_t *frameInfo, uint32_t width, uint32_t height )
+{
+	auto partialImage = g_output.partialImages[ g_output.nPartialImage ];
+	if ( partialImage == nullptr )
+		return nullptr;
+
+	auto cmdBuffer = g_device.commandBuffer();
+
+	bind_composite_blit(cmdBuffer.get(), SHADER_TYPE_PARTIAL, frameInfo);
+	cmdBuffer->bindTarget(partialImage);
+
+	int pixelsPerGroup = 8;
+
+	cmdBuffer->dispatch(div_roundup(width, pixelsPerGroup), div_roundup(height, pixelsPerGroup));
+
+	uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+	g_device.wait(sequence);
+
+	return partialImage;
+}
+
+void vulkan_flip_partial_image( void )
+{
+	g_output.nPartialImage = !g_output.nPartialImage;
+}
+
+// Whether the frame is a single layer exactly covering pScreenshotTexture
+static bool screenshot_is_plain_copy( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture )
+{
+	if ( frameInfo->layerCount != 1 )
+		return false;
+
+	const FrameInfo_t::Layer_t *layer = &frameInfo->layers[ 0 ];
+	return layer->tex->format() == pScreenshotTexture->format() &&
+		layer->tex->width() == pScreenshotTexture->width() &&
+		layer->tex->height() == pScreenshotTexture->height() &&
+		layer->scale.x == 1.0f && layer->scale.y == 1.0f &&
+		layer->offset.x == 0.0f && layer->offset.y == 0.0f &&
+		layer->srcOffset.x == 0.0f && layer->srcOffset.y == 0.0f &&
+		layer->srcSize.x == 0.0f && layer->srcSize.y == 0.0f &&
+		layer->opacity == 1.0f;
+}
+
+uint64_t vulkan_screenshot( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture )
+{
+	auto cmdBuffer = g_device.commandBuffer();
+
+	if ( screenshot_is_plain_copy( frameInfo, pScreenshotTexture ) )
+	{
+		cmdBuffer->copyImage( frameInfo->layers[ 0 ].tex, pScreenshotTexture );
+	}
+	else
+	{
+		std::shared_ptr<CVulkanTexture> &compositeImage = g_output.screenshotCompositeImage;
+		if ( compositeImage == nullptr )
+		{
+			CVulkanTexture::createFlags createFlags;
+			createFlags.bStorage = true;
+			createFlags.bTransferSrc = true;
+
+			compositeImage = std::make_shared<CVulkanTexture>();
+			if ( !compositeImage->BInit( pScreenshotTexture->width(), pScreenshotTexture->height(), VulkanFormatToDRM( pScreenshotTexture->format() ), createFlags ) )
+			{
+				vk_log.errorf( "failed to allocate screenshot composition image" );
+				compositeImage = nullptr;
+				return 0;
+			}
+		}
+
+		bind_composite_blit(cmdBuffer.get(), SHADER_TYPE_BLIT, frameInfo);
+		cmdBuffer->bindTarget(compositeImage);
+
+		int pixelsPerGroup = 8;
+
+		cmdBuffer->dispatch(div_roundup(compositeImage->width(), pixelsPerGroup), div_roundup(compositeImage->height(), pixelsPerGroup));
+
+		cmdBuffer->copyImage(compositeImage, pScreenshotTexture);
+
+		// The descriptor set and layer table rings assume every composite
+		// is done by the time the next one comes around.
+		uint64_t sequence = g_device.submit(std::move(cmdBuffer));
+		g_device.wait(sequence);
+		return sequence;
+	}
+
+	return g_device.submit(std::move(cmdBuffer));
+}
+
+void vulkan_wait_for_submission( uint64_t sequence )
+{
+	g_device.waitOnly( sequence );
+}
+
 bool vulkan_primary_dev_id(dev_t *id)
 {
 	*id = g_device.primaryDevId();
@@ -24,6 +24,9 @@
 #define k_nMaxLayers 6
 #define k_nMaxYcbcrMask 16
 
+// The dynamic blit isn't specialized on layers, it takes one per sampler slot
+#define k_nMaxDynamicLayers 16
+
 #define k_nMaxBlurLayers 2
 
 #define kMaxBlurRadius (37u / 2 + 1)
@@ -160,6 +163,7 @@ struct FrameInfo_t
 {
 	bool useFSRLayer0;
 	bool useNISLayer0;
+	bool useSharpLayer0;
 	BlurMode blurLayer0;
 	int blurRadius;
 
@@ -174,20 +178,33 @@ struct FrameInfo_t
 		vec2_t offset;
 		vec2_t scale;
 
+		// Part of tex to show, in texels, all of it if srcSize is zero.
+		// Both composition and scanout clip to it.
+		vec2_t srcOffset;
+		vec2_t srcSize;
+
 		float opacity;
 
 		bool blackBorder;
 		bool linearFilter;
 
-		uint32_t integerWidth() const { return tex->width() / scale.x; }
-		uint32_t integerHeight() const { return tex->height() / scale.y; }
+		uint32_t integerWidth() const { return srcWidth() / scale.x; }
+		uint32_t integerHeight() const { return srcHeight() / scale.y; }
+		float srcWidth() const { return srcSize.x ? srcSize.x : tex->width(); }
+		float srcHeight() const { return srcSize.y ? srcSize.y : tex->height(); }
+		// Shows less than all of tex
+		bool cropped() const
+		{
+			return srcOffset.x != 0.0f || srcOffset.y != 0.0f ||
+				srcWidth() != tex->width() || srcHeight() != tex->height();
+		}
 		vec2_t offsetPixelCenter() const
 		{
 			float x = offset.x + 0.5f / scale.x;
 			float y = offset.y + 0.5f / scale.y;
 			return { x, y };
 		}
-	} layers[ k_nMaxLayers ];
+	} layers[ k_nMaxDynamicLayers ];
 
 	uint32_t borderMask() const {
 		uint32_t result = 0;
@@ -210,9 +227,34 @@ struct FrameInfo_t
 		}
 		return result;
 	}
+
+	// Where the pointer was on its surface when the cursor layer was placed,
+	// so the layer can follow the pointer up until the frame goes out.
+	struct CursorLatch_t
+	{
+		bool valid;
+		int layer;
+		uint64_t serial;
+		struct wlr_surface *surface;
+		// The layer's offset is -(origin + surface-local position * scale)
+		vec2_t origin;
+		float scale;
+	} cursorLatch;
+
+	// Moves the cursor layer to where the pointer is now, returns whether
+	// it moved.
+	bool latchCursor();
 };
 
 extern bool g_bIsCompositeDebug;
+extern bool g_bDynamicComposite;
+
+// Layers a frame may have; anything past k_nMaxLayers composites with the
+// dynamic blit only.
+static inline int vulkan_max_layers( void )
+{
+	return g_bDynamicComposite ? k_nMaxDynamicLayers : k_nMaxLayers;
+}
 
 bool vulkan_init(void);
 bool vulkan_init_formats(void);
@@ -220,11 +262,27 @@ bool vulkan_make_output(void);
 
 std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_dmabuf( struct wlr_dmabuf_attributes *pDMA );
 std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_bits( uint32_t width, uint32_t height, uint32_t contentWidth, uint32_t contentHeight, uint32_t drmFormat, CVulkanTexture::createFlags texCreateFlags, void *bits );
+// pTex has to have been made by vulkan_create_texture_from_bits, and not be on screen.
+void vulkan_update_texture_from_bits( std::shared_ptr<CVulkanTexture> pTex, uint32_t drmFormat, void *bits );
 std::shared_ptr<CVulkanTexture> vulkan_create_texture_from_wlr_buffer( struct wlr_buffer *buf );
 
 bool vulkan_composite( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture );
 std::shared_ptr<CVulkanTexture> vulkan_get_last_output_image( void );
+// Composites frameInfo's layers with alpha, into the top-left width x height
+// of an image fit for an overlay plane. Returns the image, which is the one
+// not on screen until vulkan_flip_partial_image says it's going there.
+std::shared_ptr<CVulkanTexture> vulkan_composite_partial( const struct FrameInfo_t *frameInfo, uint32_t width, uint32_t height );
+void vulkan_flip_partial_image( void );
+// Has an intermediate image for FSR, NIS or blur at this size made in the
+// background, ahead of the first frame that needs it. Returns right away.
+void vulkan_prepare_tmp_images( uint32_t width, uint32_t height );
 std::shared_ptr<CVulkanTexture> vulkan_acquire_screenshot_texture(bool exportable);
+// Reproduces frameInfo in pScreenshotTexture without touching the output
+// images, for frames that went to scanout. Returns the submission to wait for
+// before reading it, 0 on failure.
+uint64_t vulkan_screenshot( const struct FrameInfo_t *frameInfo, std::shared_ptr<CVulkanTexture> pScreenshotTexture );
+// Safe from any thread.
+void vulkan_wait_for_submission( uint64_t sequence );
 
 void vulkan_present_to_window( void );
 
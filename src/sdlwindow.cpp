@@ -163,6 +163,10 @@ void inputSDLThreadRun( void )
 							g_upscaler = (g_upscaler == GamescopeUpscaler::NIS) ? 
 								GamescopeUpscaler::BLIT : GamescopeUpscaler::NIS;
 							break;
+						case KEY_K:
+							g_upscaler = (g_upscaler == GamescopeUpscaler::SHARP) ?
+								GamescopeUpscaler::BLIT : GamescopeUpscaler::SHARP;
+							break;
 						case KEY_I:
 							g_upscalerSharpness = std::min(20, g_upscalerSharpness + 1);
 							break;
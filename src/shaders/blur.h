@@ -5,11 +5,12 @@ vec4 textureCond(sampler2D layerSampler, uint layerIdx, vec2 pos, bool unnormali
 #ifndef BLUR_DONT_SCALE
     coord = ((coord + u_offset[layerIdx]) * u_scale[layerIdx]);
 
-    if (coord.x < 0.0f       || coord.y < 0.0f ||
-        coord.x >= texSize.x || coord.y >= texSize.y) {
+    if (outsideSource(layerIdx, coord)) {
         float border = (u_borderMask & (1u << layerIdx)) != 0 ? 1.0f : 0.0f;
         return vec4(0.0f, 0.0f, 0.0f, border);
     }
+
+    coord = clampToSource(layerIdx, coord);
 #endif
 
     if (!unnormalized)
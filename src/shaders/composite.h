@@ -46,18 +46,45 @@ void compositing_debug(uvec2 coord) {
     }
 }
 
-vec4 sampleLayer(sampler2D layerSampler, uint layerIdx, vec2 uv, bool unnormalized) {
+// Shaders with a layer table bring their own, the rest only read the source
+// rects of the sampler slots from it.
+#ifndef COMPOSITE_LAYER_TABLE
+layout(binding = 3, std430)
+readonly buffer layer_table_t {
+    uvec4 u_layerTableHeader;
+    layer_t u_layers[VKR_LAYER_TABLE_SIZE];
+};
+#endif
+
+bool outsideSource(uint slot, vec2 coord) {
+    return coord.x < u_layers[slot].srcMin.x  || coord.y < u_layers[slot].srcMin.y ||
+           coord.x >= u_layers[slot].srcMax.x || coord.y >= u_layers[slot].srcMax.y;
+}
+
+// Keeps filtering from pulling in texels past the source rect
+vec2 clampToSource(uint slot, vec2 coord) {
+    return clamp(coord, u_layers[slot].srcMin + 0.5f, u_layers[slot].srcMax - 0.5f);
+}
+
+#ifndef COMPOSITE_LAYER_TABLE
+// layerIdx indexes the push constants, slot the samplers and source rects
+vec4 sampleLayer(sampler2D layerSampler, uint layerIdx, uint slot, vec2 uv, bool unnormalized) {
     vec2 coord = ((uv + u_offset[layerIdx]) * u_scale[layerIdx]);
-    vec2 texSize = textureSize(layerSampler, 0);
 
-    if (coord.x < 0.0f       || coord.y < 0.0f ||
-        coord.x >= texSize.x || coord.y >= texSize.y) {
+    if (outsideSource(slot, coord)) {
         float border = (u_borderMask & (1u << layerIdx)) != 0 ? 1.0f : 0.0f;
         return vec4(0.0f, 0.0f, 0.0f, border);
     }
 
+    coord = clampToSource(slot, coord);
+
     if (!unnormalized)
-        coord /= texSize;
+        coord /= textureSize(layerSampler, 0);
 
     return textureLod(layerSampler, coord, 0.0f);
 }
+
+vec4 sampleLayer(sampler2D layerSampler, uint layerIdx, vec2 uv, bool unnormalized) {
+    return sampleLayer(layerSampler, layerIdx, layerIdx, uv, unnormalized);
+}
+#endif
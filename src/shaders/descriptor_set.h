@@ -9,3 +9,18 @@ layout(constant_id = 4) const int  c_blur_layer_count = 0;
 layout(binding = 0, rgba8) writeonly uniform image2D dst;
 layout(binding = 1) uniform sampler2D s_samplers[VKR_SAMPLER_SLOTS];
 layout(binding = 2) uniform sampler2D s_ycbcr_samplers[VKR_SAMPLER_SLOTS];
+
+// Layer table entry, one per sampler slot. Every dispatch fills in the source
+// rects, the rest only the dynamic blit.
+struct layer_t {
+    vec2 scale;
+    vec2 offset;
+    vec2 texSize;
+    // Part of the texture to show, in texels
+    vec2 srcMin;
+    vec2 srcMax;
+    float opacity;
+    uint texIndex;
+    uint formatClass;
+    uint flags;
+};
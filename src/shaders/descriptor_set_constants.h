@@ -8,4 +8,14 @@
 #define VKR_NIS_COEF_SCALER_SLOT (VKR_BLUR_EXTRA_SLOT + 1u)
 #define VKR_NIS_COEF_USM_SLOT    (VKR_NIS_COEF_SCALER_SLOT + 1u)
 
+// Layer table of the dynamic blit, one entry per sampler slot at most
+#define VKR_LAYER_TABLE_SIZE VKR_SAMPLER_SLOTS
+
+#define VKR_LAYER_FORMAT_RGB   0u
+#define VKR_LAYER_FORMAT_YCBCR 1u
+
+#define VKR_LAYER_FLAG_BORDER  1u
+
+#define VKR_LAYER_TABLE_KEEP_ALPHA 1u
+
 #endif
@@ -38,11 +38,13 @@
 #include <atomic>
 #include <vector>
 #include <algorithm>
+#include <cmath>
 #include <array>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <queue>
+#include <utility>
 
 #include <assert.h>
 #include <stdlib.h>
@@ -56,6 +58,7 @@
 #include <sys/prctl.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
+#include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
@@ -71,6 +74,14 @@
 #include "rendervulkan.hpp"
 #include "steamcompmgr.hpp"
 #include "vblankmanager.hpp"
+#include "framepacing.hpp"
+#include "perfhud.hpp"
+#include "syncobj.hpp"
+#include "appprofiles.hpp"
+#include "commitstats.hpp"
+#include "metrics.hpp"
+#include "control.hpp"
+#include "gamescope_limiter.h"
 #include "sdlwindow.hpp"
 #include "log.hpp"
 
@@ -113,6 +124,8 @@ struct commit_t
 		}
 
 		wlserver_lock();
+		if ( feedback )
+			wlserver_presentation_feedback_discard( feedback );
 		wlr_buffer_unlock( buf );
 		wlserver_unlock();
     }
@@ -122,6 +135,13 @@ struct commit_t
 	std::shared_ptr<CVulkanTexture> vulkanTex;
 	uint64_t commitID = 0;
 	bool done = false;
+	// When the client committed it
+	uint64_t commitTime = 0;
+	// Went out in a frame at least once
+	bool shown = false;
+	// Taken by the first frame this commit is shown in
+	struct wlr_presentation_feedback *feedback = nullptr;
+	struct wlserver_viewport_t viewport = {};
 };
 
 #define MWM_HINTS_FUNCTIONS   1
@@ -202,6 +222,9 @@ struct win {
 	unsigned int mouseMoved;
 
 	struct wlserver_surface surface;
+	// Native Wayland toplevel this window stands for instead of an X11 one.
+	// Identity only, never dereferenced.
+	struct wlr_surface *xdgSurface;
 
 	xwayland_ctx_t *ctx;
 
@@ -246,6 +269,8 @@ uint32_t		lastPublishedInputCounter;
 
 bool			focusDirty = false;
 bool			hasRepaint = false;
+// New frame from the focused game that may be flipped without waiting for vblank
+bool			hasAsyncRepaint = false;
 
 unsigned long	damageSequence = 0;
 
@@ -267,12 +292,20 @@ std::mutex g_SteamCompMgrXWaylandServerMutex;
 uint64_t g_SteamCompMgrVBlankTime = 0;
 
 static int g_nSteamCompMgrTargetFPS = 0;
+// Frame rates for Xwayland servers that don't have the focused window,
+// -1 to keep them at the refresh rate and 0 to pause them.
+static int g_nBackgroundFPS = -1;
+static int g_nSteamBackgroundFPS = -1;
 static uint64_t g_uDynamicRefreshEqualityTime = 0;
 static int g_nDynamicRefreshRate = 0;
+static bool g_bAllowTearing = false;
 // Delay to stop modes flickering back and forth.
 static const uint64_t g_uDynamicRefreshDelay = 600'000'000; // 600ms
+// X events handled per main loop iteration for servers without input focus,
+// so an event storm on one of them can't hold up painting the focused game.
+static const uint32_t g_uUnfocusedX11EventBudget = 64;
 
-static int g_nRuntimeInfoFd = -1;
+static gamescope_limiter_page_t *g_pLimiterPage = nullptr;
 
 bool g_bFSRActive = false;
 
@@ -301,6 +334,15 @@ enum HeldCommitTypes_t
 std::array<std::shared_ptr<commit_t>, HELD_COMMIT_COUNT> g_HeldCommits;
 bool g_bPendingFade = false;
 
+// Native Wayland toplevels. They aren't X11 windows, but hang off the first
+// Xwayland's context for cursor and done commit bookkeeping.
+static std::vector< win * > g_vecXdgWindows;
+
+// Focused game frame held back by frame pacing until its vblank comes up
+static std::shared_ptr<commit_t> g_PacedCommit;
+// A new game frame was picked for the base plane and not painted yet
+static bool g_bNewBaseFrame = false;
+
 /* opacity property name; sometime soon I'll write up an EWMH spec for it */
 #define OPACITY_PROP		"_NET_WM_WINDOW_OPACITY"
 #define GAME_PROP			"STEAM_GAME"
@@ -333,7 +375,6 @@ unsigned int	lastSampledFrameTime;
 float			currentFrameRate;
 
 static bool		debugFocus = false;
-static bool		drawDebugInfo = false;
 static bool		debugEvents = false;
 bool			steamMode = false;
 static bool		alwaysComposite = false;
@@ -395,6 +436,10 @@ struct WaitListEntry_t
 	// steamcompmgr thread in handle_done_commits, it is worth it.
 	bool mangoapp_nudge;
 	uint64_t commitID;
+	// Waited on instead of fence for explicitly synced clients
+	std::shared_ptr<struct wlserver_timeline> acquireTimeline;
+	uint64_t acquirePoint;
+	uint64_t queueTime;
 };
 
 sem waitListSem;
@@ -435,15 +480,25 @@ retry:
 	assert( bFound == true );
 
 	gpuvis_trace_begin_ctx_printf( entry.commitID, "wait fence" );
-	struct pollfd fd = { entry.fence, POLLOUT, 0 };
-	int ret = poll( &fd, 1, 100 );
-	if ( ret < 0 )
+	if ( entry.acquireTimeline )
+	{
+		syncobj_timeline_wait( entry.acquireTimeline, entry.acquirePoint, 100'000'000 );
+		entry.acquireTimeline = nullptr;
+	}
+	else
 	{
-		xwm_log.errorf_errno( "failed to poll fence FD" );
+		struct pollfd fd = { entry.fence, POLLOUT, 0 };
+		int ret = poll( &fd, 1, 100 );
+		if ( ret < 0 )
+		{
+			xwm_log.errorf_errno( "failed to poll fence FD" );
+		}
+
+		close( entry.fence );
 	}
 	gpuvis_trace_end_ctx_printf( entry.commitID, "wait fence" );
 
-	close( entry.fence );
+	commitstats_record( COMMIT_STAGE_FENCE, get_time_in_nanos() - entry.queueTime );
 
 	uint64_t frametime;
 	if ( entry.mangoapp_nudge )
@@ -713,6 +768,7 @@ import_commit ( struct wlr_buffer *buf )
 	{
 		commit->vulkanTex = it->second.vulkanTex;
 		commit->fb_id = it->second.fb_id;
+		metrics_count( METRIC_BUFFER_IMPORT_CACHE_HITS );
 
 		/* Unlock here to avoid deadlock [1],
 		 * drm_lock_fbid calls wlserver_lock.
@@ -744,6 +800,8 @@ import_commit ( struct wlr_buffer *buf )
 	 *		 valid in all cases, even after a rehash." */
 	lock.unlock();
 
+	metrics_count( METRIC_BUFFER_IMPORTS );
+
 	commit->vulkanTex = vulkan_create_texture_from_wlr_buffer( buf );
 	assert( commit->vulkanTex );
 
@@ -852,23 +910,11 @@ void MouseCursor::queryGlobalPosition(int &x, int &y)
 	queryPositions(x, y, winX, winY);
 }
 
-void MouseCursor::queryButtonMask(unsigned int &mask)
-{
-	Window window, child;
-	int rootX, rootY, winX, winY;
-
-	XQueryPointer(m_ctx->dpy, DefaultRootWindow(m_ctx->dpy), &window, &child,
-				  &rootX, &rootY, &winX, &winY, &mask);
-}
-
 void MouseCursor::checkSuspension()
 {
-	unsigned int buttonMask;
-	queryButtonMask(buttonMask);
-
 	bool bWasHidden = m_hideForMovement;
 
-	if (buttonMask & ( Button1Mask | Button2Mask | Button3Mask | Button4Mask | Button5Mask )) {
+	if (m_buttonHeld) {
 		m_hideForMovement = false;
 		m_lastMovedTime = get_time_in_milliseconds();
 
@@ -878,6 +924,7 @@ void MouseCursor::checkSuspension()
 		if (window_wants_no_focus_when_mouse_hidden(window) && bWasHidden)
 		{
 			XWarpPointer(m_ctx->dpy, None, x11_win(m_ctx->focus.inputFocusWindow), 0, 0, 0, 0, m_lastX, m_lastY);
+			m_positionStale = true;
 		}
 	}
 
@@ -898,6 +945,7 @@ void MouseCursor::checkSuspension()
 				m_lastX = m_x;
 				m_lastY = m_y;
 				XWarpPointer(m_ctx->dpy, None, x11_win(m_ctx->focus.inputFocusWindow), 0, 0, 0, 0, window->a.width - 1, window->a.height - 1);
+				m_positionStale = true;
 			}
 		}
 
@@ -912,6 +960,7 @@ void MouseCursor::checkSuspension()
 void MouseCursor::warp(int x, int y)
 {
 	XWarpPointer(m_ctx->dpy, None, x11_win(m_ctx->focus.inputFocusWindow), 0, 0, 0, 0, x, y);
+	m_positionStale = true;
 }
 
 void MouseCursor::resetPosition()
@@ -1094,15 +1143,50 @@ void MouseCursor::move(int x, int y)
 	if ( m_hideForMovement && window_wants_no_focus_when_mouse_hidden(window) )
 	{
 		XWarpPointer(m_ctx->dpy, None, x11_win(m_ctx->focus.inputFocusWindow), 0, 0, 0, 0, m_lastX, m_lastY);
+		m_positionStale = true;
 	}
 	m_hideForMovement = false;
 }
 
+void MouseCursor::syncPosition()
+{
+	wlserver_cursor_t cursor;
+	if (wlserver_get_cursor(m_cursorSerial, &cursor)) {
+		m_cursorSerial = cursor.serial;
+		m_buttonHeld = cursor.bButtonHeld;
+
+		win *window = m_ctx->focus.inputFocusWindow;
+		if (global_focus.inputFocusWindow && global_focus.inputFocusWindow->xdgSurface &&
+			global_focus.inputFocusWindow->ctx == m_ctx)
+			window = global_focus.inputFocusWindow;
+
+		if (cursor.bNeedsXQuery) {
+			// Nested mode motion only goes to the focused server
+			if (m_ctx->xwayland_server == steamcompmgr_get_focused_server())
+				m_positionStale = true;
+		} else if (window && cursor.surface && cursor.surface == window->surface.wlr) {
+			move(window->a.x + cursor.x, window->a.y + cursor.y);
+			m_positionStale = false;
+			m_surface = cursor.surface;
+			m_surfaceX = cursor.x;
+			m_surfaceY = cursor.y;
+			return;
+		}
+		m_surface = nullptr;
+	}
+
+	if (m_positionStale) {
+		int x, y;
+		queryGlobalPosition(x, y);
+		move(x, y);
+		m_positionStale = false;
+		m_surface = nullptr;
+	}
+}
+
 void MouseCursor::updatePosition()
 {
-	int x,y;
-	queryGlobalPosition(x, y);
-	move(x, y);
+	syncPosition();
 	checkSuspension();
 }
 
@@ -1116,43 +1200,80 @@ int MouseCursor::y() const
 	return m_y;
 }
 
-bool MouseCursor::getTexture()
+// Cursor textures are shared by every Xwayland context and kept around after
+// use, apps cycle between a handful of cursors and switching between them
+// shouldn't cost an upload each time.
+struct cursor_cache_entry_t
 {
-	if (!m_dirty) {
-		return !m_imageEmpty;
-	}
+	uint32_t width, height;
+	uint32_t surfaceWidth, surfaceHeight;
+	// Compared on lookup, so a hash collision can't show the wrong cursor
+	std::vector<uint32_t> pixels;
+
+	// Null if the cursor is fully translucent
+	std::shared_ptr<CVulkanTexture> texture;
+	uint64_t lastUsed;
+};
 
-	auto *image = XFixesGetCursorImage(m_ctx->dpy);
+static std::unordered_map<uint64_t, cursor_cache_entry_t> g_cursorCache;
+static uint64_t g_cursorCacheClock = 0;
+static const size_t k_nMaxCachedCursors = 64;
 
-	if (!image) {
-		return false;
-	}
+static uint64_t hash_cursor_pixels( const std::vector<uint32_t> &pixels, uint32_t width, uint32_t height )
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ull;
+	auto mix = [&hash]( uint32_t value ) {
+		hash ^= value;
+		hash *= 0x100000001b3ull;
+	};
 
-	m_hotspotX = image->xhot;
-	m_hotspotY = image->yhot;
+	mix( width );
+	mix( height );
+	for ( uint32_t pixel : pixels )
+		mix( pixel );
 
-	uint32_t surfaceWidth;
-	uint32_t surfaceHeight;
-	if ( BIsNested() == false && alwaysComposite == false )
+	return hash;
+}
+
+static cursor_cache_entry_t *
+lookup_cursor_texture( std::vector<uint32_t> &&pixels, uint32_t width, uint32_t height, uint32_t surfaceWidth, uint32_t surfaceHeight )
+{
+	uint64_t hash = hash_cursor_pixels( pixels, width, height );
+
+	auto iter = g_cursorCache.find( hash );
+	if ( iter != g_cursorCache.end() )
 	{
-		surfaceWidth = g_DRM.cursor_width;
-		surfaceHeight = g_DRM.cursor_height;
+		cursor_cache_entry_t *entry = &iter->second;
+		if ( entry->width == width && entry->height == height &&
+			 entry->surfaceWidth == surfaceWidth && entry->surfaceHeight == surfaceHeight &&
+			 entry->pixels == pixels )
+		{
+			entry->lastUsed = ++g_cursorCacheClock;
+			metrics_count( METRIC_CURSOR_CACHE_HITS );
+			return entry;
+		}
+
+		// Collision or the cursor plane size changed, replace it
+		g_cursorCache.erase( iter );
 	}
-	else
+
+	metrics_count( METRIC_CURSOR_CACHE_MISSES );
+
+	if ( g_cursorCache.size() >= k_nMaxCachedCursors )
 	{
-		surfaceWidth = image->width;
-		surfaceHeight = image->height;
+		auto oldest = std::min_element( g_cursorCache.begin(), g_cursorCache.end(),
+			[]( const auto &a, const auto &b ) { return a.second.lastUsed < b.second.lastUsed; } );
+		g_cursorCache.erase( oldest );
 	}
 
-	m_texture = nullptr;
-
 	// Assume the cursor is fully translucent unless proven otherwise.
 	bool bNoCursor = true;
 
 	auto cursorBuffer = std::vector<uint32_t>(surfaceWidth * surfaceHeight);
-	for (int i = 0; i < image->height; i++) {
-		for (int j = 0; j < image->width; j++) {
-			cursorBuffer[i * surfaceWidth + j] = image->pixels[i * image->width + j];
+	for (uint32_t i = 0; i < height; i++) {
+		for (uint32_t j = 0; j < width; j++) {
+			cursorBuffer[i * surfaceWidth + j] = pixels[i * width + j];
 
 			if ( cursorBuffer[i * surfaceWidth + j] & 0xff000000 ) {
 				bNoCursor = false;
@@ -1160,32 +1281,72 @@ bool MouseCursor::getTexture()
 		}
 	}
 
-	if (bNoCursor != m_imageEmpty) {
-		m_imageEmpty = bNoCursor;
+	cursor_cache_entry_t entry;
+	entry.width = width;
+	entry.height = height;
+	entry.surfaceWidth = surfaceWidth;
+	entry.surfaceHeight = surfaceHeight;
+	entry.pixels = std::move( pixels );
+	entry.lastUsed = ++g_cursorCacheClock;
 
-		if (m_imageEmpty) {
-// 				fprintf( stderr, "grab?\n" );
+	if ( !bNoCursor )
+	{
+		CVulkanTexture::createFlags texCreateFlags;
+		if ( BIsNested() == false )
+		{
+			texCreateFlags.bFlippable = true;
+			texCreateFlags.bLinear = true; // cursor buffer needs to be linear
+			// TODO: choose format & modifiers from cursor plane
 		}
+
+		entry.texture = vulkan_create_texture_from_bits(surfaceWidth, surfaceHeight, width, height, DRM_FORMAT_ARGB8888, texCreateFlags, cursorBuffer.data());
+		assert(entry.texture);
+	}
+
+	return &( g_cursorCache[ hash ] = std::move( entry ) );
+}
+
+bool MouseCursor::getTexture()
+{
+	if (!m_dirty) {
+		return !m_imageEmpty;
 	}
 
-	if (m_imageEmpty) {
+	auto *image = XFixesGetCursorImage(m_ctx->dpy);
+
+	if (!image) {
 		return false;
 	}
 
-	CVulkanTexture::createFlags texCreateFlags;
-	if ( BIsNested() == false )
+	m_hotspotX = image->xhot;
+	m_hotspotY = image->yhot;
+
+	uint32_t surfaceWidth;
+	uint32_t surfaceHeight;
+	if ( BIsNested() == false && alwaysComposite == false )
+	{
+		surfaceWidth = g_DRM.cursor_width;
+		surfaceHeight = g_DRM.cursor_height;
+	}
+	else
 	{
-		texCreateFlags.bFlippable = true;
-		texCreateFlags.bLinear = true; // cursor buffer needs to be linear
-		// TODO: choose format & modifiers from cursor plane
+		surfaceWidth = image->width;
+		surfaceHeight = image->height;
 	}
 
-	m_texture = vulkan_create_texture_from_bits(surfaceWidth, surfaceHeight, image->width, image->height, DRM_FORMAT_ARGB8888, texCreateFlags, cursorBuffer.data());
-	assert(m_texture);
+	// XFixes hands out longs, even for 32-bit pixels
+	auto pixels = std::vector<uint32_t>(image->width * image->height);
+	for (size_t i = 0; i < pixels.size(); i++)
+		pixels[i] = image->pixels[i];
+
+	cursor_cache_entry_t *entry = lookup_cursor_texture( std::move( pixels ), image->width, image->height, surfaceWidth, surfaceHeight );
 	XFree(image);
+
+	m_texture = entry->texture;
+	m_imageEmpty = m_texture == nullptr;
 	m_dirty = false;
 
-	return true;
+	return !m_imageEmpty;
 }
 
 void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
@@ -1194,9 +1355,7 @@ void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
 		return;
 	}
 
-	int rootX, rootY, winX, winY;
-	queryPositions(rootX, rootY, winX, winY);
-	move(rootX, rootY);
+	syncPosition();
 
 	// Also need new texture
 	if (!getTexture()) {
@@ -1233,13 +1392,13 @@ void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
 	cursorOffsetY = (currentOutputHeight - sourceHeight * currentScaleRatio * globalScaleRatio) / 2.0f;
 
 	// Actual point on scaled screen where the cursor hotspot should be
-	scaledX = (winX - window->a.x) * currentScaleRatio * globalScaleRatio + cursorOffsetX;
-	scaledY = (winY - window->a.y) * currentScaleRatio * globalScaleRatio + cursorOffsetY;
+	scaledX = (m_x - window->a.x) * currentScaleRatio * globalScaleRatio + cursorOffsetX;
+	scaledY = (m_y - window->a.y) * currentScaleRatio * globalScaleRatio + cursorOffsetY;
 
 	if ( zoomScaleRatio != 1.0 )
 	{
-		scaledX += ((sourceWidth / 2) - winX) * currentScaleRatio * globalScaleRatio;
-		scaledY += ((sourceHeight / 2) - winY) * currentScaleRatio * globalScaleRatio;
+		scaledX += ((sourceWidth / 2) - m_x) * currentScaleRatio * globalScaleRatio;
+		scaledY += ((sourceHeight / 2) - m_y) * currentScaleRatio * globalScaleRatio;
 	}
 
 	// Apply the cursor offset inside the texture using the display scale
@@ -1265,20 +1424,148 @@ void MouseCursor::paint(win *window, win *fit, struct FrameInfo_t *frameInfo)
 
 	layer->linearFilter = false;
 	layer->blackBorder = false;
+
+	// Let the layer follow the pointer until the frame goes out. Zoom keeps
+	// the cursor still and moves everything else, so that can't be latched.
+	if ( m_surface && zoomScaleRatio == 1.0 )
+	{
+		float scale = currentScaleRatio * globalScaleRatio;
+
+		frameInfo->cursorLatch.valid = true;
+		frameInfo->cursorLatch.layer = curLayer;
+		frameInfo->cursorLatch.serial = m_cursorSerial;
+		frameInfo->cursorLatch.surface = m_surface;
+		frameInfo->cursorLatch.origin.x = scaledX - m_surfaceX * scale;
+		frameInfo->cursorLatch.origin.y = scaledY - m_surfaceY * scale;
+		frameInfo->cursorLatch.scale = scale;
+	}
+}
+
+static void
+paint_perfhud( struct FrameInfo_t *frameInfo )
+{
+	if ( frameInfo->layerCount >= vulkan_max_layers() )
+		return;
+
+	std::shared_ptr<CVulkanTexture> tex = perfhud_get_texture( get_time_in_nanos() );
+	if ( !tex )
+		return;
+
+	int curLayer = frameInfo->layerCount++;
+
+	FrameInfo_t::Layer_t *layer = &frameInfo->layers[ curLayer ];
+
+	layer->opacity = 1.0;
+
+	layer->scale.x = 1.0;
+	layer->scale.y = 1.0;
+
+	// Top left corner, a little away from the edges
+	layer->offset.x = -16.0f;
+	layer->offset.y = -16.0f;
+
+	layer->zpos = g_zposPerfHud;
+
+	layer->tex = tex;
+	layer->fbid = BIsNested() ? 0 : tex->fbid();
+
+	layer->linearFilter = false;
+	layer->blackBorder = false;
+}
+
+// Write pCaptureTexture out as a PNG on its own thread, once submission
+// (if non-zero) finished drawing into it.
+static void
+save_screenshot( xwayland_ctx_t *root_ctx, std::shared_ptr<CVulkanTexture> pCaptureTexture, uint64_t submission, bool propertyRequestedScreenshot )
+{
+	assert( pCaptureTexture->format() == VK_FORMAT_B8G8R8A8_UNORM );
+
+	std::thread screenshotThread = std::thread([=] {
+		pthread_setname_np( pthread_self(), "gamescope-scrsh" );
+
+		if ( submission != 0 )
+			vulkan_wait_for_submission( submission );
+
+		const uint8_t *mappedData = reinterpret_cast<const uint8_t *>(pCaptureTexture->mappedData());
+
+		// Make our own copy of the image to remove the alpha channel.
+		auto imageData = std::vector<uint8_t>(currentOutputWidth * currentOutputHeight * 4);
+		const uint32_t comp = 4;
+		const uint32_t pitch = currentOutputWidth * comp;
+		for (uint32_t y = 0; y < currentOutputHeight; y++)
+		{
+			for (uint32_t x = 0; x < currentOutputWidth; x++)
+			{
+				// BGR...
+				imageData[y * pitch + x * comp + 0] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 2];
+				imageData[y * pitch + x * comp + 1] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 1];
+				imageData[y * pitch + x * comp + 2] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 0];
+				imageData[y * pitch + x * comp + 3] = 255;
+			}
+		}
+
+		char pTimeBuffer[1024] = "/tmp/gamescope.png";
+
+		if ( !propertyRequestedScreenshot )
+		{
+			time_t currentTime = time(0);
+			struct tm *localTime = localtime( &currentTime );
+			strftime( pTimeBuffer, sizeof( pTimeBuffer ), "/tmp/gamescope_%Y-%m-%d_%H-%M-%S.png", localTime );
+		}
+
+		if ( stbi_write_png(pTimeBuffer, currentOutputWidth, currentOutputHeight, 4, imageData.data(), pitch) )
+		{
+			xwm_log.infof("Screenshot saved to %s", pTimeBuffer);
+		}
+		else
+		{
+			xwm_log.errorf( "Failed to save screenshot to %s", pTimeBuffer );
+		}
+
+		XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeScreenShotAtom );
+	});
+
+	screenshotThread.detach();
 }
 
 struct BaseLayerInfo_t
 {
 	float scale[2];
 	float offset[2];
+	float srcOffset[2];
+	float srcSize[2];
 	float opacity;
 };
 
 std::array< BaseLayerInfo_t, HELD_COMMIT_COUNT > g_CachedPlanes = {};
 
+// Commits shown by the frame being painted, whose presentation feedback goes
+// out with it
+static std::vector< std::shared_ptr<commit_t> > g_FrameCommits;
+
+static std::vector< struct wlr_presentation_feedback * >
+take_frame_feedbacks( void )
+{
+	std::vector< struct wlr_presentation_feedback * > feedbacks;
+	uint64_t now = get_time_in_nanos();
+	for ( const std::shared_ptr<commit_t> &commit : g_FrameCommits )
+	{
+		if ( !commit->shown && commit->commitTime != 0 )
+			metrics_observe( METRIC_COMMIT_TO_SCANOUT, now - commit->commitTime );
+		commit->shown = true;
+
+		if ( commit->feedback )
+			feedbacks.push_back( std::exchange( commit->feedback, nullptr ) );
+	}
+	g_FrameCommits.clear();
+	return feedbacks;
+}
+
 static void
 paint_cached_base_layer(const std::shared_ptr<commit_t>& commit, const BaseLayerInfo_t& base, struct FrameInfo_t *frameInfo, float flOpacityScale)
 {
+	g_FrameCommits.push_back( commit );
+
 	int curLayer = frameInfo->layerCount++;
 
 	FrameInfo_t::Layer_t *layer = &frameInfo->layers[ curLayer ];
@@ -1287,6 +1574,10 @@ paint_cached_base_layer(const std::shared_ptr<commit_t>& commit, const BaseLayer
 	layer->scale.y = base.scale[1];
 	layer->offset.x = base.offset[0];
 	layer->offset.y = base.offset[1];
+	layer->srcOffset.x = base.srcOffset[0];
+	layer->srcOffset.y = base.srcOffset[1];
+	layer->srcSize.x = base.srcSize[0];
+	layer->srcSize.y = base.srcSize[1];
 	layer->opacity = base.opacity * flOpacityScale;
 
 	layer->tex = commit->vulkanTex;
@@ -1469,9 +1760,26 @@ paint_window(win *w, win *scaleW, struct FrameInfo_t *frameInfo,
 		layer->zpos = g_zposExternalOverlay;
 	}
 
+	const struct wlserver_viewport_t &viewport = lastCommit->viewport;
+	if ( viewport.enabled && w->a.width > 0 && w->a.height > 0 )
+	{
+		// The window shows only part of the buffer, possibly at another size
+		// than the buffer's. Scaling by that and shifting to where that part
+		// starts keeps the window itself exactly where it was.
+		layer->scale.x *= viewport.srcWidth / w->a.width;
+		layer->scale.y *= viewport.srcHeight / w->a.height;
+		layer->offset.x += viewport.srcX / layer->scale.x;
+		layer->offset.y += viewport.srcY / layer->scale.y;
+
+		layer->srcOffset = { viewport.srcX, viewport.srcY };
+		layer->srcSize = { viewport.srcWidth, viewport.srcHeight };
+	}
+
 	layer->tex = lastCommit->vulkanTex;
 	layer->fbid = lastCommit->fb_id;
 
+	g_FrameCommits.push_back( lastCommit );
+
 	layer->linearFilter = (w->isOverlay || w->isExternalOverlay) ? true : g_bFilterGameWindow;
 
 	if ( flags & PaintWindowFlag::BasePlane )
@@ -1481,6 +1789,10 @@ paint_window(win *w, win *scaleW, struct FrameInfo_t *frameInfo,
 		basePlane.scale[1] = layer->scale.y;
 		basePlane.offset[0] = layer->offset.x;
 		basePlane.offset[1] = layer->offset.y;
+		basePlane.srcOffset[0] = layer->srcOffset.x;
+		basePlane.srcOffset[1] = layer->srcOffset.y;
+		basePlane.srcSize[0] = layer->srcSize.x;
+		basePlane.srcSize[1] = layer->srcSize.y;
 		basePlane.opacity = layer->opacity;
 
 		g_CachedPlanes[ HELD_COMMIT_BASE ] = basePlane;
@@ -1507,8 +1819,120 @@ static void update_touch_scaling( const struct FrameInfo_t *frameInfo )
 	focusedWindowOffsetY = frameInfo->layers[ frameInfo->layerCount - 1 ].offset.y;
 }
 
-static void
-paint_all()
+// Composites layers [first, last] on their own into an overlay plane, so the
+// layers around them can still be scanned out directly. Only the area those
+// layers cover is composited, a small shm popup over a game costs a small blit.
+static int
+paint_partial_composite_range( struct FrameInfo_t *frameInfo, int first, int last )
+{
+	float x0 = currentOutputWidth, y0 = currentOutputHeight, x1 = 0.0f, y1 = 0.0f;
+	for ( int i = first; i <= last; i++ )
+	{
+		const FrameInfo_t::Layer_t *layer = &frameInfo->layers[ i ];
+		x0 = std::min( x0, -layer->offset.x );
+		y0 = std::min( y0, -layer->offset.y );
+		x1 = std::max( x1, -layer->offset.x + layer->tex->width() / layer->scale.x );
+		y1 = std::max( y1, -layer->offset.y + layer->tex->height() / layer->scale.y );
+	}
+
+	int bx = std::max( 0, (int)std::floor( x0 ) );
+	int by = std::max( 0, (int)std::floor( y0 ) );
+	int bx1 = std::min( (int)currentOutputWidth, (int)std::ceil( x1 ) );
+	int by1 = std::min( (int)currentOutputHeight, (int)std::ceil( y1 ) );
+	if ( bx1 <= bx || by1 <= by )
+		return -EINVAL;
+
+	uint32_t width = bx1 - bx;
+	uint32_t height = by1 - by;
+
+	struct FrameInfo_t partialFrameInfo = *frameInfo;
+	partialFrameInfo.layerCount = last - first + 1;
+	for ( int i = first; i <= last; i++ )
+	{
+		FrameInfo_t::Layer_t *layer = &partialFrameInfo.layers[ i - first ];
+		*layer = frameInfo->layers[ i ];
+		layer->offset.x += bx;
+		layer->offset.y += by;
+		layer->blackBorder = false;
+	}
+
+	// Lands in the image that isn't on screen, and keeps doing so until a
+	// prepare with it goes through.
+	std::shared_ptr<CVulkanTexture> partialImage = vulkan_composite_partial( &partialFrameInfo, width, height );
+	if ( partialImage == nullptr )
+		return -EINVAL;
+
+	struct FrameInfo_t hybridFrameInfo = *frameInfo;
+	hybridFrameInfo.layerCount = frameInfo->layerCount - ( last - first );
+
+	FrameInfo_t::Layer_t *partialLayer = &hybridFrameInfo.layers[ first ];
+	*partialLayer = {};
+	partialLayer->tex = partialImage;
+	partialLayer->fbid = partialLayer->tex->fbid();
+	partialLayer->zpos = frameInfo->layers[ first ].zpos;
+	partialLayer->offset.x = -bx;
+	partialLayer->offset.y = -by;
+	partialLayer->scale.x = 1.0f;
+	partialLayer->scale.y = 1.0f;
+	partialLayer->srcSize.x = width;
+	partialLayer->srcSize.y = height;
+	partialLayer->opacity = 1.0f;
+	partialLayer->linearFilter = false;
+
+	for ( int i = last + 1; i < frameInfo->layerCount; i++ )
+		hybridFrameInfo.layers[ i - ( last - first ) ] = frameInfo->layers[ i ];
+
+	int ret = drm_prepare( &g_DRM, false, &hybridFrameInfo );
+	if ( ret == 0 )
+	{
+		*frameInfo = hybridFrameInfo;
+		vulkan_flip_partial_image();
+	}
+
+	return ret;
+}
+
+// Called when the frame as-is can't be scanned out. Tries to composite as
+// little of it as possible instead of all of it.
+static int
+paint_partial_composite( struct FrameInfo_t *frameInfo )
+{
+	// Rotation happens in the full composite
+	if ( BIsNested() || !g_bUseLayers || g_bRotated || frameInfo->layerCount < 2 )
+		return -EINVAL;
+
+	// The layers we have no FB for, usually shm buffers
+	int first = -1, last = -1;
+	for ( int i = 0; i < frameInfo->layerCount; i++ )
+	{
+		if ( frameInfo->layers[ i ].fbid == 0 )
+		{
+			if ( first < 0 )
+				first = i;
+			last = i;
+		}
+	}
+
+	// Nothing to put the rest on top of
+	if ( first == 0 )
+		return -EINVAL;
+
+	int ret = -EINVAL;
+	if ( first > 0 )
+		ret = paint_partial_composite_range( frameInfo, first, last );
+
+	// Out of planes, or liftoff didn't like the layers in between: flatten
+	// everything above the base layer onto one plane.
+	if ( ret != 0 && ret != -EACCES && ( first != 1 || last != frameInfo->layerCount - 1 ) )
+		ret = paint_partial_composite_range( frameInfo, 1, frameInfo->layerCount - 1 );
+
+	return ret;
+}
+
+// bOffVblank paints are for frames that tear out as soon as they are ready.
+// Returns false if this frame can't, and is left for the next vblank.
+static bool
+paint_all( bool bOffVblank )
 {
 	gamescope_xwayland_server_t *root_server = wlserver_get_xwayland_server(0);
 	xwayland_ctx_t *root_ctx = root_server->ctx.get();
@@ -1517,6 +1941,9 @@ paint_all()
 
 	paintID++;
 	gpuvis_trace_begin_ctx_printf( paintID, "paint_all" );
+
+	// Anything left from a frame we bailed out of goes with this one instead
+	g_FrameCommits.clear();
 	win	*w;
 	win	*overlay;
 	win *externalOverlay;
@@ -1542,6 +1969,13 @@ paint_all()
 
 		stats_printf( "fps=%f\n", currentFrameRate );
 
+		FramePacingStats_t pacingStats;
+		framepacing_take_stats( &pacingStats );
+		stats_printf( "pacing=%i\n", pacingStats.bPacing ? 1 : 0 );
+		stats_printf( "pacing_frametime=%f\n", pacingStats.flAppFrameTimeMS );
+		stats_printf( "pacing_error=%f\n", pacingStats.flPacingErrorMS );
+		stats_printf( "pacing_judder=%u/%u\n", pacingStats.uJudderFrames, pacingStats.uPresentedFrames );
+
 		if ( w && w->isSteam )
 		{
 			stats_printf( "focus=steam\n" );
@@ -1617,8 +2051,12 @@ paint_all()
 				paint_window(w, w, &frameInfo, global_focus.cursor, PaintWindowFlag::BasePlane | PaintWindowFlag::DrawBorders, 1.0f, override);
 
 				bool needsScaling = frameInfo.layers[0].scale.x < 1.0f && frameInfo.layers[0].scale.y < 1.0f;
-				frameInfo.useFSRLayer0 = g_upscaler == GamescopeUpscaler::FSR && needsScaling;
-				frameInfo.useNISLayer0 = g_upscaler == GamescopeUpscaler::NIS && needsScaling;
+				// FSR and NIS read the whole buffer, so a viewport crop falls
+				// back to the other filters, which clip to it.
+				bool bCropped = frameInfo.layers[0].cropped();
+				frameInfo.useFSRLayer0 = g_upscaler == GamescopeUpscaler::FSR && needsScaling && !bCropped;
+				frameInfo.useNISLayer0 = g_upscaler == GamescopeUpscaler::NIS && needsScaling && !bCropped;
+				frameInfo.useSharpLayer0 = g_upscaler == GamescopeUpscaler::SHARP && needsScaling;
 			}
 			update_touch_scaling( &frameInfo );
 		}
@@ -1633,7 +2071,8 @@ paint_all()
 	// with an offset.
 	// Josh: No override if we're streaming video
 	// as we will have too many layers. Better to be safe than sorry.
-	if ( override && w && !w->isSteamStreamingClient )
+	// The dynamic blit has room for it.
+	if ( override && w && ( !w->isSteamStreamingClient || g_bDynamicComposite ) )
 	{
 		paint_window(override, w, &frameInfo, global_focus.cursor, 0, 1.0f, override);
 		// Don't update touch scaling for frameInfo. We don't ever make it our
@@ -1675,6 +2114,7 @@ paint_all()
 	}
 
 	bool bDrewCursor = false;
+	int nCursorLayer = -1;
 
 	// Draw cursor if we need to
 	if (input) {
@@ -1684,18 +2124,61 @@ paint_all()
 			&frameInfo);
 		int nLayerCountAfter = frameInfo.layerCount;
 		bDrewCursor = nLayerCountAfter > nLayerCountBefore;
+		if ( bDrewCursor )
+			nCursorLayer = nLayerCountBefore;
+	}
+
+	// What the HUD adds on top doesn't count towards conditional blur, or
+	// turning it on would change what it measures. It does count for
+	// tearing: a frame with the HUD has two planes, and those don't flip
+	// async.
+	int nContentLayers = frameInfo.layerCount;
+
+	if ( g_bPerfHud )
+		paint_perfhud( &frameInfo );
+
+	// Only the focused game going straight to the primary plane may tear,
+	// anything we composite stays in sync with vblank.
+	bool bAsyncFlip = g_bAllowTearing && gameFocused && frameInfo.layerCount == 1 && frameInfo.layers[ 0 ].zpos == g_zposBase;
+
+	// Painting off-vblank for anything else would send it out at some random
+	// time, and then block in the flip wait.
+	if ( bOffVblank && ( !bAsyncFlip || alwaysComposite || g_BlurMode != BLUR_MODE_OFF ||
+	                     frameInfo.useFSRLayer0 || frameInfo.useNISLayer0 || frameInfo.useSharpLayer0 ||
+	                     ( !g_bFilterGameWindow && frameInfo.layers[ 0 ].scale.x != 1.0f && frameInfo.layers[ 0 ].scale.y != 1.0f ) ) )
+	{
+		gpuvis_trace_end_ctx_printf( paintID, "paint_all" );
+		return false;
 	}
 
+	// Have what blur or an upscaler renders into made before either can be
+	// turned on, so the frame that does doesn't wait on the allocation. Blur
+	// needs it at the output size, and is only ever asked for by the Steam
+	// UI or an overlay. FSR and NIS need it at the size the base layer is
+	// scaled to, whenever it is scaled.
+	if ( steamMode || overlay || externalOverlay )
+		vulkan_prepare_tmp_images( currentOutputWidth, currentOutputHeight );
+	if ( frameInfo.layerCount > 0 && ( frameInfo.layers[ 0 ].scale.x != 1.0f || frameInfo.layers[ 0 ].scale.y != 1.0f ) )
+		vulkan_prepare_tmp_images( frameInfo.layers[ 0 ].integerWidth(), frameInfo.layers[ 0 ].integerHeight() );
+
 	if ( !bValidContents || ( BIsNested() == false && g_DRM.paused == true ) )
 	{
-		return;
+		return true;
 	}
 
+	// Images we draw into ping-pong, the one up next may still be on screen
+	// until the last flip is done.
+	if ( BIsNested() == false )
+		drm_wait_for_flip( &g_DRM );
+
+	// That can take most of a refresh, put the cursor where the pointer is now
+	frameInfo.latchCursor();
+
 	unsigned int blurFadeTime = get_time_in_milliseconds() - g_BlurFadeStartTime;
 	bool blurFading = blurFadeTime < g_BlurFadeDuration;
 	BlurMode currentBlurMode = blurFading ? std::max(g_BlurMode, g_BlurModeOld) : g_BlurMode;
 
-	if (currentBlurMode && !(frameInfo.layerCount <= 1 && currentBlurMode == BLUR_MODE_COND))
+	if (currentBlurMode && !(nContentLayers <= 1 && currentBlurMode == BLUR_MODE_COND))
 	{
 		frameInfo.blurLayer0 = currentBlurMode;
 		frameInfo.blurRadius = g_BlurRadius;
@@ -1713,6 +2196,16 @@ paint_all()
 
 		frameInfo.useFSRLayer0 = false;
 		frameInfo.useNISLayer0 = false;
+		frameInfo.useSharpLayer0 = false;
+	}
+
+	// Blur, FSR and sharp only have specialized pipelines, which top out at
+	// k_nMaxLayers. NIS finishes with the blit, which copes.
+	if ( frameInfo.layerCount > k_nMaxLayers )
+	{
+		frameInfo.blurLayer0 = BLUR_MODE_OFF;
+		frameInfo.useFSRLayer0 = false;
+		frameInfo.useSharpLayer0 = false;
 	}
 
 	g_bFSRActive = frameInfo.useFSRLayer0;
@@ -1734,6 +2227,12 @@ paint_all()
 
 	bool bCapture = takeScreenshot || pw_buffer != nullptr;
 
+	// Screenshots don't make us composite; if we scan this frame out, it
+	// gets reproduced from its layers once the flip is queued.
+	std::unique_ptr<FrameInfo_t> pScreenshotFrameInfo;
+	if ( takeScreenshot )
+		pScreenshotFrameInfo = std::make_unique<FrameInfo_t>( frameInfo );
+
 	int nTargetRefresh = g_nDynamicRefreshRate && steamcompmgr_window_should_limit_fps( global_focus.focusWindow )// && !global_focus.overlayWindow
 		? g_nDynamicRefreshRate
 		: drm_get_default_refresh( &g_DRM );
@@ -1750,23 +2249,45 @@ paint_all()
 
 	bool bNeedsComposite = BIsNested();
 	bNeedsComposite |= alwaysComposite;
-	bNeedsComposite |= bCapture;
+	bNeedsComposite |= pw_buffer != nullptr;
 	bNeedsComposite |= bWasFirstFrame;
 	bNeedsComposite |= frameInfo.useFSRLayer0;
 	bNeedsComposite |= frameInfo.useNISLayer0;
+	bNeedsComposite |= frameInfo.useSharpLayer0;
 	bNeedsComposite |= frameInfo.blurLayer0;
 	bNeedsComposite |= bNeedsNearest;
-	bNeedsComposite |= bDrewCursor;
+	// amdgpu scales the cursor plane along with the plane under it, so the
+	// cursor only gets a plane of its own when nothing it may be over is
+	// scaled, overlays included.
+	bool bScaledUnderCursor = false;
+	for ( int i = 0; bDrewCursor && i < frameInfo.layerCount; i++ )
+	{
+		if ( i != nCursorLayer && ( frameInfo.layers[ i ].scale.x != 1.0f || frameInfo.layers[ i ].scale.y != 1.0f ) )
+			bScaledUnderCursor = true;
+	}
+	bNeedsComposite |= bScaledUnderCursor;
 
 	if ( !bNeedsComposite )
 	{
-		int ret = drm_prepare( &g_DRM, &frameInfo );
+		int ret = drm_prepare( &g_DRM, bAsyncFlip, &frameInfo );
+
+		// Not every driver can do an async flip of this layer, fall back to a regular one.
+		if ( ret != 0 && ret != -EACCES && bAsyncFlip )
+			ret = drm_prepare( &g_DRM, false, &frameInfo );
+
+		if ( ret != 0 && ret != -EACCES )
+			ret = paint_partial_composite( &frameInfo );
+
 		if ( ret == 0 )
 			bDoComposite = false;
 		else if ( ret == -EACCES )
-			return;
+			return true;
 	}
 
+	// The composite path replaces frameInfo with its output layer
+	uint32_t nFrameLayerCount = frameInfo.layerCount;
+	bool bFrameUpscaled = frameInfo.useFSRLayer0 || frameInfo.useNISLayer0 || frameInfo.useSharpLayer0;
+
 	if ( bDoComposite == true )
 	{
 		std::shared_ptr<CVulkanTexture> pCaptureTexture = nullptr;
@@ -1786,7 +2307,7 @@ paint_all()
 		if ( bResult != true )
 		{
 			xwm_log.errorf("vulkan_composite failed");
-			return;
+			return true;
 		}
 
 		if ( BIsNested() == true )
@@ -1794,7 +2315,20 @@ paint_all()
 			vulkan_present_to_window();
 			// Update the time it took us to present.
 			// TODO: Use Vulkan present timing in future.
-			g_uVblankDrawTimeNS = get_time_in_nanos() - g_SteamCompMgrVBlankTime;
+			uint64_t presentTime = get_time_in_nanos();
+			g_uVblankDrawTimeNS = presentTime - g_SteamCompMgrVBlankTime;
+
+			// Without present timing, all we know is when the frame went
+			// to the host compositor.
+			std::vector< struct wlr_presentation_feedback * > feedbacks = take_frame_feedbacks();
+			if ( !feedbacks.empty() )
+			{
+				uint32_t refresh = g_nNestedRefresh > 0 ? 1'000'000'000u / g_nNestedRefresh : 0;
+
+				wlserver_lock();
+				wlserver_presentation_feedback_presented( feedbacks, presentTime, 0, refresh, 0 );
+				wlserver_unlock();
+			}
 		}
 		else
 		{
@@ -1811,11 +2345,11 @@ paint_all()
 
 			layer->linearFilter = false;
 
-			int ret = drm_prepare( &g_DRM, &frameInfo );
+			int ret = drm_prepare( &g_DRM, false, &frameInfo );
 
 			// Happens when we're VT-switched away
 			if ( ret == -EACCES )
-				return;
+				return true;
 
 			if ( ret != 0 )
 			{
@@ -1830,11 +2364,11 @@ paint_all()
 				drm_rollback( &g_DRM );
 
 				// Try once again to in case we need to fall back to another mode.
-				ret = drm_prepare( &g_DRM, &frameInfo );
+				ret = drm_prepare( &g_DRM, false, &frameInfo );
 
 				// Happens when we're VT-switched away
 				if ( ret == -EACCES )
-					return;
+					return true;
 
 				if ( ret != 0 )
 				{
@@ -1844,58 +2378,14 @@ paint_all()
 				}
 			}
 
+			drm_set_presentation_feedback( &g_DRM, take_frame_feedbacks(), false );
 			drm_commit( &g_DRM, &frameInfo );
 		}
 
 		if ( takeScreenshot )
 		{
 			assert( pCaptureTexture != nullptr );
-			assert( pCaptureTexture->format() == VK_FORMAT_B8G8R8A8_UNORM );
-
-			std::thread screenshotThread = std::thread([=] {
-				pthread_setname_np( pthread_self(), "gamescope-scrsh" );
-
-				const uint8_t *mappedData = reinterpret_cast<const uint8_t *>(pCaptureTexture->mappedData());
-
-				// Make our own copy of the image to remove the alpha channel.
-				auto imageData = std::vector<uint8_t>(currentOutputWidth * currentOutputHeight * 4);
-				const uint32_t comp = 4;
-				const uint32_t pitch = currentOutputWidth * comp;
-				for (uint32_t y = 0; y < currentOutputHeight; y++)
-				{
-					for (uint32_t x = 0; x < currentOutputWidth; x++)
-					{
-						// BGR...
-						imageData[y * pitch + x * comp + 0] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 2];
-						imageData[y * pitch + x * comp + 1] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 1];
-						imageData[y * pitch + x * comp + 2] = mappedData[y * pCaptureTexture->rowPitch() + x * comp + 0];
-						imageData[y * pitch + x * comp + 3] = 255;
-					}
-				}
-
-				char pTimeBuffer[1024] = "/tmp/gamescope.png";
-
-				if ( !propertyRequestedScreenshot )
-				{
-					time_t currentTime = time(0);
-					struct tm *localTime = localtime( &currentTime );
-					strftime( pTimeBuffer, sizeof( pTimeBuffer ), "/tmp/gamescope_%Y-%m-%d_%H-%M-%S.png", localTime );
-				}
-
-				if ( stbi_write_png(pTimeBuffer, currentOutputWidth, currentOutputHeight, 4, imageData.data(), pitch) )
-				{
-					xwm_log.infof("Screenshot saved to %s", pTimeBuffer);
-				}
-				else
-				{
-					xwm_log.errorf( "Failed to save screenshot to %s", pTimeBuffer );
-				}
-
-				XDeleteProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeScreenShotAtom );
-			});
-
-			screenshotThread.detach();
-
+			save_screenshot( root_ctx, pCaptureTexture, 0, propertyRequestedScreenshot );
 			takeScreenshot = false;
 		}
 
@@ -1912,11 +2402,65 @@ paint_all()
 	{
 		assert( BIsNested() == false );
 
+		drm_set_presentation_feedback( &g_DRM, take_frame_feedbacks(), true );
 		drm_commit( &g_DRM, &frameInfo );
+
+		if ( takeScreenshot )
+		{
+			std::shared_ptr<CVulkanTexture> pCaptureTexture = vulkan_acquire_screenshot_texture(false);
+			uint64_t submission = pCaptureTexture ? vulkan_screenshot( pScreenshotFrameInfo.get(), pCaptureTexture ) : 0;
+			if ( submission != 0 )
+				save_screenshot( root_ctx, pCaptureTexture, submission, propertyRequestedScreenshot );
+			else
+				xwm_log.errorf( "Failed to take screenshot" );
+		}
+	}
+
+	if ( g_bPerfHud )
+	{
+		PerfHudFrame_t hudFrame = {};
+		hudFrame.ulDrawTime = g_uVblankDrawTimeNS;
+		hudFrame.uLayerCount = nFrameLayerCount;
+		hudFrame.bComposited = bDoComposite;
+		hudFrame.bMissedVBlank = g_uVblankDrawTimeNS > vblank_paint_offset();
+		perfhud_frame_painted( hudFrame );
+	}
+
+	if ( g_bMetrics )
+	{
+		metrics_observe( METRIC_PAINT_TIME, g_uVblankDrawTimeNS );
+		metrics_count( bDoComposite ? METRIC_FRAMES_COMPOSITED : METRIC_FRAMES_SCANOUT );
+		if ( g_uVblankDrawTimeNS > vblank_paint_offset() )
+			metrics_count( METRIC_MISSED_VBLANKS );
+		if ( !bDoComposite )
+			metrics_set_planes( nFrameLayerCount );
+	}
+
+	if ( control_wants_frame_stats() )
+	{
+		static uint32_t uFrameSeq = 0;
+
+		gamescope_control_frame_stats_t stats = {};
+		stats.seq = uFrameSeq++;
+		stats.vblankTime = g_SteamCompMgrVBlankTime;
+		stats.drawTime = g_uVblankDrawTimeNS;
+		stats.appID = w ? w->appID : 0;
+		stats.layerCount = nFrameLayerCount;
+		if ( bDoComposite )
+			stats.flags |= GAMESCOPE_CONTROL_FRAME_STATS_FLAGS_COMPOSITED;
+		if ( bFrameUpscaled )
+			stats.flags |= GAMESCOPE_CONTROL_FRAME_STATS_FLAGS_UPSCALED;
+		if ( !BIsNested() && ( g_DRM.flags & DRM_MODE_PAGE_FLIP_ASYNC ) )
+			stats.flags |= GAMESCOPE_CONTROL_FRAME_STATS_FLAGS_TEARING;
+
+		wlserver_lock();
+		control_send_frame_stats( stats );
+		wlserver_unlock();
 	}
 
 	gpuvis_trace_end_ctx_printf( paintID, "paint_all" );
 	gpuvis_trace_printf( "paint_all %i layers, composite %i", (int)frameInfo.layerCount, bDoComposite );
+	return true;
 }
 
 /* Get prop from window
@@ -2148,6 +2692,13 @@ found:;
 		}
 	}
 
+	// xdg toplevels have no X window, their id of None must not match every
+	// X window that is transient for nothing.
+	auto isTransientFor = []( win *candidate, win *parent )
+	{
+		return candidate->transientFor != None && candidate->transientFor == parent->id;
+	};
+
 	auto resolveTransientOverrides = [&](bool maybe)
 	{
 		// Do some searches to find transient links to override redirects too.
@@ -2159,7 +2710,7 @@ found:;
 			{
 				bool is_dropdown = maybe ? win_maybe_a_dropdown( candidate ) : win_is_override_redirect( candidate );
 				if ( ( !override_focus || candidate != override_focus ) && candidate != focus &&
-					( ( !override_focus && candidate->transientFor == focus->id ) || ( override_focus && candidate->transientFor == override_focus->id ) ) &&
+					( ( !override_focus && isTransientFor( candidate, focus ) ) || ( override_focus && isTransientFor( candidate, override_focus ) ) ) &&
 					 is_dropdown)
 				{
 					bFoundTransient = true;
@@ -2183,7 +2734,7 @@ found:;
 
 			for ( win *candidate : vecPossibleFocusWindows )
 			{
-				if ( candidate != focus && candidate->transientFor == focus->id && !win_maybe_a_dropdown( candidate ) )
+				if ( candidate != focus && isTransientFor( candidate, focus ) && !win_maybe_a_dropdown( candidate ) )
 				{
 					bFoundTransient = true;
 					focus = candidate;
@@ -2506,6 +3057,8 @@ wlr_surface *win_surface(win *window)
 	return window->surface.wlr;
 }
 
+static void apply_app_profile( win *w );
+
 static void
 determine_and_apply_focus()
 {
@@ -2530,9 +3083,17 @@ determine_and_apply_focus()
 		}
 	}
 
-	for ( win *focusable_window : vecPossibleFocusWindows )
+	// Native Wayland toplevels have no X11 properties to go by, any of them
+	// with contents can take focus.
+	for ( win *w : g_vecXdgWindows )
 	{
-		// Exclude windows that are useless (1x1), skip taskbar + pager or override redirect windows
+		if ( window_has_commits( w ) )
+			vecPossibleFocusWindows.push_back( w );
+	}
+
+	for ( win *focusable_window : vecPossibleFocusWindows )
+	{
+		// Exclude windows that are useless (1x1), skip taskbar + pager or override redirect windows
 		// from the reported focusable windows to Steam.
 		if ( win_is_useless( focusable_window ) ||
 			win_skip_taskbar_and_pager( focusable_window ) ||
@@ -2556,6 +3117,10 @@ determine_and_apply_focus()
 			}
 		}
 
+		// Only X windows can be named in the focus control property
+		if ( focusable_window->xdgSurface )
+			continue;
+
 		// list of [window, appid, pid] triplets
 		focusable_windows.push_back( focusable_window->id );
 		focusable_windows.push_back( focusable_window->appID );
@@ -2715,6 +3280,17 @@ determine_and_apply_focus()
 		}
 	}
 
+	// Frame pacing follows the focused game only
+	if ( previous_focus.focusWindow != global_focus.focusWindow )
+	{
+		if ( g_PacedCommit )
+		{
+			g_PacedCommit->done = true;
+			g_PacedCommit = nullptr;
+		}
+		framepacing_reset();
+	}
+
 	// Update last focus commit
 	if ( global_focus.focusWindow &&
 		 previous_focus.focusWindow != global_focus.focusWindow &&
@@ -2725,6 +3301,8 @@ determine_and_apply_focus()
 
 	hasFocusWindow = global_focus.focusWindow != nullptr;
 
+	apply_app_profile( global_focus.focusWindow );
+
 	// Set SDL window title
 	if ( global_focus.focusWindow )
 		sdlwindow_title( global_focus.focusWindow->title );
@@ -3222,6 +3800,7 @@ add_win(xwayland_ctx_t *ctx, Window id, Window prev, unsigned long sequence)
 	new_win->mouseMoved = 0;
 
 	wlserver_surface_init( &new_win->surface, id );
+	new_win->xdgSurface = nullptr;
 
 	new_win->next = *p;
 	*p = new_win;
@@ -3615,11 +4194,43 @@ T bit_cast(const J& src) {
 static void
 update_runtime_info()
 {
-	if ( g_nRuntimeInfoFd < 0 )
+	gamescope_limiter_page_t *page = g_pLimiterPage;
+	if ( !page )
 		return;
 
-	uint32_t limiter_enabled = g_nSteamCompMgrTargetFPS != 0 ? 1 : 0;
-	pwrite( g_nRuntimeInfoFd, &limiter_enabled, sizeof( limiter_enabled ), 0 );
+	win *w = global_focus.focusWindow;
+	bool bLimit = g_nSteamCompMgrTargetFPS != 0 && steamcompmgr_window_should_limit_fps( w );
+	int nRefresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+
+	uint32_t seq = page->seq + 1;
+	__atomic_store_n( &page->seq, seq, __ATOMIC_RELAXED );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	page->limiter_enabled = g_nSteamCompMgrTargetFPS != 0 ? 1 : 0;
+	page->app_id = w ? w->appID : 0;
+	page->target_fps = bLimit ? g_nSteamCompMgrTargetFPS : 0;
+	page->target_interval_ns = bLimit ? 1'000'000'000ul / g_nSteamCompMgrTargetFPS : 0;
+	page->refresh_interval_ns = 1'000'000'000ul / nRefresh;
+	page->next_vblank_ns = vblank_next_time();
+	page->present_margin_ns = vblank_paint_offset();
+
+	__atomic_store_n( &page->seq, seq + 1, __ATOMIC_RELEASE );
+}
+
+// Whether a layer in w's app is limiting its frame rate itself, in which
+// case holding back frame callbacks would only add latency.
+static bool
+limiter_client_active( win *w )
+{
+	gamescope_limiter_page_t *page = g_pLimiterPage;
+	if ( !page || !w || !w->appID )
+		return false;
+
+	if ( __atomic_load_n( &page->client_app_id, __ATOMIC_RELAXED ) != w->appID )
+		return false;
+
+	uint64_t lastPresent = __atomic_load_n( &page->client_present_ns, __ATOMIC_RELAXED );
+	return get_time_in_nanos() - lastPresent < GAMESCOPE_LIMITER_CLIENT_TIMEOUT_NS;
 }
 
 static void
@@ -3629,10 +4240,123 @@ init_runtime_info()
 	if ( !path )
 		return;
 
-	g_nRuntimeInfoFd = open( path, O_CREAT | O_RDWR , 0644 );
+	int fd = open( path, O_CREAT | O_RDWR | O_CLOEXEC, 0644 );
+	if ( fd < 0 )
+	{
+		xwm_log.errorf_errno( "Failed to open limiter file %s", path );
+		return;
+	}
+
+	size_t size = sysconf( _SC_PAGESIZE );
+	if ( ftruncate( fd, size ) != 0 )
+	{
+		xwm_log.errorf_errno( "Failed to resize limiter file %s", path );
+		close( fd );
+		return;
+	}
+
+	void *data = mmap( nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( data == MAP_FAILED )
+	{
+		xwm_log.errorf_errno( "Failed to map limiter file %s", path );
+		return;
+	}
+
+	g_pLimiterPage = (gamescope_limiter_page_t *)data;
+	memset( g_pLimiterPage, 0, sizeof( *g_pLimiterPage ) );
+	g_pLimiterPage->magic = GAMESCOPE_LIMITER_MAGIC;
+	g_pLimiterPage->version = GAMESCOPE_LIMITER_VERSION;
 	update_runtime_info();
 }
 
+// Setters shared by root window properties and the control protocol
+
+static void
+set_scaling_filter( int nScalingMode )
+{
+	switch ( nScalingMode )
+	{
+	default:
+	case 0:
+		g_bFilterGameWindow = true;
+		g_bIntegerScale = false;
+		g_upscaler = GamescopeUpscaler::BLIT;
+		break;
+	case 1:
+		g_bFilterGameWindow = false;
+		g_bIntegerScale = false;
+		g_upscaler = GamescopeUpscaler::BLIT;
+		break;
+	case 2:
+		g_bFilterGameWindow = false;
+		g_bIntegerScale = true;
+		g_upscaler = GamescopeUpscaler::BLIT;
+		break;
+	case 3:
+		g_bFilterGameWindow = true;
+		g_bIntegerScale = false;
+		g_upscaler = GamescopeUpscaler::FSR;
+		break;
+	case 4:
+		g_bFilterGameWindow = true;
+		g_bIntegerScale = false;
+		g_upscaler = GamescopeUpscaler::NIS;
+		break;
+	case 5:
+		g_bFilterGameWindow = true;
+		g_bIntegerScale = false;
+		g_upscaler = GamescopeUpscaler::SHARP;
+		break;
+	}
+	hasRepaint = true;
+}
+
+static void
+set_upscaler_sharpness( unsigned int sharpness )
+{
+	g_upscalerSharpness = (int)clamp( sharpness, 0u, 20u );
+	if ( g_upscaler != GamescopeUpscaler::BLIT )
+		hasRepaint = true;
+}
+
+static void
+set_fps_limit( int nTargetFPS )
+{
+	g_nSteamCompMgrTargetFPS = nTargetFPS;
+	update_runtime_info();
+}
+
+static void
+set_allow_tearing( bool bAllowTearing )
+{
+	g_bAllowTearing = bAllowTearing;
+	if ( g_bAllowTearing && !BIsNested() && !g_DRM.supports_async_flips )
+		xwm_log.infof( "tearing requested, but the KMS driver doesn't support async page flips" );
+}
+
+static void
+set_blur_mode( BlurMode newBlur )
+{
+	if (newBlur < BLUR_MODE_OFF || newBlur > BLUR_MODE_ALWAYS)
+		newBlur = BLUR_MODE_OFF;
+
+	if (newBlur != g_BlurMode) {
+		g_BlurFadeStartTime = get_time_in_milliseconds();
+		g_BlurModeOld = g_BlurMode;
+		g_BlurMode = newBlur;
+		hasRepaint = true;
+	}
+}
+
+static void
+set_blur_radius( unsigned int pixel )
+{
+	g_BlurRadius = (int)clamp((pixel / 2) + 1, 1u, kMaxBlurRadius - 1);
+	if ( g_BlurMode )
+		hasRepaint = true;
+}
+
 static void
 handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 {
@@ -3873,43 +4597,11 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 	}
 	if ( ev->atom == ctx->atoms.gamescopeScalingFilter )
 	{
-		int nScalingMode = get_prop( ctx, ctx->root, ctx->atoms.gamescopeScalingFilter, 0 );
-		switch ( nScalingMode )
-		{
-		default:
-		case 0:
-			g_bFilterGameWindow = true;
-			g_bIntegerScale = false;
-			g_upscaler = GamescopeUpscaler::BLIT;
-			break;
-		case 1:
-			g_bFilterGameWindow = false;
-			g_bIntegerScale = false;
-			g_upscaler = GamescopeUpscaler::BLIT;
-			break;
-		case 2:
-			g_bFilterGameWindow = false;
-			g_bIntegerScale = true;
-			g_upscaler = GamescopeUpscaler::BLIT;
-			break;
-		case 3:
-			g_bFilterGameWindow = true;
-			g_bIntegerScale = false;
-			g_upscaler = GamescopeUpscaler::FSR;
-			break;
-		case 4:
-			g_bFilterGameWindow = true;
-			g_bIntegerScale = false;
-			g_upscaler = GamescopeUpscaler::NIS;
-			break;
-		}
-		hasRepaint = true;
+		set_scaling_filter( get_prop( ctx, ctx->root, ctx->atoms.gamescopeScalingFilter, 0 ) );
 	}
 	if ( ev->atom == ctx->atoms.gamescopeFSRSharpness || ev->atom == ctx->atoms.gamescopeSharpness )
 	{
-		g_upscalerSharpness = (int)clamp( get_prop( ctx, ctx->root, ev->atom, 2 ), 0u, 20u );
-		if ( g_upscaler != GamescopeUpscaler::BLIT )
-			hasRepaint = true;
+		set_upscaler_sharpness( get_prop( ctx, ctx->root, ev->atom, 2 ) );
 	}
 	if ( ev->atom == ctx->atoms.gamescopeColorLinearGain )
 	{
@@ -4025,8 +4717,7 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 	}
 	if ( ev->atom == ctx->atoms.gamescopeFPSLimit )
 	{
-		g_nSteamCompMgrTargetFPS = get_prop( ctx, ctx->root, ctx->atoms.gamescopeFPSLimit, 0 );
-		update_runtime_info();
+		set_fps_limit( get_prop( ctx, ctx->root, ctx->atoms.gamescopeFPSLimit, 0 ) );
 	}
 	if ( ev->atom == ctx->atoms.gamescopeDynamicRefresh )
 	{
@@ -4036,25 +4727,26 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 	{
 		g_bLowLatency = !!get_prop( ctx, ctx->root, ctx->atoms.gamescopeLowLatency, 0 );
 	}
+	if ( ev->atom == ctx->atoms.gamescopeAllowTearing )
+	{
+		set_allow_tearing( !!get_prop( ctx, ctx->root, ctx->atoms.gamescopeAllowTearing, 0 ) );
+	}
+	if ( ev->atom == ctx->atoms.gamescopeFramePacing )
+	{
+		g_bFramePacing = !!get_prop( ctx, ctx->root, ctx->atoms.gamescopeFramePacing, 0 );
+	}
+	if ( ev->atom == ctx->atoms.gamescopeDebugHud )
+	{
+		g_bPerfHud = !!get_prop( ctx, ctx->root, ctx->atoms.gamescopeDebugHud, 0 );
+		hasRepaint = true;
+	}
 	if ( ev->atom == ctx->atoms.gamescopeBlurMode )
 	{
-		BlurMode newBlur = (BlurMode)get_prop( ctx, ctx->root, ctx->atoms.gamescopeBlurMode, 0 );
-		if (newBlur < BLUR_MODE_OFF || newBlur > BLUR_MODE_ALWAYS)
-			newBlur = BLUR_MODE_OFF;
-
-		if (newBlur != g_BlurMode) {
-			g_BlurFadeStartTime = get_time_in_milliseconds();
-			g_BlurModeOld = g_BlurMode;
-			g_BlurMode = newBlur;
-			hasRepaint = true;
-		}
+		set_blur_mode( (BlurMode)get_prop( ctx, ctx->root, ctx->atoms.gamescopeBlurMode, 0 ) );
 	}
 	if ( ev->atom == ctx->atoms.gamescopeBlurRadius )
 	{
-		unsigned int pixel = get_prop( ctx, ctx->root, ctx->atoms.gamescopeBlurRadius, 0 );
-		g_BlurRadius = (int)clamp((pixel / 2) + 1, 1u, kMaxBlurRadius - 1);
-		if ( g_BlurMode )
-			hasRepaint = true;
+		set_blur_radius( get_prop( ctx, ctx->root, ctx->atoms.gamescopeBlurRadius, 0 ) );
 	}
 	if ( ev->atom == ctx->atoms.gamescopeBlurFadeDuration )
 	{
@@ -4062,6 +4754,123 @@ handle_property_notify(xwayland_ctx_t *ctx, XPropertyEvent *ev)
 	}
 }
 
+static void
+apply_control_transaction( gamescope_control_transaction_t &t )
+{
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_FPS_LIMIT ) )
+		set_fps_limit( t.fpsLimit );
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_DYNAMIC_REFRESH ) )
+		g_nDynamicRefreshRate = t.dynamicRefresh;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_VBLANK_RED_ZONE ) )
+		g_uVblankDrawBufferRedZoneNS = t.vblankRedZone;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_VBLANK_RATE_OF_DECAY ) )
+		g_uVBlankRateOfDecayPercentage = t.vblankRateOfDecay;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_LOW_LATENCY ) )
+		g_bLowLatency = t.lowLatency;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_ALLOW_TEARING ) )
+		set_allow_tearing( t.allowTearing );
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_FRAME_PACING ) )
+		g_bFramePacing = t.framePacing;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_SCALING_FILTER ) )
+		set_scaling_filter( t.scalingFilter );
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_SHARPNESS ) )
+		set_upscaler_sharpness( t.sharpness );
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_COLOR_LINEAR_GAIN ) && drm_set_color_linear_gains( &g_DRM, t.colorLinearGain ) )
+		hasRepaint = true;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_COLOR_GAIN ) && drm_set_color_gains( &g_DRM, t.colorGain ) )
+		hasRepaint = true;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_COLOR_LINEAR_GAIN_BLEND ) && drm_set_color_gain_blend( &g_DRM, t.colorLinearGainBlend ) )
+		hasRepaint = true;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_COLOR_MATRIX ) && drm_set_color_mtx( &g_DRM, t.colorMatrix ) )
+		hasRepaint = true;
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_COLOR_GAMMA_EXPONENT ) )
+	{
+		if ( drm_set_degamma_exponent( &g_DRM, &t.colorGammaExponent[0] ) )
+			hasRepaint = true;
+		if ( drm_set_gamma_exponent( &g_DRM, &t.colorGammaExponent[3] ) )
+			hasRepaint = true;
+	}
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_BLUR_MODE ) )
+		set_blur_mode( (BlurMode)t.blurMode );
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_BLUR_RADIUS ) )
+		set_blur_radius( t.blurRadius );
+	if ( t.has( GAMESCOPE_CONTROL_SETTING_BLUR_FADE_DURATION ) )
+		g_BlurFadeDuration = t.blurFadeDuration;
+}
+
+static void
+handle_control_transactions()
+{
+	for ( gamescope_control_transaction_t &t : control_take_transactions() )
+		apply_control_transaction( t );
+}
+
+// Per-app profiles. Only the settings a profile names are touched, and they
+// go back to what they were before once the app loses focus.
+
+static uint32_t g_uProfileAppID = 0;
+static gamescope_control_transaction_t g_profileBaseline;
+
+static uint32_t
+get_scaling_filter()
+{
+	switch ( g_upscaler )
+	{
+	case GamescopeUpscaler::FSR:
+		return 3;
+	case GamescopeUpscaler::NIS:
+		return 4;
+	case GamescopeUpscaler::SHARP:
+		return 5;
+	default:
+		if ( g_bIntegerScale )
+			return 2;
+		return g_bFilterGameWindow ? 0 : 1;
+	}
+}
+
+static gamescope_control_transaction_t
+get_current_settings( uint32_t mask )
+{
+	gamescope_control_transaction_t t;
+	t.mask = mask;
+	t.fpsLimit = g_nSteamCompMgrTargetFPS;
+	t.dynamicRefresh = g_nDynamicRefreshRate;
+	t.lowLatency = g_bLowLatency;
+	t.allowTearing = g_bAllowTearing;
+	t.framePacing = g_bFramePacing;
+	t.scalingFilter = get_scaling_filter();
+	t.sharpness = g_upscalerSharpness;
+	t.blurMode = g_BlurMode;
+	// Inverse of set_blur_radius
+	t.blurRadius = ( g_BlurRadius - 1 ) * 2;
+	return t;
+}
+
+static void
+apply_app_profile( win *w )
+{
+	uint32_t appID = w ? w->appID : 0;
+	if ( appID == g_uProfileAppID )
+		return;
+
+	if ( g_profileBaseline.mask )
+	{
+		apply_control_transaction( g_profileBaseline );
+		g_profileBaseline.mask = 0;
+	}
+	g_uProfileAppID = appID;
+
+	const gamescope_control_transaction_t *pProfile = appprofiles_lookup( appID );
+	if ( pProfile == nullptr )
+		return;
+
+	xwm_log.infof( "applying profile for app %u", appID );
+	gamescope_control_transaction_t profile = *pProfile;
+	g_profileBaseline = get_current_settings( profile.mask );
+	apply_control_transaction( profile );
+}
+
 static int
 error(Display *dpy, XErrorEvent *ev)
 {
@@ -4144,9 +4953,13 @@ steamcompmgr_exit(void)
 			for ( win *w = server->ctx->list; w; w = w->next )
 				w->commit_queue.clear();
 		}
+
+		for ( win *w : g_vecXdgWindows )
+			w->commit_queue.clear();
 	}
 	g_HeldCommits[ HELD_COMMIT_BASE ] = nullptr;
 	g_HeldCommits[ HELD_COMMIT_FADE ] = nullptr;
+	g_PacedCommit = nullptr;
 
 	imageWaitThreadRun = false;
 	waitListSem.signal();
@@ -4249,81 +5062,139 @@ register_systray(xwayland_ctx_t *ctx)
 	XSetSelectionOwner(ctx->dpy, net_system_tray, ctx->ourWindow, 0);
 }
 
-void handle_done_commits( xwayland_ctx_t *ctx )
+static void release_paced_commit( void )
 {
-	std::lock_guard<std::mutex> lock( ctx->listCommitsDoneLock );
+	if ( !g_PacedCommit )
+		return;
 
-	// very fast loop yes
-	for ( uint32_t i = 0; i < ctx->listCommitsDone.size(); i++ )
-	{
-		bool bFoundWindow = false;
-		for ( win *w = ctx->list; w; w = w->next )
-		{
-			uint32_t j;
-			for ( j = 0; j < w->commit_queue.size(); j++ )
-			{
-				if ( w->commit_queue[ j ]->commitID == ctx->listCommitsDone[ i ] )
-				{
-					gpuvis_trace_printf( "commit %lu done", w->commit_queue[ j ]->commitID );
-					w->commit_queue[ j ]->done = true;
-					bFoundWindow = true;
+	gpuvis_trace_printf( "commit %lu released by frame pacing", g_PacedCommit->commitID );
+	g_PacedCommit->done = true;
 
-					// Window just got a new available commit, determine if that's worth a repaint
+	win *w = global_focus.focusWindow;
+	if ( w && std::find( w->commit_queue.begin(), w->commit_queue.end(), g_PacedCommit ) != w->commit_queue.end() )
+	{
+		g_HeldCommits[ HELD_COMMIT_BASE ] = g_PacedCommit;
+		hasRepaint = true;
+		g_bNewBaseFrame = true;
+	}
 
-					// If this is an overlay that we're presenting, repaint
-					if ( gameFocused )
-					{
-						if ( w == global_focus.overlayWindow && w->opacity != TRANSLUCENT )
-						{
-							hasRepaint = true;
-						}
+	g_PacedCommit = nullptr;
+}
 
-						if ( w == global_focus.notificationWindow && w->opacity != TRANSLUCENT )
-						{
-							hasRepaint = true;
-						}
-					}
-					if ( ctx->focus.outdatedInteractiveFocus )
-					{
-						focusDirty = true;
-						ctx->focus.outdatedInteractiveFocus = false;
-					}
-					// If this is an external overlay, repaint
-					if ( w == ctx->focus.externalOverlayWindow && w->opacity != TRANSLUCENT )
-					{
-						hasRepaint = true;
-					}
-					// If this is the main plane, repaint
-					if ( w == global_focus.focusWindow && !w->isSteamStreamingClient )
-					{
-						g_HeldCommits[ HELD_COMMIT_BASE ] = w->commit_queue[ j ];
-						hasRepaint = true;
-					}
+// Returns true if the commit belonged to w.
+static bool
+handle_done_commit( xwayland_ctx_t *ctx, win *w, uint64_t commitID )
+{
+	bool bPaced = false;
+	uint32_t j;
+	for ( j = 0; j < w->commit_queue.size(); j++ )
+	{
+		if ( w->commit_queue[ j ]->commitID == commitID )
+		{
+			gpuvis_trace_printf( "commit %lu done", w->commit_queue[ j ]->commitID );
+			w->commit_queue[ j ]->done = true;
+			commitstats_record( COMMIT_STAGE_READY, get_time_in_nanos() - w->commit_queue[ j ]->commitTime );
 
-					if ( w == global_focus.overrideWindow )
-					{
-						hasRepaint = true;
-					}
+			// Window just got a new available commit, determine if that's worth a repaint
 
-					if ( w->isSteamStreamingClientVideo && global_focus.focusWindow && global_focus.focusWindow->isSteamStreamingClient )
-					{
-						g_HeldCommits[ HELD_COMMIT_BASE ] = w->commit_queue[ j ];
-						hasRepaint = true;
-					}
+			// If this is an overlay that we're presenting, repaint
+			if ( gameFocused )
+			{
+				if ( w == global_focus.overlayWindow && w->opacity != TRANSLUCENT )
+				{
+					hasRepaint = true;
+				}
 
-					break;
+				if ( w == global_focus.notificationWindow && w->opacity != TRANSLUCENT )
+				{
+					hasRepaint = true;
 				}
 			}
-
-			if ( bFoundWindow == true )
+			if ( ctx->focus.outdatedInteractiveFocus )
 			{
-				if ( j > 0 )
+				focusDirty = true;
+				ctx->focus.outdatedInteractiveFocus = false;
+			}
+			// If this is an external overlay, repaint
+			if ( w == ctx->focus.externalOverlayWindow && w->opacity != TRANSLUCENT )
+			{
+				hasRepaint = true;
+			}
+			// If this is the main plane, repaint
+			if ( w == global_focus.focusWindow && !w->isSteamStreamingClient )
+			{
+				framepacing_frame_ready( get_time_in_nanos() );
+				perfhud_app_frame( get_time_in_nanos() );
+
+				if ( framepacing_active() )
 				{
-					// we can release all commits prior to done ones
-					w->commit_queue.erase( w->commit_queue.begin(), w->commit_queue.begin() + j );
+					// Hold it until the pacer picks its vblank. If the previous
+					// frame is still held, it goes out right away instead of
+					// being dropped.
+					release_paced_commit();
+					w->commit_queue[ j ]->done = false;
+					g_PacedCommit = w->commit_queue[ j ];
+					bPaced = true;
+				}
+				else
+				{
+					g_HeldCommits[ HELD_COMMIT_BASE ] = w->commit_queue[ j ];
+					hasRepaint = true;
+					g_bNewBaseFrame = true;
+
+					if ( g_bAllowTearing )
+						hasAsyncRepaint = true;
 				}
-				break;
 			}
+
+			if ( w == global_focus.overrideWindow )
+			{
+				hasRepaint = true;
+			}
+
+			if ( w->isSteamStreamingClientVideo && global_focus.focusWindow && global_focus.focusWindow->isSteamStreamingClient )
+			{
+				g_HeldCommits[ HELD_COMMIT_BASE ] = w->commit_queue[ j ];
+				hasRepaint = true;
+			}
+
+			break;
+		}
+	}
+
+	if ( j == w->commit_queue.size() )
+		return false;
+
+	// A held commit isn't done yet, keep the last done one around.
+	if ( bPaced )
+		j = std::max( window_last_done_commit_id( w ), 0 );
+
+	if ( j > 0 )
+	{
+		// we can release all commits prior to done ones
+		w->commit_queue.erase( w->commit_queue.begin(), w->commit_queue.begin() + j );
+	}
+
+	return true;
+}
+
+void handle_done_commits( xwayland_ctx_t *ctx )
+{
+	std::lock_guard<std::mutex> lock( ctx->listCommitsDoneLock );
+
+	commitstats_queue_depth( COMMIT_QUEUE_DONE, ctx->listCommitsDone.size() );
+
+	// very fast loop yes
+	for ( uint32_t i = 0; i < ctx->listCommitsDone.size(); i++ )
+	{
+		bool bFoundWindow = false;
+		for ( win *w = ctx->list; w && !bFoundWindow; w = w->next )
+			bFoundWindow = handle_done_commit( ctx, w, ctx->listCommitsDone[ i ] );
+
+		for ( size_t k = 0; k < g_vecXdgWindows.size() && !bFoundWindow; k++ )
+		{
+			if ( g_vecXdgWindows[ k ]->ctx == ctx )
+				bFoundWindow = handle_done_commit( ctx, g_vecXdgWindows[ k ], ctx->listCommitsDone[ i ] );
 		}
 	}
 
@@ -4342,12 +5213,73 @@ void take_screenshot( void )
 	nudge_steamcompmgr();
 }
 
+static void
+queue_commit( xwayland_ctx_t *ctx, win *w, const ResListEntry_t &res )
+{
+	struct wlr_buffer *buf = res.buf;
+
+	uint64_t importStart = get_time_in_nanos();
+	commitstats_record( COMMIT_STAGE_QUEUE, importStart - res.commitTime );
+	std::shared_ptr<commit_t> newCommit = import_commit( buf );
+	commitstats_record( COMMIT_STAGE_IMPORT, get_time_in_nanos() - importStart );
+
+	int fence = -1;
+	if ( newCommit )
+	{
+		newCommit->feedback = res.feedback;
+		newCommit->viewport = res.viewport;
+		newCommit->commitTime = res.commitTime;
+
+		struct wlr_dmabuf_attributes dmabuf = {0};
+		if ( res.acquireTimeline )
+		{
+			// The client told us what to wait on, don't also wait on
+			// whatever else happens to be using the buffer.
+		}
+		else if ( wlr_buffer_get_dmabuf( buf, &dmabuf ) )
+		{
+			fence = dup( dmabuf.fd[0] );
+		}
+		else
+		{
+			fence = newCommit->vulkanTex->memoryFence();
+		}
+
+		// Whether or not to nudge mango app when this commit is done.
+		const bool mango_nudge = ( w == global_focus.focusWindow && !w->isSteamStreamingClient ) ||
+								 ( global_focus.focusWindow && global_focus.focusWindow->isSteamStreamingClient && w->isSteamStreamingClientVideo );
+
+		gpuvis_trace_printf( "pushing wait for commit %lu win %lx", newCommit->commitID, w->id );
+		{
+			std::unique_lock< std::mutex > lock( waitListLock );
+			WaitListEntry_t entry
+			{
+				.ctx = ctx,
+				.fence = fence,
+				.mangoapp_nudge = mango_nudge,
+				.commitID = newCommit->commitID,
+				.acquireTimeline = res.acquireTimeline,
+				.acquirePoint = res.acquirePoint,
+				.queueTime = get_time_in_nanos(),
+			};
+			waitList.push_back( entry );
+			commitstats_queue_depth( COMMIT_QUEUE_WAIT_LIST, waitList.size() );
+		}
+
+		// Wake up commit wait thread if chilling
+		waitListSem.signal();
+
+		w->commit_queue.push_back( std::move(newCommit) );
+	}
+}
+
 void check_new_wayland_res(xwayland_ctx_t *ctx)
 {
 	// When importing buffer, we'll potentially need to perform operations with
 	// a wlserver lock (e.g. wlr_buffer_lock). We can't do this with a
 	// wayland_commit_queue lock because that causes deadlocks.
 	std::vector<ResListEntry_t> tmp_queue = ctx->xwayland_server->retrieve_commits();
+	commitstats_queue_depth( COMMIT_QUEUE_WAYLAND, tmp_queue.size() );
 
 	for ( uint32_t i = 0; i < tmp_queue.size(); i++ )
 	{
@@ -4358,49 +5290,152 @@ void check_new_wayland_res(xwayland_ctx_t *ctx)
 		if ( w == nullptr )
 		{
 			wlserver_lock();
+			if ( tmp_queue[ i ].feedback )
+				wlserver_presentation_feedback_discard( tmp_queue[ i ].feedback );
 			wlr_buffer_unlock( buf );
 			wlserver_unlock();
 			xwm_log.errorf( "waylandres but no win" );
 			continue;
 		}
 
-		std::shared_ptr<commit_t> newCommit = import_commit( buf );
+		queue_commit( ctx, w, tmp_queue[ i ] );
+	}
+}
 
-		int fence = -1;
-		if ( newCommit )
-		{
-			struct wlr_dmabuf_attributes dmabuf = {0};
-			if ( wlr_buffer_get_dmabuf( buf, &dmabuf ) )
-			{
-				fence = dup( dmabuf.fd[0] );
-			}
-			else
-			{
-				fence = newCommit->vulkanTex->memoryFence();
-			}
+static win *
+find_xdg_win( struct wlr_surface *surf )
+{
+	for ( win *w : g_vecXdgWindows )
+	{
+		if ( w->xdgSurface == surf )
+			return w;
+	}
 
-			// Whether or not to nudge mango app when this commit is done.
-			const bool mango_nudge = ( w == global_focus.focusWindow && !w->isSteamStreamingClient ) ||
-									 ( global_focus.focusWindow && global_focus.focusWindow->isSteamStreamingClient && w->isSteamStreamingClientVideo );
+	return nullptr;
+}
 
-			gpuvis_trace_printf( "pushing wait for commit %lu win %lx", newCommit->commitID, w->id );
-			{
-				std::unique_lock< std::mutex > lock( waitListLock );
-				WaitListEntry_t entry
-				{
-					.ctx = ctx,
-					.fence = fence,
-					.mangoapp_nudge = mango_nudge,
-					.commitID = newCommit->commitID,
-				};
-				waitList.push_back( entry );
-			}
+static void
+check_new_xdg_res( void )
+{
+	std::vector<ResListEntry_t> tmp_queue = wlserver_xdg_retrieve_commits();
+	commitstats_queue_depth( COMMIT_QUEUE_WAYLAND, tmp_queue.size() );
+
+	for ( uint32_t i = 0; i < tmp_queue.size(); i++ )
+	{
+		struct wlr_buffer *buf = tmp_queue[ i ].buf;
 
-			// Wake up commit wait thread if chilling
-			waitListSem.signal();
+		win *w = find_xdg_win( tmp_queue[ i ].surf );
 
-			w->commit_queue.push_back( std::move(newCommit) );
+		// Commits can race with the unmap
+		if ( w == nullptr )
+		{
+			wlserver_lock();
+			if ( tmp_queue[ i ].feedback )
+				wlserver_presentation_feedback_discard( tmp_queue[ i ].feedback );
+			wlr_buffer_unlock( buf );
+			wlserver_unlock();
+			continue;
 		}
+
+		// No X damage for these, so new contents are what counts for focus
+		if ( w->damage_sequence == 0 )
+			focusDirty = true;
+		w->damage_sequence = damageSequence++;
+
+		// The surface size, which is only the buffer size without a viewport
+		w->a.width = tmp_queue[ i ].viewport.width;
+		w->a.height = tmp_queue[ i ].viewport.height;
+
+		queue_commit( w->ctx, w, tmp_queue[ i ] );
+	}
+}
+
+static void
+map_xdg_win( const wlserver_xdg_event_t &event )
+{
+	win *w = new win{};
+
+	w->ctx = wlserver_get_xwayland_server( 0 )->ctx.get();
+	w->xdgSurface = event.surf;
+	w->a.width = event.width;
+	w->a.height = event.height;
+	w->a.map_state = IsViewable;
+	w->a.c_class = InputOutput;
+	w->opacity = OPAQUE;
+	w->pid = event.pid;
+	w->title = event.title;
+	w->utf8_title = true;
+	w->isFullscreen = true;
+
+	if ( steamMode == true )
+		w->appID = w->pid != -1 ? get_appid_from_pid( w->pid ) : 0;
+	else
+		w->appID = w->pid;
+
+	wlserver_surface_init( &w->surface, 0 );
+
+	wlserver_lock();
+	bool bAttached = wlserver_xdg_surface_attach( &w->surface, event.surf );
+	wlserver_unlock();
+
+	if ( !bAttached )
+	{
+		free( w->title );
+		delete w;
+		return;
+	}
+
+	g_vecXdgWindows.push_back( w );
+	focusDirty = true;
+}
+
+static void
+unmap_xdg_win( struct wlr_surface *surf )
+{
+	win *w = find_xdg_win( surf );
+	if ( !w )
+		return;
+
+	// Nothing may point at w until the next focus pass picks again
+	win **focusSlots[] = {
+		&global_focus.focusWindow,
+		&global_focus.inputFocusWindow,
+		&global_focus.keyboardFocusWindow,
+		&global_focus.overrideWindow,
+		&global_focus.notificationWindow,
+		&global_focus.overlayWindow,
+		&global_focus.externalOverlayWindow,
+		&global_focus.fadeWindow,
+	};
+	for ( win **slot : focusSlots )
+	{
+		if ( *slot == w )
+			*slot = nullptr;
+	}
+
+	focusDirty = true;
+
+	g_vecXdgWindows.erase( std::remove( g_vecXdgWindows.begin(), g_vecXdgWindows.end(), w ), g_vecXdgWindows.end() );
+
+	w->commit_queue.clear();
+
+	wlserver_lock();
+	wlserver_surface_finish( &w->surface );
+	wlserver_unlock();
+
+	free( w->title );
+	delete w;
+}
+
+static void
+handle_xdg_events( void )
+{
+	for ( const wlserver_xdg_event_t &event : wlserver_xdg_retrieve_events() )
+	{
+		if ( event.type == WLSERVER_XDG_MAP )
+			map_xdg_win( event );
+		else
+			unmap_xdg_win( event.surf );
 	}
 }
 
@@ -4526,15 +5561,28 @@ spawn_client( char **argv )
 	waitThread.detach();
 }
 
-static void
+// Returns true if it stopped at the event budget with events left to handle.
+static bool
 dispatch_x11( xwayland_ctx_t *ctx )
 {
 	MouseCursor *cursor = ctx->cursor.get();
 	bool bShouldResetCursor = false;
 	bool bSetFocus = false;
+	bool bEventsLeft = false;
+
+	uint32_t uEventBudget = UINT32_MAX;
+	if ( ctx->xwayland_server != steamcompmgr_get_focused_server() )
+		uEventBudget = g_uUnfocusedX11EventBudget;
 
-	while (XPending(ctx->dpy))
+	for ( uint32_t uEvents = 0; XPending(ctx->dpy); uEvents++ )
 	{
+		if ( uEvents == uEventBudget )
+		{
+			gpuvis_trace_printf( "dispatch_x11: event budget reached" );
+			bEventsLeft = true;
+			break;
+		}
+
 		XEvent ev;
 		int ret = XNextEvent(ctx->dpy, &ev);
 		if (ret != 0)
@@ -4691,6 +5739,8 @@ dispatch_x11( xwayland_ctx_t *ctx )
 	{
 		XSetInputFocus(ctx->dpy, ctx->currentKeyboardFocusWindow, RevertToNone, CurrentTime);
 	}
+
+	return bEventsLeft;
 }
 
 static bool
@@ -4750,31 +5800,50 @@ struct rgba_t
 static bool
 load_mouse_cursor( MouseCursor *cursor, const char *path, int hx, int hy )
 {
-	int w, h, channels;
-	rgba_t *data = (rgba_t *) stbi_load(path, &w, &h, &channels, STBI_rgb_alpha);
-	if (!data)
+	// Every Xwayland context gets the same image, only decode it once
+	static std::string s_loadedPath;
+	static std::vector<rgba_t> s_loadedData;
+	static int s_loadedWidth, s_loadedHeight;
+
+	if ( s_loadedPath != path )
 	{
-		xwm_log.errorf("Failed to open/load cursor file");
-		return false;
-	}
+		int w, h, channels;
+		rgba_t *data = (rgba_t *) stbi_load(path, &w, &h, &channels, STBI_rgb_alpha);
+		if (!data)
+		{
+			xwm_log.errorf("Failed to open/load cursor file");
+			return false;
+		}
 
-	std::transform(data, data + w * h, data, [](rgba_t x) {
-		if (x.a == 0)
-			return rgba_t{};
-		return rgba_t{
-			uint8_t((x.b * x.a) / 255),
-			uint8_t((x.g * x.a) / 255),
-			uint8_t((x.r * x.a) / 255),
-			x.a };
-	});
+		s_loadedData.resize( w * h );
+		std::transform(data, data + w * h, s_loadedData.begin(), [](rgba_t x) {
+			if (x.a == 0)
+				return rgba_t{};
+			return rgba_t{
+				uint8_t((x.b * x.a) / 255),
+				uint8_t((x.g * x.a) / 255),
+				uint8_t((x.r * x.a) / 255),
+				x.a };
+		});
+		stbi_image_free(data);
+
+		s_loadedPath = path;
+		s_loadedWidth = w;
+		s_loadedHeight = h;
+	}
 
 	// Data is freed by XDestroyImage in setCursorImage.
-	return cursor->setCursorImage((char *)data, w, h, hx, hy);
+	size_t size = s_loadedData.size() * sizeof(rgba_t);
+	char *data = (char *)malloc(size);
+	memcpy(data, s_loadedData.data(), size);
+
+	return cursor->setCursorImage(data, s_loadedWidth, s_loadedHeight, hx, hy);
 }
 
 enum steamcompmgr_event_type {
 	EVENT_VBLANK,
 	EVENT_NUDGE,
+	EVENT_FLIP,
 	EVENT_X11,
 	// Any past here are X11
 };
@@ -4940,8 +6009,12 @@ void init_xwayland_ctx(gamescope_xwayland_server_t *xwayland_server)
 	ctx->atoms.gamescopeFPSLimit = XInternAtom( ctx->dpy, "GAMESCOPE_FPS_LIMIT", false );
 	ctx->atoms.gamescopeDynamicRefresh = XInternAtom( ctx->dpy, "GAMESCOPE_DYNAMIC_REFRESH", false );
 	ctx->atoms.gamescopeLowLatency = XInternAtom( ctx->dpy, "GAMESCOPE_LOW_LATENCY", false );
+	ctx->atoms.gamescopeAllowTearing = XInternAtom( ctx->dpy, "GAMESCOPE_ALLOW_TEARING", false );
+	ctx->atoms.gamescopeFramePacing = XInternAtom( ctx->dpy, "GAMESCOPE_FRAME_PACING", false );
+	ctx->atoms.gamescopeDebugHud = XInternAtom( ctx->dpy, "GAMESCOPE_DEBUG_HUD", false );
 
 	ctx->atoms.gamescopeFSRFeedback = XInternAtom( ctx->dpy, "GAMESCOPE_FSR_FEEDBACK", false );
+	ctx->atoms.gamescopePreferredRenderSize = XInternAtom( ctx->dpy, "GAMESCOPE_PREFERRED_RENDER_SIZE", false );
 
 	ctx->atoms.gamescopeBlurMode = XInternAtom( ctx->dpy, "GAMESCOPE_BLUR_MODE", false );
 	ctx->atoms.gamescopeBlurRadius = XInternAtom( ctx->dpy, "GAMESCOPE_BLUR_RADIUS", false );
@@ -4993,6 +6066,30 @@ extern int g_nPreferredOutputWidth;
 extern int g_nPreferredOutputHeight;
 
 static bool g_bWasFSRActive = false;
+static uint32_t g_uPublishedRenderSize[2] = { 0, 0 };
+
+// The size apps get the most out of rendering at: the nested size, which we
+// scale to the output for free (with FSR or NIS if enabled). Going past the
+// size the output actually shows it at is wasted work.
+static void
+get_preferred_render_size( uint32_t *pWidth, uint32_t *pHeight )
+{
+	uint32_t width = g_nNestedWidth;
+	uint32_t height = g_nNestedHeight;
+
+	if ( width && height && currentOutputWidth && currentOutputHeight )
+	{
+		float flRatio = std::min( currentOutputWidth / (float)width, currentOutputHeight / (float)height );
+		if ( flRatio < 1.0f )
+		{
+			width = std::max( uint32_t( width * flRatio ), 1u );
+			height = std::max( uint32_t( height * flRatio ), 1u );
+		}
+	}
+
+	*pWidth = width;
+	*pHeight = height;
+}
 
 void
 steamcompmgr_main(int argc, char **argv)
@@ -5023,7 +6120,7 @@ steamcompmgr_main(int argc, char **argv)
 				cursorHideTime = atoi( optarg );
 				break;
 			case 'v':
-				drawDebugInfo = true;
+				g_bPerfHud = true;
 				break;
 			case 'e':
 				steamMode = true;
@@ -5048,6 +6145,18 @@ steamcompmgr_main(int argc, char **argv)
 					sscanf(optarg, "%d,%d", &g_customCursorHotspotX, &g_customCursorHotspotY);
 				} else if (strcmp(opt_name, "fade-out-duration") == 0) {
 					g_FadeOutDuration = atoi(optarg);
+				} else if (strcmp(opt_name, "frame-pacing") == 0) {
+					g_bFramePacing = true;
+				} else if (strcmp(opt_name, "background-fps") == 0) {
+					g_nBackgroundFPS = atoi(optarg);
+				} else if (strcmp(opt_name, "steam-background-fps") == 0) {
+					g_nSteamBackgroundFPS = atoi(optarg);
+				} else if (strcmp(opt_name, "app-profiles") == 0) {
+					appprofiles_load(optarg);
+				} else if (strcmp(opt_name, "commit-stats") == 0) {
+					g_bCommitStats = true;
+				} else if (strcmp(opt_name, "metrics-socket") == 0) {
+					metrics_init(optarg);
 				}
 				break;
 			case '?':
@@ -5127,6 +6236,11 @@ steamcompmgr_main(int argc, char **argv)
 			.fd = g_nudgePipe[ 0 ],
 			.events = POLLIN,
 	});
+	// EVENT_FLIP
+	pollfds.push_back(pollfd {
+		.fd = BIsNested() ? -1 : g_DRM.flip_event_fd,
+		.events = POLLIN,
+	});
 	// EVENT_X11
 	{
 		gamescope_xwayland_server_t *server = NULL;
@@ -5148,8 +6262,10 @@ steamcompmgr_main(int argc, char **argv)
 			for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
 			{
 				assert(server);
-				if (x_events_queued(server->ctx.get()))
-					dispatch_x11(server->ctx.get());
+				// Leftover events are already read off the connection, make
+				// sure poll doesn't sit on them.
+				if (x_events_queued(server->ctx.get()) && dispatch_x11(server->ctx.get()))
+					nudge_steamcompmgr();
 			}
 		}
 
@@ -5180,25 +6296,33 @@ steamcompmgr_main(int argc, char **argv)
 			{
 				gamescope_xwayland_server_t *server = wlserver_get_xwayland_server(i - EVENT_X11);
 				assert(server);
-				dispatch_x11( server->ctx.get() );
+				if ( dispatch_x11( server->ctx.get() ) )
+					nudge_steamcompmgr();
 			}
 		}
 		if ( pollfds[ EVENT_VBLANK ].revents & POLLIN )
 			vblank = dispatch_vblank( vblankFD );
 		if ( pollfds[ EVENT_NUDGE ].revents & POLLIN )
 			dispatch_nudge( g_nudgePipe[ 0 ] );
+		if ( pollfds[ EVENT_FLIP ].revents & POLLIN )
+			drm_dispatch_flip_events( &g_DRM );
 
 		if ( g_bRun == false )
 		{
 			break;
 		}
 
+		handle_control_transactions();
+
+		bool bFeedbackChanged = false;
+
 		if ( inputCounter != lastPublishedInputCounter )
 		{
 			XChangeProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopeInputCounterAtom, XA_CARDINAL, 32, PropModeReplace,
 							 (unsigned char *)&inputCounter, 1 );
 
 			lastPublishedInputCounter = inputCounter;
+			bFeedbackChanged = true;
 		}
 
 		if ( g_bFSRActive != g_bWasFSRActive )
@@ -5208,6 +6332,33 @@ steamcompmgr_main(int argc, char **argv)
 					(unsigned char *)&active, 1 );
 
 			g_bWasFSRActive = g_bFSRActive;
+			bFeedbackChanged = true;
+		}
+
+		uint32_t renderSize[2];
+		get_preferred_render_size( &renderSize[0], &renderSize[1] );
+		if ( renderSize[0] != g_uPublishedRenderSize[0] || renderSize[1] != g_uPublishedRenderSize[1] )
+		{
+			unsigned long renderSizeProp[2] = { renderSize[0], renderSize[1] };
+			XChangeProperty( root_ctx->dpy, root_ctx->root, root_ctx->atoms.gamescopePreferredRenderSize, XA_CARDINAL, 32, PropModeReplace,
+					(unsigned char *)renderSizeProp, 2 );
+
+			// Native clients get it as their toplevel size and can use
+			// wp_viewporter to render at something else.
+			wlserver_lock();
+			wlserver_xdg_set_size( renderSize[0], renderSize[1] );
+			wlserver_unlock();
+
+			g_uPublishedRenderSize[0] = renderSize[0];
+			g_uPublishedRenderSize[1] = renderSize[1];
+			bFeedbackChanged = true;
+		}
+
+		if ( bFeedbackChanged )
+		{
+			wlserver_lock();
+			control_update_feedback( lastPublishedInputCounter, g_bWasFSRActive, g_uPublishedRenderSize[0], g_uPublishedRenderSize[1] );
+			wlserver_unlock();
 		}
 
 		if (focusDirty)
@@ -5268,19 +6419,53 @@ steamcompmgr_main(int argc, char **argv)
 				check_new_wayland_res(server->ctx.get());
 		}
 
+		handle_xdg_events();
+		check_new_xdg_res();
+
+		commitstats_report( get_time_in_nanos() );
+
 		// Handles if we got a commit for the window we want to focus
 		// to switch to it for painting (outdatedInteractiveFocus)
 		// Doesn't realllly matter but avoids an extra frame of being on the wrong window.
 		if (focusDirty)
 			determine_and_apply_focus();
 
-		if ( ( g_bTakeScreenshot == true || hasRepaint == true || is_fading_out() ) && vblank == true )
+		// A held game frame only goes out once the previous new one got painted
+		if ( vblank == true && g_PacedCommit && !g_bNewBaseFrame &&
+			 framepacing_should_present( g_SteamCompMgrVBlankTime, true ) )
+		{
+			release_paced_commit();
+		}
+
+		// With tearing allowed, a new game frame doesn't wait for the next
+		// vblank; paint_all decides whether it can really be flipped async.
+		bool bTearingPaint = hasAsyncRepaint && g_bAllowTearing && g_DRM.supports_async_flips;
+
+		bool bPainted = false;
+		if ( ( g_bTakeScreenshot == true || hasRepaint == true || is_fading_out() ) && ( vblank == true || bTearingPaint ) )
 		{
-			paint_all();
+			bPainted = paint_all( !vblank );
 
+			// Whatever paint_all turned down waits for the vblank
+			hasAsyncRepaint = false;
+		}
+
+		if ( bPainted )
+		{
 			// Consumed the need to repaint here
 			hasRepaint = false;
 
+			if ( g_bNewBaseFrame )
+			{
+				framepacing_mark_presented( vblank ? g_SteamCompMgrVBlankTime : get_time_in_nanos() );
+				g_bNewBaseFrame = false;
+			}
+
+			// The game can render past the refresh rate, so give it a new
+			// frame callback as soon as its frame is on screen.
+			if ( !vblank && ( g_DRM.flags & DRM_MODE_PAGE_FLIP_ASYNC ) )
+				steamcompmgr_send_frame_done_to_focus_window();
+
 			// If we're in the middle of a fade, pump an event into the loop to
 			// make sure we keep pushing frames even if the app isn't updating.
 			if ( is_fading_out() )
@@ -5305,39 +6490,69 @@ steamcompmgr_main(int argc, char **argv)
 		if ( vblank == true )
 		{
 			static int vblank_idx = 0;
+
+			update_runtime_info();
+
+			// xdg toplevels hang off server 0's ctx but aren't on any
+			// Xwayland server, so with one focused all servers are in the
+			// background.
+			win *focusWindow = global_focus.focusWindow;
+			xwayland_ctx_t *focusedCtx = focusWindow && !focusWindow->xdgSurface ? focusWindow->ctx : nullptr;
+
+			auto sendFrameCallback = [&]( win *w, int nDisplayFPS )
 			{
-				gamescope_xwayland_server_t *server = NULL;
-				for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
+				bool bSendCallback = w->surface.wlr != nullptr;
+
+				int nRefresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+				int nTargetFPS = 0;
+				if ( g_nSteamCompMgrTargetFPS && steamcompmgr_window_should_limit_fps( w ) && !limiter_client_active( w ) )
+					nTargetFPS = g_nSteamCompMgrTargetFPS;
+
+				// Overlays get drawn over whatever has focus, they always keep up
+				if ( nDisplayFPS >= 0 && !w->isOverlay && !w->isExternalOverlay )
 				{
-					for (win *w = server->ctx->list; w; w = w->next)
-					{
-						bool bSendCallback = w->surface.wlr != nullptr;
+					if ( nDisplayFPS == 0 )
+						bSendCallback = false;
+					else if ( nTargetFPS == 0 || nDisplayFPS < nTargetFPS )
+						nTargetFPS = nDisplayFPS;
+				}
 
-						int nRefresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
-						int nTargetFPS = g_nSteamCompMgrTargetFPS;
-						if ( g_nSteamCompMgrTargetFPS && steamcompmgr_window_should_limit_fps( w ) && nRefresh > nTargetFPS )
-						{
-							int nVblankDivisor = nRefresh / nTargetFPS;
+				if ( nTargetFPS && nRefresh > nTargetFPS )
+				{
+					int nVblankDivisor = nRefresh / nTargetFPS;
 
-							if ( vblank_idx % nVblankDivisor != 0 )
-								bSendCallback = false;
-						}
+					if ( vblank_idx % nVblankDivisor != 0 )
+						bSendCallback = false;
+				}
 
-						if ( bSendCallback )
-						{
-							// Acknowledge commit once.
-							wlserver_lock();
+				// Acknowledge commit once.
+				if ( bSendCallback && w->surface.wlr != nullptr )
+					wlserver_send_frame_done(w->surface.wlr, &now);
+			};
 
-							if ( w->surface.wlr != nullptr )
-							{
-								wlserver_send_frame_done(w->surface.wlr, &now);
-							}
+			// All of them go out in a single flush
+			wlserver_lock();
 
-							wlserver_unlock();
-						}
-					}
+			{
+				gamescope_xwayland_server_t *server = NULL;
+				for (size_t i = 0; (server = wlserver_get_xwayland_server(i)); i++)
+				{
+					int nDisplayFPS = -1;
+					if ( focusWindow && server->ctx.get() != focusedCtx )
+						nDisplayFPS = ( steamMode && i == 0 ) ? g_nSteamBackgroundFPS : g_nBackgroundFPS;
+
+					for (win *w = server->ctx->list; w; w = w->next)
+						sendFrameCallback( w, nDisplayFPS );
 				}
 			}
+
+			// Native toplevels other than the focused one are held to the
+			// background rate, like unfocused Xwayland servers
+			for ( win *w : g_vecXdgWindows )
+				sendFrameCallback( w, focusWindow && w != focusWindow ? g_nBackgroundFPS : -1 );
+
+			wlserver_unlock();
+
 			vblank_idx++;
 		}
 
@@ -34,6 +34,7 @@ static const uint32_t g_zposOverride = 1;
 static const uint32_t g_zposExternalOverlay = 2;
 static const uint32_t g_zposOverlay = 3;
 static const uint32_t g_zposCursor = 4;
+static const uint32_t g_zposPerfHud = 5;
 
 extern EStreamColorspace g_ForcedNV12ColorSpace;
 
@@ -70,10 +71,10 @@ public:
 private:
 	void warp(int x, int y);
 	void checkSuspension();
+	void syncPosition();
 
 	void queryGlobalPosition(int &x, int &y);
 	void queryPositions(int &rootX, int &rootY, int &winX, int &winY);
-	void queryButtonMask(unsigned int &mask);
 
 	bool getTexture();
 
@@ -93,6 +94,15 @@ private:
 
 	int m_lastX = 0;
 	int m_lastY = 0;
+
+	// Last pointer state picked up from wlserver
+	uint64_t m_cursorSerial = 0;
+	bool m_buttonHeld = false;
+	// Only the X server knows where the pointer is, e.g. after we warped it
+	bool m_positionStale = true;
+	// Surface the position came from and where on it, if it came from wlserver
+	struct wlr_surface *m_surface = nullptr;
+	int m_surfaceX = 0, m_surfaceY = 0;
 };
 
 extern std::vector< wlr_surface * > wayland_surfaces_deleted;
@@ -111,6 +121,7 @@ extern uint32_t inputCounter;
 
 void nudge_steamcompmgr( void );
 void take_screenshot( void );
+void steamcompmgr_send_frame_done_to_focus_window( void );
 
 extern void mangoapp_update( uint64_t visible_frametime, uint64_t app_frametime_ns, uint64_t latency_ns );
 gamescope_xwayland_server_t *steamcompmgr_get_focused_server();
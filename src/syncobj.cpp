@@ -0,0 +1,337 @@
+#include "syncobj.hpp"
+#include "wlserver.hpp"
+#include "steamcompmgr.hpp"
+#include "log.hpp"
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <xf86drm.h>
+
+extern "C" {
+#define static
+#define class class_
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_buffer.h>
+#include <wlr/types/wlr_surface.h>
+#undef static
+#undef class
+}
+
+#include "linux-drm-syncobj-v1-protocol.h"
+
+#define SYNCOBJ_MANAGER_VERSION 1
+
+static LogScope syncobj_log("syncobj");
+
+struct wlserver_timeline
+{
+	int drm_fd;
+	uint32_t handle;
+
+	~wlserver_timeline()
+	{
+		drmSyncobjDestroy(drm_fd, handle);
+	}
+};
+
+struct syncobj_point
+{
+	std::shared_ptr<wlserver_timeline> timeline;
+	uint64_t point;
+};
+
+struct syncobj_surface
+{
+	struct wl_resource *resource;
+	struct wlr_surface *surface;
+	struct wl_listener surface_destroy;
+
+	// Pending until the next commit
+	syncobj_point acquire;
+	syncobj_point release;
+};
+
+// Release points of commits whose buffer we still hold
+struct syncobj_buffer_release
+{
+	struct wlr_buffer *buf;
+	struct wl_listener release;
+	struct wl_listener destroy;
+
+	std::vector<syncobj_point> points;
+};
+
+// Only touched with the wayland lock held
+static int syncobj_drm_fd = -1;
+static std::unordered_map<struct wlr_surface *, syncobj_surface *> syncobj_surfaces;
+static std::unordered_map<struct wlr_buffer *, syncobj_buffer_release *> syncobj_buffer_releases;
+
+static void syncobj_signal(const syncobj_point &point)
+{
+	uint32_t handle = point.timeline->handle;
+	uint64_t value = point.point;
+	if (drmSyncobjTimelineSignal(point.timeline->drm_fd, &handle, &value, 1) != 0)
+		syncobj_log.errorf_errno("Failed to signal release point %" PRIu64, value);
+}
+
+static void buffer_release_finish(syncobj_buffer_release *br)
+{
+	// The last of our locks on the buffer is gone, so no composite reading it
+	// is outstanding and it's not on a plane anymore either.
+	for (const syncobj_point &point : br->points)
+		syncobj_signal(point);
+
+	wl_list_remove(&br->release.link);
+	wl_list_remove(&br->destroy.link);
+	syncobj_buffer_releases.erase(br->buf);
+	delete br;
+}
+
+static void buffer_handle_release(struct wl_listener *listener, void *data)
+{
+	syncobj_buffer_release *br = wl_container_of(listener, br, release);
+	buffer_release_finish(br);
+}
+
+static void buffer_handle_destroy(struct wl_listener *listener, void *data)
+{
+	syncobj_buffer_release *br = wl_container_of(listener, br, destroy);
+	buffer_release_finish(br);
+}
+
+static void release_on_buffer(struct wlr_buffer *buf, syncobj_point point)
+{
+	syncobj_buffer_release *&br = syncobj_buffer_releases[buf];
+	if (br == nullptr) {
+		br = new syncobj_buffer_release();
+		br->buf = buf;
+		br->release.notify = buffer_handle_release;
+		wl_signal_add(&buf->events.release, &br->release);
+		br->destroy.notify = buffer_handle_destroy;
+		wl_signal_add(&buf->events.destroy, &br->destroy);
+	}
+
+	br->points.push_back(std::move(point));
+}
+
+void syncobj_surface_commit(struct wlr_surface *surf, struct wlr_buffer *buf, ResListEntry_t *entry)
+{
+	auto it = syncobj_surfaces.find(surf);
+	if (it == syncobj_surfaces.end())
+		return;
+
+	syncobj_surface *surface = it->second;
+
+	syncobj_point acquire = std::move(surface->acquire);
+	syncobj_point release = std::move(surface->release);
+	surface->acquire = {};
+	surface->release = {};
+
+	// Plain implicit sync for this commit
+	if (!acquire.timeline && !release.timeline)
+		return;
+
+	if (!acquire.timeline) {
+		wl_resource_post_error(surface->resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_ACQUIRE_POINT, "Missing acquire point");
+		return;
+	}
+	if (!release.timeline) {
+		wl_resource_post_error(surface->resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_RELEASE_POINT, "Missing release point");
+		return;
+	}
+	if (acquire.timeline == release.timeline && acquire.point >= release.point) {
+		wl_resource_post_error(surface->resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_CONFLICTING_POINTS, "Release point must come after the acquire point");
+		return;
+	}
+
+	// Only dmabufs can be synchronized explicitly, shm has nothing to wait on
+	struct wlr_dmabuf_attributes dmabuf = {};
+	if (buf != nullptr && !wlr_buffer_get_dmabuf(buf, &dmabuf)) {
+		wl_resource_post_error(surface->resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_UNSUPPORTED_BUFFER, "Explicit sync needs a dmabuf");
+		return;
+	}
+
+	if (buf == nullptr) {
+		// Never going to look at it
+		syncobj_signal(release);
+		return;
+	}
+
+	entry->acquireTimeline = std::move(acquire.timeline);
+	entry->acquirePoint = acquire.point;
+
+	release_on_buffer(buf, std::move(release));
+}
+
+bool syncobj_timeline_wait(const std::shared_ptr<struct wlserver_timeline> &timeline, uint64_t point, uint64_t timeoutNS)
+{
+	uint32_t handle = timeline->handle;
+	int64_t deadline = get_time_in_nanos() + timeoutNS;
+
+	// Clients may hand us points nothing was submitted for yet
+	int ret = drmSyncobjTimelineWait(timeline->drm_fd, &handle, &point, 1, deadline, DRM_SYNCOBJ_WAIT_FLAGS_WAIT_FOR_SUBMIT, nullptr);
+	if (ret == -ETIME)
+		return false;
+	if (ret != 0)
+		syncobj_log.errorf("Failed to wait on acquire point %" PRIu64 ": %s", point, strerror(-ret));
+
+	return true;
+}
+
+static syncobj_point timeline_point(struct wl_resource *timeline_resource, uint32_t point_hi, uint32_t point_lo)
+{
+	std::shared_ptr<wlserver_timeline> *timeline = (std::shared_ptr<wlserver_timeline> *)wl_resource_get_user_data(timeline_resource);
+	return { *timeline, (uint64_t)point_hi << 32 | point_lo };
+}
+
+static void surface_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void surface_handle_set_acquire_point(struct wl_client *client, struct wl_resource *resource, struct wl_resource *timeline_resource, uint32_t point_hi, uint32_t point_lo)
+{
+	syncobj_surface *surface = (syncobj_surface *)wl_resource_get_user_data(resource);
+	if (surface == nullptr) {
+		wl_resource_post_error(resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_SURFACE, "The surface was destroyed");
+		return;
+	}
+
+	surface->acquire = timeline_point(timeline_resource, point_hi, point_lo);
+}
+
+static void surface_handle_set_release_point(struct wl_client *client, struct wl_resource *resource, struct wl_resource *timeline_resource, uint32_t point_hi, uint32_t point_lo)
+{
+	syncobj_surface *surface = (syncobj_surface *)wl_resource_get_user_data(resource);
+	if (surface == nullptr) {
+		wl_resource_post_error(resource, WP_LINUX_DRM_SYNCOBJ_SURFACE_V1_ERROR_NO_SURFACE, "The surface was destroyed");
+		return;
+	}
+
+	surface->release = timeline_point(timeline_resource, point_hi, point_lo);
+}
+
+static const struct wp_linux_drm_syncobj_surface_v1_interface surface_impl = {
+	.destroy = surface_handle_destroy,
+	.set_acquire_point = surface_handle_set_acquire_point,
+	.set_release_point = surface_handle_set_release_point,
+};
+
+static void surface_destroy(syncobj_surface *surface)
+{
+	wl_resource_set_user_data(surface->resource, nullptr);
+	wl_list_remove(&surface->surface_destroy.link);
+	syncobj_surfaces.erase(surface->surface);
+	delete surface;
+}
+
+static void surface_handle_resource_destroy(struct wl_resource *resource)
+{
+	syncobj_surface *surface = (syncobj_surface *)wl_resource_get_user_data(resource);
+	if (surface == nullptr)
+		return;
+
+	// Points set since the last commit are simply dropped
+	surface_destroy(surface);
+}
+
+static void surface_handle_surface_destroy(struct wl_listener *listener, void *data)
+{
+	syncobj_surface *surface = wl_container_of(listener, surface, surface_destroy);
+	surface_destroy(surface);
+}
+
+static void timeline_handle_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct wp_linux_drm_syncobj_timeline_v1_interface timeline_impl = {
+	.destroy = timeline_handle_destroy,
+};
+
+static void timeline_handle_resource_destroy(struct wl_resource *resource)
+{
+	// Points already set keep their own reference
+	std::shared_ptr<wlserver_timeline> *timeline = (std::shared_ptr<wlserver_timeline> *)wl_resource_get_user_data(resource);
+	delete timeline;
+}
+
+static void manager_handle_destroy(struct wl_client *client, struct wl_resource *manager_resource)
+{
+	wl_resource_destroy(manager_resource);
+}
+
+static void manager_handle_get_surface(struct wl_client *client, struct wl_resource *manager_resource, uint32_t id, struct wl_resource *surface_resource)
+{
+	struct wlr_surface *wlr_surface = wlr_surface_from_resource(surface_resource);
+
+	if (syncobj_surfaces.count(wlr_surface)) {
+		wl_resource_post_error(manager_resource, WP_LINUX_DRM_SYNCOBJ_MANAGER_V1_ERROR_SURFACE_EXISTS, "The surface already has a syncobj surface");
+		return;
+	}
+
+	uint32_t version = wl_resource_get_version(manager_resource);
+	struct wl_resource *resource = wl_resource_create(client, &wp_linux_drm_syncobj_surface_v1_interface, version, id);
+
+	syncobj_surface *surface = new syncobj_surface();
+	surface->resource = resource;
+	surface->surface = wlr_surface;
+	surface->surface_destroy.notify = surface_handle_surface_destroy;
+	wl_signal_add(&wlr_surface->events.destroy, &surface->surface_destroy);
+
+	wl_resource_set_implementation(resource, &surface_impl, surface, surface_handle_resource_destroy);
+
+	syncobj_surfaces[wlr_surface] = surface;
+}
+
+static void manager_handle_import_timeline(struct wl_client *client, struct wl_resource *manager_resource, uint32_t id, int32_t fd)
+{
+	uint32_t handle = 0;
+	int ret = drmSyncobjFDToHandle(syncobj_drm_fd, fd, &handle);
+	close(fd);
+
+	if (ret != 0) {
+		wl_resource_post_error(manager_resource, WP_LINUX_DRM_SYNCOBJ_MANAGER_V1_ERROR_INVALID_TIMELINE, "Failed to import the timeline");
+		return;
+	}
+
+	std::shared_ptr<wlserver_timeline> *timeline = new std::shared_ptr<wlserver_timeline>(new wlserver_timeline{ syncobj_drm_fd, handle });
+
+	uint32_t version = wl_resource_get_version(manager_resource);
+	struct wl_resource *resource = wl_resource_create(client, &wp_linux_drm_syncobj_timeline_v1_interface, version, id);
+	wl_resource_set_implementation(resource, &timeline_impl, timeline, timeline_handle_resource_destroy);
+}
+
+static const struct wp_linux_drm_syncobj_manager_v1_interface manager_impl = {
+	.destroy = manager_handle_destroy,
+	.get_surface = manager_handle_get_surface,
+	.import_timeline = manager_handle_import_timeline,
+};
+
+static void manager_bind(struct wl_client *client, void *data, uint32_t version, uint32_t id)
+{
+	struct wl_resource *resource = wl_resource_create(client, &wp_linux_drm_syncobj_manager_v1_interface, version, id);
+	wl_resource_set_implementation(resource, &manager_impl, nullptr, nullptr);
+}
+
+void create_syncobj_manager(struct wlserver_t *wlserver)
+{
+	int drm_fd = wlr_renderer_get_drm_fd(wlserver->wlr.renderer);
+
+	uint64_t cap = 0;
+	if (drm_fd < 0 || drmGetCap(drm_fd, DRM_CAP_SYNCOBJ_TIMELINE, &cap) != 0 || cap == 0) {
+		syncobj_log.infof("No timeline syncobj support, clients will have to use implicit sync");
+		return;
+	}
+
+	syncobj_drm_fd = drm_fd;
+	wl_global_create(wlserver->display, &wp_linux_drm_syncobj_manager_v1_interface, SYNCOBJ_MANAGER_VERSION, nullptr, manager_bind);
+}
@@ -0,0 +1,17 @@
+// Explicit synchronization with DRM timeline syncobjs
+
+#pragma once
+
+#include "wlserver.hpp"
+
+void create_syncobj_manager(struct wlserver_t *wlserver);
+
+// Moves the acquire point set for surf's latest commit into entry. The release
+// point gets signalled once buf isn't used by us anymore, or right away if buf
+// is null because the commit is dropped.
+// Needs the wlserver lock.
+void syncobj_surface_commit(struct wlr_surface *surf, struct wlr_buffer *buf, ResListEntry_t *entry);
+
+// Blocks until point is signalled or timeoutNS passed, returns false on the latter.
+// Safe to call from any thread.
+bool syncobj_timeline_wait(const std::shared_ptr<struct wlserver_timeline> &timeline, uint64_t point, uint64_t timeoutNS);
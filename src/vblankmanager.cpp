@@ -161,3 +161,21 @@ void vblank_mark_possible_vblank( uint64_t nanos )
 {
 	g_lastVblank = nanos;
 }
+
+uint64_t vblank_next_time( void )
+{
+	const int refresh = g_nNestedRefresh ? g_nNestedRefresh : g_nOutputRefresh;
+	const uint64_t nsecInterval = 1'000'000'000ul / refresh;
+
+	uint64_t now = get_time_in_nanos();
+	uint64_t nextVblank = g_lastVblank + nsecInterval;
+	if ( nextVblank < now )
+		nextVblank += ( ( now - nextVblank ) / nsecInterval + 1 ) * nsecInterval;
+
+	return nextVblank;
+}
+
+uint64_t vblank_paint_offset( void )
+{
+	return g_uRollingMaxDrawTime + g_uVblankDrawBufferRedZoneNS;
+}
@@ -4,6 +4,11 @@ int vblank_init( void );
 
 void vblank_mark_possible_vblank( uint64_t nanos );
 
+// Predicted time of the next vblank after now.
+uint64_t vblank_next_time( void );
+// How long before a vblank we start painting for it.
+uint64_t vblank_paint_offset( void );
+
 extern std::atomic<uint64_t> g_uVblankDrawTimeNS;
 
 const unsigned int g_uDefaultVBlankRedZone = 1'650'000;
@@ -7,6 +7,9 @@
 #include <pthread.h>
 #include <string.h>
 #include <poll.h>	
+#include <sys/eventfd.h>
+
+#include <algorithm>
 
 #include <linux/input-event-codes.h>
 
@@ -27,7 +30,10 @@ extern "C" {
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_keyboard.h>
 #include <wlr/types/wlr_pointer.h>
+#include <wlr/types/wlr_presentation_time.h>
 #include <wlr/types/wlr_touch.h>
+#include <wlr/types/wlr_viewporter.h>
+#include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/xwayland.h>
 #include <wlr/util/log.h>
 #undef static
@@ -43,6 +49,8 @@ extern "C" {
 #include "steamcompmgr.hpp"
 #include "log.hpp"
 #include "ime.hpp"
+#include "syncobj.hpp"
+#include "control.hpp"
 #include "xwayland_ctx.hpp"
 
 #if HAVE_PIPEWIRE
@@ -55,6 +63,30 @@ static LogScope wl_log("wlserver");
 
 static struct wlserver_t wlserver = {};
 
+// Published pointer state, only written with the wayland lock held and read
+// locklessly by the compositor. Odd sequence numbers mean a write is underway.
+static struct {
+	std::atomic<uint64_t> seq;
+	std::atomic<struct wlr_surface *> surface;
+	std::atomic<int> x, y;
+	std::atomic<bool> buttonHeld;
+	std::atomic<bool> needsXQuery;
+} cursor_state;
+
+// Set once nested XTest motion moved the pointer where only the X server
+// knows, and kept until input puts it somewhere we know again, so that a
+// button press in between doesn't publish our stale position as current.
+// Under the wayland lock.
+static bool g_bCursorOwnedByX = false;
+
+// Other threads queue events for clients under the wayland lock, then poke
+// this so the Wayland thread flushes them all at once rather than every
+// unlock writing to every client's socket, or the events sitting there
+// until some client sends a request.
+static int g_nFlushEventFd = -1;
+static std::atomic<bool> g_bFlushPending = { false };
+static thread_local bool t_bWaylandThread = false;
+
 struct wlserver_content_override {
 	struct wlr_surface *surface;
 	uint32_t x11_window;
@@ -70,6 +102,23 @@ static void wlserver_surface_set_wlr( struct wlserver_surface *surf, struct wlr_
 
 extern const struct wlr_surface_role xwayland_surface_role;
 
+static struct wlserver_viewport_t wlserver_get_viewport( struct wlr_surface *surf )
+{
+	struct wlserver_viewport_t viewport = {};
+	viewport.enabled = surf->current.viewport.has_src || surf->current.viewport.has_dst || surf->current.scale != 1;
+
+	struct wlr_fbox box;
+	wlr_surface_get_buffer_source_box( surf, &box );
+	viewport.srcX = box.x;
+	viewport.srcY = box.y;
+	viewport.srcWidth = box.width;
+	viewport.srcHeight = box.height;
+	viewport.width = surf->current.width;
+	viewport.height = surf->current.height;
+
+	return viewport;
+}
+
 std::vector<ResListEntry_t> gamescope_xwayland_server_t::retrieve_commits()
 {
 	std::vector<ResListEntry_t> commits;
@@ -80,16 +129,11 @@ std::vector<ResListEntry_t> gamescope_xwayland_server_t::retrieve_commits()
 	return commits;
 }
 
-void gamescope_xwayland_server_t::wayland_commit(struct wlr_surface *surf, struct wlr_buffer *buf)
+void gamescope_xwayland_server_t::wayland_commit(ResListEntry_t newEntry)
 {
 	{
 		std::lock_guard<std::mutex> lock( wayland_commit_lock );
-
-		ResListEntry_t newEntry = {
-			.surf = surf,
-			.buf = buf,
-		};
-		wayland_commit_queue.push_back( newEntry );
+		wayland_commit_queue.push_back( std::move( newEntry ) );
 	}
 
 	nudge_steamcompmgr();
@@ -101,6 +145,7 @@ void xwayland_surface_role_commit(struct wlr_surface *wlr_surface) {
 	VulkanWlrTexture_t *tex = (VulkanWlrTexture_t *) wlr_surface_get_texture( wlr_surface );
 	if ( tex == NULL )
 	{
+		syncobj_surface_commit( wlr_surface, nullptr, nullptr );
 		return;
 	}
 
@@ -108,9 +153,18 @@ void xwayland_surface_role_commit(struct wlr_surface *wlr_surface) {
 
 	gpuvis_trace_printf( "xwayland_surface_role_commit wlr_surface %p", wlr_surface );
 
+	ResListEntry_t newEntry = {
+		.surf = wlr_surface,
+		.buf = buf,
+		.feedback = wlr_presentation_surface_sampled( wlserver.wlr.presentation, wlr_surface ),
+		.viewport = wlserver_get_viewport( wlr_surface ),
+	};
+	syncobj_surface_commit( wlr_surface, buf, &newEntry );
+	newEntry.commitTime = get_time_in_nanos();
+
 	gamescope_xwayland_server_t *server = (gamescope_xwayland_server_t *)wlr_surface->data;
 	assert(server);
-	server->wayland_commit( wlr_surface, buf );
+	server->wayland_commit( std::move( newEntry ) );
 }
 
 static void xwayland_surface_role_precommit(struct wlr_surface *wlr_surface) {
@@ -194,8 +248,60 @@ static void wlserver_handle_key(struct wl_listener *listener, void *data)
 	bump_input_counter();
 }
 
+static void wlserver_publish_cursor( void )
+{
+	uint64_t seq = cursor_state.seq.load( std::memory_order_relaxed );
+	cursor_state.seq.store( seq + 1, std::memory_order_relaxed );
+	std::atomic_thread_fence( std::memory_order_release );
+
+	cursor_state.surface.store( wlserver.mouse_focus_surface, std::memory_order_relaxed );
+	cursor_state.x.store( (int)wlserver.mouse_surface_cursorx, std::memory_order_relaxed );
+	cursor_state.y.store( (int)wlserver.mouse_surface_cursory, std::memory_order_relaxed );
+	cursor_state.buttonHeld.store( wlserver.buttons_down > 0, std::memory_order_relaxed );
+	cursor_state.needsXQuery.store( g_bCursorOwnedByX, std::memory_order_relaxed );
+
+	cursor_state.seq.store( seq + 2, std::memory_order_release );
+}
+
+bool wlserver_get_cursor( uint64_t serial, struct wlserver_cursor_t *pCursor )
+{
+	for (;;)
+	{
+		uint64_t seq = cursor_state.seq.load( std::memory_order_acquire );
+		if ( seq == serial )
+			return false;
+		if ( seq & 1 )
+			continue;
+
+		pCursor->surface = cursor_state.surface.load( std::memory_order_relaxed );
+		pCursor->x = cursor_state.x.load( std::memory_order_relaxed );
+		pCursor->y = cursor_state.y.load( std::memory_order_relaxed );
+		pCursor->bButtonHeld = cursor_state.buttonHeld.load( std::memory_order_relaxed );
+		pCursor->bNeedsXQuery = cursor_state.needsXQuery.load( std::memory_order_relaxed );
+		pCursor->serial = seq;
+
+		std::atomic_thread_fence( std::memory_order_acquire );
+		if ( cursor_state.seq.load( std::memory_order_relaxed ) == seq )
+			return true;
+	}
+}
+
+static void wlserver_pointer_button( uint32_t time, uint32_t button, enum wlr_button_state state )
+{
+	wlr_seat_pointer_notify_button( wlserver.wlr.seat, time, button, state );
+
+	if ( state == WLR_BUTTON_PRESSED )
+		wlserver.buttons_down++;
+	else if ( wlserver.buttons_down > 0 )
+		wlserver.buttons_down--;
+
+	wlserver_publish_cursor();
+}
+
 static void wlserver_movecursor( int x, int y )
 {
+	g_bCursorOwnedByX = false;
+
 	wlserver.mouse_surface_cursorx += x;
 
 	if ( wlserver.mouse_surface_cursorx > wlserver.mouse_focus_surface->current.width - 1 )
@@ -231,6 +337,7 @@ static void wlserver_handle_pointer_motion(struct wl_listener *listener, void *d
 		wlserver_movecursor( event->unaccel_dx, event->unaccel_dy );
 
 		wlr_seat_pointer_notify_motion( wlserver.wlr.seat, event->time_msec, wlserver.mouse_surface_cursorx, wlserver.mouse_surface_cursory );
+		wlserver_publish_cursor();
 	}
 }
 
@@ -239,7 +346,7 @@ static void wlserver_handle_pointer_button(struct wl_listener *listener, void *d
 	struct wlserver_pointer *pointer = wl_container_of( listener, pointer, button );
 	struct wlr_event_pointer_button *event = (struct wlr_event_pointer_button *) data;
 
-	wlr_seat_pointer_notify_button( wlserver.wlr.seat, event->time_msec, event->button, event->state );
+	wlserver_pointer_button( event->time_msec, event->button, event->state );
 }
 
 static void wlserver_handle_pointer_axis(struct wl_listener *listener, void *data)
@@ -296,6 +403,8 @@ static void wlserver_handle_touch_down(struct wl_listener *listener, void *data)
 
 		wlserver.mouse_surface_cursorx = x;
 		wlserver.mouse_surface_cursory = y;
+		g_bCursorOwnedByX = false;
+		wlserver_publish_cursor();
 
 		if ( g_nTouchClickMode == WLSERVER_TOUCH_CLICK_PASSTHROUGH )
 		{
@@ -322,7 +431,7 @@ static void wlserver_handle_touch_down(struct wl_listener *listener, void *data)
 
 			if ( button != 0 && g_nTouchClickMode < WLSERVER_BUTTON_COUNT )
 			{
-				wlr_seat_pointer_notify_button( wlserver.wlr.seat, event->time_msec, button, WLR_BUTTON_PRESSED );
+				wlserver_pointer_button( event->time_msec, button, WLR_BUTTON_PRESSED );
 				wlr_seat_pointer_notify_frame( wlserver.wlr.seat );
 
 				wlserver.button_held[ g_nTouchClickMode ] = true;
@@ -349,7 +458,7 @@ static void wlserver_handle_touch_up(struct wl_listener *listener, void *data)
 
 				if ( button != 0 )
 				{
-					wlr_seat_pointer_notify_button( wlserver.wlr.seat, event->time_msec, button, WLR_BUTTON_RELEASED );
+					wlserver_pointer_button( event->time_msec, button, WLR_BUTTON_RELEASED );
 					bReleasedAny = true;
 				}
 
@@ -393,6 +502,8 @@ static void wlserver_handle_touch_motion(struct wl_listener *listener, void *dat
 
 		wlserver.mouse_surface_cursorx = x;
 		wlserver.mouse_surface_cursory = y;
+		g_bCursorOwnedByX = false;
+		wlserver_publish_cursor();
 
 		if ( g_nTouchClickMode == WLSERVER_TOUCH_CLICK_PASSTHROUGH )
 		{
@@ -504,6 +615,162 @@ static void wlserver_new_surface(struct wl_listener *l, void *data)
 
 static struct wl_listener new_surface_listener = { .notify = wlserver_new_surface };
 
+struct wlserver_xdg_surface_info
+{
+	struct wlr_xdg_surface *xdg_surface;
+	bool mapped;
+
+	struct wl_listener map;
+	struct wl_listener unmap;
+	struct wl_listener destroy;
+	struct wl_listener commit;
+};
+
+// Only touched with the wayland lock held
+static std::vector<wlserver_xdg_surface_info *> xdg_surfaces;
+static int xdg_width, xdg_height;
+
+static std::mutex xdg_queue_lock;
+static std::vector<wlserver_xdg_event_t> xdg_events;
+static std::vector<ResListEntry_t> xdg_commits;
+
+std::vector<wlserver_xdg_event_t> wlserver_xdg_retrieve_events( void )
+{
+	std::lock_guard<std::mutex> lock( xdg_queue_lock );
+	return std::move( xdg_events );
+}
+
+std::vector<ResListEntry_t> wlserver_xdg_retrieve_commits( void )
+{
+	std::lock_guard<std::mutex> lock( xdg_queue_lock );
+	return std::move( xdg_commits );
+}
+
+static void xdg_push_event( struct wlserver_xdg_surface_info *info, enum wlserver_xdg_event_type type )
+{
+	wlserver_xdg_event_t event = {};
+	event.type = type;
+	event.surf = info->xdg_surface->surface;
+	event.pid = -1;
+
+	if ( type == WLSERVER_XDG_MAP )
+	{
+		event.width = info->xdg_surface->surface->current.width;
+		event.height = info->xdg_surface->surface->current.height;
+
+		struct wl_client *client = wl_resource_get_client( info->xdg_surface->resource );
+		wl_client_get_credentials( client, &event.pid, nullptr, nullptr );
+
+		if ( info->xdg_surface->toplevel->title )
+			event.title = strdup( info->xdg_surface->toplevel->title );
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( xdg_queue_lock );
+		xdg_events.push_back( event );
+	}
+
+	nudge_steamcompmgr();
+}
+
+static void xdg_surface_handle_map( struct wl_listener *l, void *data )
+{
+	struct wlserver_xdg_surface_info *info = wl_container_of( l, info, map );
+	info->mapped = true;
+	xdg_push_event( info, WLSERVER_XDG_MAP );
+}
+
+static void xdg_surface_handle_unmap( struct wl_listener *l, void *data )
+{
+	struct wlserver_xdg_surface_info *info = wl_container_of( l, info, unmap );
+	info->mapped = false;
+	xdg_push_event( info, WLSERVER_XDG_UNMAP );
+}
+
+static void xdg_surface_handle_commit( struct wl_listener *l, void *data )
+{
+	struct wlserver_xdg_surface_info *info = wl_container_of( l, info, commit );
+	struct wlr_surface *wlr_surface = info->xdg_surface->surface;
+
+	VulkanWlrTexture_t *tex = info->mapped ? (VulkanWlrTexture_t *) wlr_surface_get_texture( wlr_surface ) : NULL;
+	if ( tex == NULL )
+	{
+		syncobj_surface_commit( wlr_surface, nullptr, nullptr );
+		return;
+	}
+
+	struct wlr_buffer *buf = wlr_buffer_lock( tex->buf );
+
+	gpuvis_trace_printf( "xdg_surface_handle_commit wlr_surface %p", wlr_surface );
+
+	ResListEntry_t newEntry = {
+		.surf = wlr_surface,
+		.buf = buf,
+		.feedback = wlr_presentation_surface_sampled( wlserver.wlr.presentation, wlr_surface ),
+		.viewport = wlserver_get_viewport( wlr_surface ),
+	};
+	syncobj_surface_commit( wlr_surface, buf, &newEntry );
+	newEntry.commitTime = get_time_in_nanos();
+
+	{
+		std::lock_guard<std::mutex> lock( xdg_queue_lock );
+		xdg_commits.push_back( std::move( newEntry ) );
+	}
+
+	nudge_steamcompmgr();
+}
+
+static void xdg_surface_handle_destroy( struct wl_listener *l, void *data )
+{
+	struct wlserver_xdg_surface_info *info = wl_container_of( l, info, destroy );
+
+	if ( info->mapped )
+		xdg_push_event( info, WLSERVER_XDG_UNMAP );
+
+	wl_list_remove( &info->map.link );
+	wl_list_remove( &info->unmap.link );
+	wl_list_remove( &info->destroy.link );
+	wl_list_remove( &info->commit.link );
+
+	xdg_surfaces.erase( std::remove( xdg_surfaces.begin(), xdg_surfaces.end(), info ), xdg_surfaces.end() );
+	delete info;
+}
+
+static void xdg_shell_handle_new_surface( struct wl_listener *l, void *data )
+{
+	struct wlr_xdg_surface *xdg_surface = (struct wlr_xdg_surface *) data;
+
+	// Popups have nothing to be placed relative to on our side
+	if ( xdg_surface->role != WLR_XDG_SURFACE_ROLE_TOPLEVEL )
+		return;
+
+	struct wlserver_xdg_surface_info *info = new wlserver_xdg_surface_info{};
+	info->xdg_surface = xdg_surface;
+
+	info->map.notify = xdg_surface_handle_map;
+	wl_signal_add( &xdg_surface->events.map, &info->map );
+	info->unmap.notify = xdg_surface_handle_unmap;
+	wl_signal_add( &xdg_surface->events.unmap, &info->unmap );
+	info->destroy.notify = xdg_surface_handle_destroy;
+	wl_signal_add( &xdg_surface->events.destroy, &info->destroy );
+	info->commit.notify = xdg_surface_handle_commit;
+	wl_signal_add( &xdg_surface->surface->events.commit, &info->commit );
+
+	xdg_surfaces.push_back( info );
+
+	// Same deal as X11 games, everything is fullscreen at the nested resolution
+	if ( !xdg_width || !xdg_height )
+	{
+		xdg_width = g_nNestedWidth;
+		xdg_height = g_nNestedHeight;
+	}
+	wlr_xdg_toplevel_set_size( xdg_surface, xdg_width, xdg_height );
+	wlr_xdg_toplevel_set_fullscreen( xdg_surface, true );
+	wlr_xdg_toplevel_set_activated( xdg_surface, true );
+}
+
+static struct wl_listener xdg_shell_new_surface_listener = { .notify = xdg_shell_handle_new_surface };
+
 void gamescope_xwayland_server_t::destroy_content_override( struct wlserver_content_override *co )
 {
 	wl_list_remove( &co->surface_destroy_listener.link );
@@ -614,7 +881,7 @@ static void create_gamescope_pipewire( void )
 static void handle_session_active( struct wl_listener *listener, void *data )
 {
 	if (wlserver.wlr.session->active) {
-		g_DRM.out_of_date = true;
+		drm_request_probe( &g_DRM );
 		g_DRM.needs_modeset = true;
 	}
 	g_DRM.paused = !wlserver.wlr.session->active;
@@ -662,10 +929,10 @@ bool wlsession_init( void ) {
 
 static void kms_device_handle_change( struct wl_listener *listener, void *data )
 {
-	g_DRM.out_of_date = true;
 	wl_log.infof( "Got change event for KMS device" );
 
-	nudge_steamcompmgr();
+	// The probe thread nudges us once it's done
+	drm_request_probe( &g_DRM );
 }
 
 int wlsession_open_kms( const char *device_name ) {
@@ -729,6 +996,10 @@ bool wlserver_init( void ) {
 
 	wlserver.event_loop = wl_display_get_event_loop(wlserver.display);
 
+	g_nFlushEventFd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	if ( g_nFlushEventFd < 0 )
+		wl_log.errorf_errno( "Failed to create flush eventfd, flushing on unlock" );
+
 	wlserver.wlr.multi_backend = wlr_multi_backend_create(wlserver.display);
 
 	assert( wlserver.event_loop && wlserver.wlr.multi_backend );
@@ -769,8 +1040,19 @@ bool wlserver_init( void ) {
 
 	wl_signal_add( &wlserver.wlr.compositor->events.new_surface, &new_surface_listener );
 
+	wlserver.wlr.xdg_shell = wlr_xdg_shell_create( wlserver.display );
+	wl_signal_add( &wlserver.wlr.xdg_shell->events.new_surface, &xdg_shell_new_surface_listener );
+
+	wlserver.wlr.presentation = wlr_presentation_create( wlserver.display, wlserver.wlr.multi_backend );
+
+	wlr_viewporter_create( wlserver.display );
+
 	create_ime_manager( &wlserver );
 
+	create_syncobj_manager( &wlserver );
+
+	create_control_manager( &wlserver );
+
 	create_gamescope_xwayland();
 
 #if HAVE_PIPEWIRE
@@ -851,7 +1133,16 @@ void wlserver_lock(void)
 
 void wlserver_unlock(void)
 {
-	wl_display_flush_clients(wlserver.display);
+	if ( t_bWaylandThread || g_nFlushEventFd < 0 )
+	{
+		wl_display_flush_clients(wlserver.display);
+	}
+	else if ( !g_bFlushPending.exchange( true ) )
+	{
+		uint64_t one = 1;
+		if ( write( g_nFlushEventFd, &one, sizeof( one ) ) < 0 )
+			wl_display_flush_clients(wlserver.display);
+	}
 	pthread_mutex_unlock(&waylock);
 }
 
@@ -859,12 +1150,20 @@ extern std::mutex g_SteamCompMgrXWaylandServerMutex;
 
 void wlserver_run(void)
 {
-	struct pollfd pollfd = {
-		.fd = wl_event_loop_get_fd( wlserver.event_loop ),
-		.events = POLLIN,
+	t_bWaylandThread = true;
+
+	struct pollfd pollfds[2] = {
+		{
+			.fd = wl_event_loop_get_fd( wlserver.event_loop ),
+			.events = POLLIN,
+		},
+		{
+			.fd = g_nFlushEventFd,
+			.events = POLLIN,
+		},
 	};
 	while ( g_bRun ) {
-		int ret = poll( &pollfd, 1, -1 );
+		int ret = poll( pollfds, 2, -1 );
 		if ( ret < 0 ) {
 			if ( errno == EINTR )
 				continue;
@@ -872,21 +1171,34 @@ void wlserver_run(void)
 			break;
 		}
 
-		if ( pollfd.revents & (POLLHUP | POLLERR) ) {
-			wl_log.errorf( "socket %s", ( pollfd.revents & POLLERR ) ? "error" : "closed" );
+		if ( pollfds[0].revents & (POLLHUP | POLLERR) ) {
+			wl_log.errorf( "socket %s", ( pollfds[0].revents & POLLERR ) ? "error" : "closed" );
 			break;
 		}
 
-		if ( pollfd.revents & POLLIN ) {
+		if ( pollfds[1].revents & POLLIN ) {
+			uint64_t count;
+			if ( read( g_nFlushEventFd, &count, sizeof( count ) ) < 0 && errno != EAGAIN )
+				wl_log.errorf_errno( "failed to read flush eventfd" );
+		}
+
+		if ( ( pollfds[0].revents | pollfds[1].revents ) & POLLIN ) {
 			// We have wayland stuff to do, do it while locked
 			wlserver_lock();
 
-			wl_display_flush_clients(wlserver.display);
-			int ret = wl_event_loop_dispatch(wlserver.event_loop, 0);
-			if (ret < 0) {
-				break;
+			// Anything queued after this gets its own wakeup
+			g_bFlushPending = false;
+
+			// Clients whose socket was full get flushed again by the event
+			// loop once it's writable.
+			if ( pollfds[0].revents & POLLIN ) {
+				int ret = wl_event_loop_dispatch(wlserver.event_loop, 0);
+				if (ret < 0) {
+					break;
+				}
 			}
 
+			// Unlocking flushes what we and other threads queued
 			wlserver_unlock();
 		}
 	}
@@ -935,22 +1247,37 @@ void wlserver_mousefocus( struct wlr_surface *wlrsurface, int x /* = 0 */, int y
 		wlserver.mouse_surface_cursory = wlrsurface->current.height / 2.0;
 	}
 	wlr_seat_pointer_notify_enter( wlserver.wlr.seat, wlrsurface, wlserver.mouse_surface_cursorx, wlserver.mouse_surface_cursory );
+	wlserver_publish_cursor();
 }
 
 void wlserver_mousemotion( int x, int y, uint32_t time )
 {
+	// Native Wayland clients don't go through the X server
+	if ( wlserver.mouse_focus_surface != NULL && wlr_surface_is_xdg_surface( wlserver.mouse_focus_surface ) )
+	{
+		wlserver_movecursor( x, y );
+
+		wlr_seat_pointer_notify_motion( wlserver.wlr.seat, time, wlserver.mouse_surface_cursorx, wlserver.mouse_surface_cursory );
+		wlr_seat_pointer_notify_frame( wlserver.wlr.seat );
+		wlserver_publish_cursor();
+		return;
+	}
+
 	// TODO: Pick the xwayland_server with active focus
 	auto server = steamcompmgr_get_focused_server();
 	if ( server != NULL )
 	{
 		XTestFakeRelativeMotionEvent( server->get_xdisplay(), x, y, CurrentTime );
 		XFlush( server->get_xdisplay() );
+
+		g_bCursorOwnedByX = true;
+		wlserver_publish_cursor();
 	}
 }
 
 void wlserver_mousebutton( int button, bool press, uint32_t time )
 {
-	wlr_seat_pointer_notify_button( wlserver.wlr.seat, time, button, press ? WLR_BUTTON_PRESSED : WLR_BUTTON_RELEASED );
+	wlserver_pointer_button( time, button, press ? WLR_BUTTON_PRESSED : WLR_BUTTON_RELEASED );
 	wlr_seat_pointer_notify_frame( wlserver.wlr.seat );
 }
 
@@ -972,6 +1299,29 @@ void wlserver_send_frame_done( struct wlr_surface *surf, const struct timespec *
 	wlr_surface_send_frame_done( surf, when );
 }
 
+void wlserver_presentation_feedback_presented( const std::vector<struct wlr_presentation_feedback *> &feedbacks, uint64_t presentTime, uint64_t seq, uint32_t refresh, uint32_t flags )
+{
+	struct wlr_presentation_event event = {};
+	event.output = wlserver.wlr.output;
+	event.tv_sec = presentTime / 1'000'000'000lu;
+	event.tv_nsec = presentTime % 1'000'000'000lu;
+	event.refresh = refresh;
+	event.seq = seq;
+	event.flags = flags;
+
+	for ( struct wlr_presentation_feedback *feedback : feedbacks )
+	{
+		wlr_presentation_feedback_send_presented( feedback, &event );
+		wlr_presentation_feedback_destroy( feedback );
+	}
+}
+
+void wlserver_presentation_feedback_discard( struct wlr_presentation_feedback *feedback )
+{
+	// Sends discarded to anyone still waiting on it
+	wlr_presentation_feedback_destroy( feedback );
+}
+
 gamescope_xwayland_server_t *wlserver_get_xwayland_server( size_t index )
 {
 	if (index >= wlserver.wlr.xwayland_servers.size() )
@@ -1009,6 +1359,34 @@ static void wlserver_surface_set_wlr( struct wlserver_surface *surf, struct wlr_
 	}
 }
 
+bool wlserver_xdg_surface_attach( struct wlserver_surface *surf, struct wlr_surface *wlr_surf )
+{
+	for ( struct wlserver_xdg_surface_info *info : xdg_surfaces )
+	{
+		if ( info->xdg_surface->surface != wlr_surf || !info->mapped )
+			continue;
+
+		surf->destroy.notify = handle_surface_destroy;
+		wl_signal_add( &wlr_surf->events.destroy, &surf->destroy );
+		surf->wlr = wlr_surf;
+		return true;
+	}
+
+	return false;
+}
+
+void wlserver_xdg_set_size( int width, int height )
+{
+	if ( width == xdg_width && height == xdg_height )
+		return;
+
+	xdg_width = width;
+	xdg_height = height;
+
+	for ( struct wlserver_xdg_surface_info *info : xdg_surfaces )
+		wlr_xdg_toplevel_set_size( info->xdg_surface, xdg_width, xdg_height );
+}
+
 void wlserver_surface_init( struct wlserver_surface *surf, long x11_id )
 {
 	surf->wl_id = 0;
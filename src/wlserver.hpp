@@ -15,9 +15,29 @@
 struct _XDisplay;
 struct xwayland_ctx_t;
 
+// The part of a buffer a surface shows, in buffer pixels, and the surface-local
+// size it's shown at. Only enabled if that isn't simply all of the buffer at
+// its own size, i.e. the client used wp_viewporter or a buffer scale.
+struct wlserver_viewport_t {
+	bool enabled;
+	float srcX, srcY, srcWidth, srcHeight;
+	int width, height;
+};
+
+// A DRM timeline syncobj imported by a client
+struct wlserver_timeline;
+
 struct ResListEntry_t {
 	struct wlr_surface *surf;
 	struct wlr_buffer *buf;
+	// Owned by whoever ends up displaying buf, may be null
+	struct wlr_presentation_feedback *feedback;
+	struct wlserver_viewport_t viewport;
+	// Explicit sync, buf may only be read once this point is signalled.
+	// Null if the client relies on implicit sync.
+	std::shared_ptr<struct wlserver_timeline> acquireTimeline;
+	uint64_t acquirePoint;
+	uint64_t commitTime;
 };
 
 struct wlserver_content_override;
@@ -40,7 +60,7 @@ public:
 
 	std::unique_ptr<xwayland_ctx_t> ctx;
 
-	void wayland_commit(struct wlr_surface *surf, struct wlr_buffer *buf);
+	void wayland_commit(ResListEntry_t newEntry);
 
 	std::vector<ResListEntry_t> retrieve_commits();
 
@@ -74,6 +94,8 @@ struct wlserver_t {
 
 		struct wlr_renderer *renderer;
 		struct wlr_compositor *compositor;
+		struct wlr_xdg_shell *xdg_shell;
+		struct wlr_presentation *presentation;
 		struct wlr_session *session;	
 		struct wlr_seat *seat;
 		struct wlr_output *output;
@@ -90,6 +112,7 @@ struct wlserver_t {
 	double mouse_surface_cursory;
 	
 	bool button_held[ WLSERVER_BUTTON_COUNT ];
+	int buttons_down;
 	bool touch_down[ WLSERVER_TOUCH_COUNT ];
 
 	struct wl_listener session_active;
@@ -154,6 +177,70 @@ void wlserver_mousewheel( int x, int y, uint32_t time );
 
 void wlserver_send_frame_done( struct wlr_surface *surf, const struct timespec *when );
 
+// Mirrors wp_presentation_feedback.kind
+enum wlserver_presentation_flags {
+	WLSERVER_PRESENTATION_VSYNC = 0x1,
+	WLSERVER_PRESENTATION_HW_CLOCK = 0x2,
+	WLSERVER_PRESENTATION_HW_COMPLETION = 0x4,
+	WLSERVER_PRESENTATION_ZERO_COPY = 0x8,
+};
+
+// Tells clients their frames were shown at presentTime (CLOCK_MONOTONIC ns),
+// refresh being the ns until the next one or 0 if unknown. Consumes feedbacks.
+// Needs the wlserver lock.
+void wlserver_presentation_feedback_presented( const std::vector<struct wlr_presentation_feedback *> &feedbacks, uint64_t presentTime, uint64_t seq, uint32_t refresh, uint32_t flags );
+// For frames that never made it to the screen.
+// Needs the wlserver lock.
+void wlserver_presentation_feedback_discard( struct wlr_presentation_feedback *feedback );
+
+// Pointer state as last seen on the Wayland side, so the compositor can
+// follow the cursor without round-trips to the X server.
+struct wlserver_cursor_t
+{
+	struct wlr_surface *surface;
+	// Surface-local position
+	int x, y;
+	bool bButtonHeld;
+	// The X server moved the pointer on its own (nested XTest motion), only
+	// it knows where the pointer is and x/y are stale. Stays set on every
+	// publish until input moves the pointer somewhere we know again.
+	bool bNeedsXQuery;
+	uint64_t serial;
+};
+
+enum wlserver_xdg_event_type {
+	WLSERVER_XDG_MAP,
+	WLSERVER_XDG_UNMAP,
+};
+
+// A native Wayland xdg toplevel was mapped or unmapped
+struct wlserver_xdg_event_t {
+	enum wlserver_xdg_event_type type;
+	// Only used to identify the toplevel, it may be gone by the time this is
+	// handled.
+	struct wlr_surface *surf;
+	int width, height;
+	pid_t pid;
+	// Owned by the receiver, may be null
+	char *title;
+};
+
+std::vector<wlserver_xdg_event_t> wlserver_xdg_retrieve_events( void );
+std::vector<ResListEntry_t> wlserver_xdg_retrieve_commits( void );
+
+// Size native toplevels are configured at, they're told again when it changes.
+// Needs the wlserver lock.
+void wlserver_xdg_set_size( int width, int height );
+
+// Binds surf to an xdg toplevel we got a map event for, so it gets cleared
+// when that goes away. Returns false if it's already gone.
+// Needs the wlserver lock.
+bool wlserver_xdg_surface_attach( struct wlserver_surface *surf, struct wlr_surface *wlr_surf );
+
+// Fills pCursor and returns true if the pointer state changed since serial.
+// Lockless, safe to call from any thread.
+bool wlserver_get_cursor( uint64_t serial, struct wlserver_cursor_t *pCursor );
+
 gamescope_xwayland_server_t *wlserver_get_xwayland_server( size_t index );
 const char *wlserver_get_wl_display_name( void );
 
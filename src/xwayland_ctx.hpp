@@ -131,8 +131,12 @@ struct xwayland_ctx_t
 		Atom gamescopeFPSLimit;
 		Atom gamescopeDynamicRefresh;
 		Atom gamescopeLowLatency;
+		Atom gamescopeAllowTearing;
+		Atom gamescopeFramePacing;
+		Atom gamescopeDebugHud;
 
 		Atom gamescopeFSRFeedback;
+		Atom gamescopePreferredRenderSize;
 
 		Atom gamescopeBlurMode;
 		Atom gamescopeBlurRadius;
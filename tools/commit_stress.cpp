@@ -0,0 +1,715 @@
+// Load generator for the commit path
+//
+// Maps a number of xdg toplevels on gamescope's Wayland display (run it with
+// --expose-wayland, nested or on DRM) and commits new buffers on each at a
+// fixed rate, with shm or dmabuf buffers. Reports how many commits went
+// through, how long they took to be presented and how often every buffer of
+// a surface was still held by the compositor when the next commit was due,
+// which is what a backed up queue looks like from the client.
+//
+// Run gamescope with --commit-stats to see the same load stage by stage.
+
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <vector>
+
+#include <wayland-client.h>
+
+#include "xdg-shell-client-protocol.h"
+#include "presentation-time-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
+
+#if HAVE_GBM
+#include <gbm.h>
+#include <drm_fourcc.h>
+#endif
+
+static const uint32_t k_unBuckets = 24;
+static const uint64_t k_ulReportInterval = 1'000'000'000;
+
+struct Histogram_t
+{
+	uint32_t buckets[ k_unBuckets ] = {};
+	uint32_t unCount = 0;
+	uint64_t ulMax = 0;
+
+	void add( uint64_t ulDuration )
+	{
+		uint64_t ulMicros = ulDuration / 1000;
+		uint32_t unBucket = 0;
+		while ( unBucket < k_unBuckets - 1 && ulMicros >= ( 1ull << unBucket ) )
+			unBucket++;
+
+		buckets[ unBucket ]++;
+		unCount++;
+		ulMax = std::max( ulMax, ulDuration );
+	}
+
+	// Upper bound of the bucket the given fraction of samples falls in, in us
+	uint64_t percentile( float flFraction ) const
+	{
+		uint32_t unTarget = std::max<uint32_t>( unCount * flFraction, 1 );
+		uint32_t unSeen = 0;
+		for ( uint32_t i = 0; i < k_unBuckets; i++ )
+		{
+			unSeen += buckets[ i ];
+			if ( unSeen >= unTarget )
+				return 1ull << i;
+		}
+		return 1ull << ( k_unBuckets - 1 );
+	}
+
+	void merge( const Histogram_t &other )
+	{
+		for ( uint32_t i = 0; i < k_unBuckets; i++ )
+			buckets[ i ] += other.buckets[ i ];
+		unCount += other.unCount;
+		ulMax = std::max( ulMax, other.ulMax );
+	}
+};
+
+struct Counters_t
+{
+	uint32_t unCommits = 0;
+	uint32_t unPresented = 0;
+	uint32_t unDiscarded = 0;
+	// A commit was due but every buffer was still held by the compositor
+	uint32_t unStarved = 0;
+	// Commit to presentation
+	Histogram_t presentLatency;
+	// Commit to the compositor letting go of the buffer again
+	Histogram_t releaseLatency;
+
+	void merge( const Counters_t &other )
+	{
+		unCommits += other.unCommits;
+		unPresented += other.unPresented;
+		unDiscarded += other.unDiscarded;
+		unStarved += other.unStarved;
+		presentLatency.merge( other.presentLatency );
+		releaseLatency.merge( other.releaseLatency );
+	}
+};
+
+struct Buffer_t
+{
+	struct wl_buffer *buffer = nullptr;
+	bool bBusy = false;
+	uint64_t ulCommitTime = 0;
+#if HAVE_GBM
+	struct gbm_bo *bo = nullptr;
+#endif
+};
+
+struct Surface_t
+{
+	struct wl_surface *surface = nullptr;
+	struct xdg_surface *xdgSurface = nullptr;
+	struct xdg_toplevel *toplevel = nullptr;
+	bool bConfigured = false;
+
+	std::vector<Buffer_t> buffers;
+	uint32_t unNextBuffer = 0;
+
+	uint64_t ulNextCommit = 0;
+};
+
+struct Feedback_t
+{
+	uint64_t ulCommitTime;
+};
+
+enum class BufferType
+{
+	SHM,
+	DMABUF,
+};
+
+static struct
+{
+	uint32_t unSurfaces = 1;
+	double flRate = 60.0;
+	double flRampStep = 0.0;
+	uint32_t unDuration = 10;
+	uint32_t unWidth = 1280;
+	uint32_t unHeight = 720;
+	uint32_t unBufferCount = 3;
+	BufferType bufferType = BufferType::SHM;
+	const char *pDevice = "/dev/dri/renderD128";
+} s_options;
+
+static struct wl_display *s_display;
+static struct wl_compositor *s_compositor;
+static struct wl_shm *s_shm;
+static struct xdg_wm_base *s_wmBase;
+static struct wp_presentation *s_presentation;
+static struct zwp_linux_dmabuf_v1 *s_dmabuf;
+static clockid_t s_clock = CLOCK_MONOTONIC;
+
+static std::vector<Surface_t *> s_surfaces;
+static Counters_t s_interval;
+static Counters_t s_total;
+static volatile sig_atomic_t s_bRunning = 1;
+
+static uint64_t get_time( void )
+{
+	struct timespec ts;
+	clock_gettime( s_clock, &ts );
+	return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+static void buffer_release( void *data, struct wl_buffer *wl_buffer )
+{
+	Buffer_t *buffer = (Buffer_t *)data;
+	buffer->bBusy = false;
+	s_interval.releaseLatency.add( get_time() - buffer->ulCommitTime );
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	.release = buffer_release,
+};
+
+static void feedback_sync_output( void *data, struct wp_presentation_feedback *feedback, struct wl_output *output )
+{
+}
+
+static void feedback_presented( void *data, struct wp_presentation_feedback *feedback,
+	uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec,
+	uint32_t refresh, uint32_t seq_hi, uint32_t seq_lo, uint32_t flags )
+{
+	Feedback_t *pFeedback = (Feedback_t *)data;
+
+	uint64_t ulPresentTime = ( ( (uint64_t)tv_sec_hi << 32 ) | tv_sec_lo ) * 1'000'000'000ull + tv_nsec;
+	if ( ulPresentTime > pFeedback->ulCommitTime )
+		s_interval.presentLatency.add( ulPresentTime - pFeedback->ulCommitTime );
+	s_interval.unPresented++;
+
+	wp_presentation_feedback_destroy( feedback );
+	delete pFeedback;
+}
+
+static void feedback_discarded( void *data, struct wp_presentation_feedback *feedback )
+{
+	s_interval.unDiscarded++;
+
+	wp_presentation_feedback_destroy( feedback );
+	delete (Feedback_t *)data;
+}
+
+static const struct wp_presentation_feedback_listener feedback_listener = {
+	.sync_output = feedback_sync_output,
+	.presented = feedback_presented,
+	.discarded = feedback_discarded,
+};
+
+static void presentation_clock_id( void *data, struct wp_presentation *presentation, uint32_t clk_id )
+{
+	s_clock = (clockid_t)clk_id;
+}
+
+static const struct wp_presentation_listener presentation_listener = {
+	.clock_id = presentation_clock_id,
+};
+
+static void wm_base_ping( void *data, struct xdg_wm_base *wm_base, uint32_t serial )
+{
+	xdg_wm_base_pong( wm_base, serial );
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+	.ping = wm_base_ping,
+};
+
+static void xdg_surface_configure( void *data, struct xdg_surface *xdg_surface, uint32_t serial )
+{
+	Surface_t *surface = (Surface_t *)data;
+	xdg_surface_ack_configure( xdg_surface, serial );
+	surface->bConfigured = true;
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+	.configure = xdg_surface_configure,
+};
+
+static void toplevel_configure( void *data, struct xdg_toplevel *toplevel, int32_t width, int32_t height, struct wl_array *states )
+{
+}
+
+static void toplevel_close( void *data, struct xdg_toplevel *toplevel )
+{
+	s_bRunning = 0;
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+	.configure = toplevel_configure,
+	.close = toplevel_close,
+};
+
+static void registry_global( void *data, struct wl_registry *registry, uint32_t name, const char *interface, uint32_t version )
+{
+	if ( strcmp( interface, wl_compositor_interface.name ) == 0 )
+		s_compositor = (struct wl_compositor *)wl_registry_bind( registry, name, &wl_compositor_interface, 4 );
+	else if ( strcmp( interface, wl_shm_interface.name ) == 0 )
+		s_shm = (struct wl_shm *)wl_registry_bind( registry, name, &wl_shm_interface, 1 );
+	else if ( strcmp( interface, xdg_wm_base_interface.name ) == 0 )
+	{
+		s_wmBase = (struct xdg_wm_base *)wl_registry_bind( registry, name, &xdg_wm_base_interface, 1 );
+		xdg_wm_base_add_listener( s_wmBase, &wm_base_listener, nullptr );
+	}
+	else if ( strcmp( interface, wp_presentation_interface.name ) == 0 )
+	{
+		s_presentation = (struct wp_presentation *)wl_registry_bind( registry, name, &wp_presentation_interface, 1 );
+		wp_presentation_add_listener( s_presentation, &presentation_listener, nullptr );
+	}
+	else if ( strcmp( interface, zwp_linux_dmabuf_v1_interface.name ) == 0 && version >= 3 )
+		s_dmabuf = (struct zwp_linux_dmabuf_v1 *)wl_registry_bind( registry, name, &zwp_linux_dmabuf_v1_interface, 3 );
+}
+
+static void registry_global_remove( void *data, struct wl_registry *registry, uint32_t name )
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	.global = registry_global,
+	.global_remove = registry_global_remove,
+};
+
+static bool create_shm_buffers( Surface_t *surface, uint32_t unSurface )
+{
+	uint32_t stride = s_options.unWidth * 4;
+	size_t size = (size_t)stride * s_options.unHeight;
+	size_t poolSize = size * s_options.unBufferCount;
+
+	int fd = memfd_create( "gamescope-commit-stress", MFD_CLOEXEC );
+	if ( fd < 0 || ftruncate( fd, poolSize ) < 0 )
+	{
+		perror( "memfd" );
+		return false;
+	}
+
+	uint32_t *pixels = (uint32_t *)mmap( nullptr, poolSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	if ( pixels == MAP_FAILED )
+	{
+		perror( "mmap" );
+		close( fd );
+		return false;
+	}
+
+	// A different shade per surface and buffer, so overlapping surfaces can
+	// be told apart on screen
+	for ( uint32_t i = 0; i < s_options.unBufferCount; i++ )
+	{
+		uint32_t color = 0xff000000 | ( ( unSurface * 47 ) & 0xff ) << 16 | ( ( i * 85 ) & 0xff ) << 8 | 0x40;
+		std::fill_n( pixels + i * size / 4, size / 4, color );
+	}
+	munmap( pixels, poolSize );
+
+	struct wl_shm_pool *pool = wl_shm_create_pool( s_shm, fd, poolSize );
+	for ( uint32_t i = 0; i < s_options.unBufferCount; i++ )
+	{
+		Buffer_t &buffer = surface->buffers[ i ];
+		buffer.buffer = wl_shm_pool_create_buffer( pool, i * size, s_options.unWidth, s_options.unHeight, stride, WL_SHM_FORMAT_XRGB8888 );
+		wl_buffer_add_listener( buffer.buffer, &buffer_listener, &buffer );
+	}
+	wl_shm_pool_destroy( pool );
+	close( fd );
+
+	return true;
+}
+
+#if HAVE_GBM
+static struct gbm_device *s_gbm;
+
+static bool create_dmabuf_buffers( Surface_t *surface )
+{
+	if ( s_gbm == nullptr )
+	{
+		int fd = open( s_options.pDevice, O_RDWR | O_CLOEXEC );
+		if ( fd < 0 )
+		{
+			perror( s_options.pDevice );
+			return false;
+		}
+		s_gbm = gbm_create_device( fd );
+		if ( s_gbm == nullptr )
+		{
+			fprintf( stderr, "Failed to create GBM device for %s\n", s_options.pDevice );
+			return false;
+		}
+	}
+
+	// Contents don't matter for the commit path, only that each buffer has
+	// to be imported.
+	for ( Buffer_t &buffer : surface->buffers )
+	{
+		buffer.bo = gbm_bo_create( s_gbm, s_options.unWidth, s_options.unHeight, GBM_FORMAT_XRGB8888, GBM_BO_USE_RENDERING | GBM_BO_USE_SCANOUT );
+		if ( buffer.bo == nullptr )
+		{
+			fprintf( stderr, "Failed to allocate a %ux%u buffer\n", s_options.unWidth, s_options.unHeight );
+			return false;
+		}
+
+		struct zwp_linux_buffer_params_v1 *params = zwp_linux_dmabuf_v1_create_params( s_dmabuf );
+		uint64_t modifier = gbm_bo_get_modifier( buffer.bo );
+		int planeCount = gbm_bo_get_plane_count( buffer.bo );
+		for ( int plane = 0; plane < planeCount; plane++ )
+		{
+			int fd = gbm_bo_get_fd( buffer.bo );
+			zwp_linux_buffer_params_v1_add( params, fd, plane,
+				gbm_bo_get_offset( buffer.bo, plane ), gbm_bo_get_stride_for_plane( buffer.bo, plane ),
+				modifier >> 32, modifier & 0xffffffff );
+			close( fd );
+		}
+
+		buffer.buffer = zwp_linux_buffer_params_v1_create_immed( params, s_options.unWidth, s_options.unHeight, DRM_FORMAT_XRGB8888, 0 );
+		zwp_linux_buffer_params_v1_destroy( params );
+		wl_buffer_add_listener( buffer.buffer, &buffer_listener, &buffer );
+	}
+
+	return true;
+}
+#endif
+
+static Surface_t *create_surface( uint32_t unSurface )
+{
+	Surface_t *surface = new Surface_t;
+	surface->buffers.resize( s_options.unBufferCount );
+
+	bool bSuccess = false;
+	if ( s_options.bufferType == BufferType::SHM )
+		bSuccess = create_shm_buffers( surface, unSurface );
+#if HAVE_GBM
+	else
+		bSuccess = create_dmabuf_buffers( surface );
+#endif
+
+	if ( !bSuccess )
+	{
+		delete surface;
+		return nullptr;
+	}
+
+	surface->surface = wl_compositor_create_surface( s_compositor );
+	surface->xdgSurface = xdg_wm_base_get_xdg_surface( s_wmBase, surface->surface );
+	xdg_surface_add_listener( surface->xdgSurface, &xdg_surface_listener, surface );
+	surface->toplevel = xdg_surface_get_toplevel( surface->xdgSurface );
+	xdg_toplevel_add_listener( surface->toplevel, &toplevel_listener, surface );
+
+	char title[ 64 ];
+	snprintf( title, sizeof( title ), "commit-stress %u", unSurface );
+	xdg_toplevel_set_title( surface->toplevel, title );
+
+	wl_surface_commit( surface->surface );
+	return surface;
+}
+
+static void commit_surface( Surface_t *surface, uint64_t now )
+{
+	Buffer_t *buffer = nullptr;
+	for ( uint32_t i = 0; i < surface->buffers.size() && buffer == nullptr; i++ )
+	{
+		Buffer_t *candidate = &surface->buffers[ ( surface->unNextBuffer + i ) % surface->buffers.size() ];
+		if ( !candidate->bBusy )
+			buffer = candidate;
+	}
+
+	if ( buffer == nullptr )
+	{
+		s_interval.unStarved++;
+		return;
+	}
+
+	surface->unNextBuffer = ( buffer - surface->buffers.data() + 1 ) % surface->buffers.size();
+	buffer->bBusy = true;
+	buffer->ulCommitTime = now;
+
+	if ( s_presentation )
+	{
+		Feedback_t *pFeedback = new Feedback_t{ now };
+		struct wp_presentation_feedback *feedback = wp_presentation_feedback( s_presentation, surface->surface );
+		wp_presentation_feedback_add_listener( feedback, &feedback_listener, pFeedback );
+	}
+
+	wl_surface_attach( surface->surface, buffer->buffer, 0, 0 );
+	wl_surface_damage_buffer( surface->surface, 0, 0, INT32_MAX, INT32_MAX );
+	wl_surface_commit( surface->surface );
+
+	s_interval.unCommits++;
+}
+
+static void print_interval( double flRate, double flSeconds )
+{
+	const Counters_t &c = s_interval;
+	printf( "%6.1f Hz x %u: %7.1f commits/s %7.1f presented/s %7.1f discarded/s %5u starved  present p50 <%lluus p99 <%lluus  release p99 <%lluus\n",
+		flRate, s_options.unSurfaces,
+		c.unCommits / flSeconds, c.unPresented / flSeconds, c.unDiscarded / flSeconds, c.unStarved,
+		(unsigned long long)c.presentLatency.percentile( 0.5f ),
+		(unsigned long long)c.presentLatency.percentile( 0.99f ),
+		(unsigned long long)c.releaseLatency.percentile( 0.99f ) );
+	fflush( stdout );
+}
+
+static void print_histogram( const char *pName, const Histogram_t &histogram )
+{
+	if ( histogram.unCount == 0 )
+		return;
+
+	printf( "%s latency, %u samples, max %.2fms:\n", pName, histogram.unCount, histogram.ulMax / 1'000'000.0 );
+	for ( uint32_t i = 0; i < k_unBuckets; i++ )
+	{
+		if ( histogram.buckets[ i ] == 0 )
+			continue;
+
+		uint32_t unBar = histogram.buckets[ i ] * 50 / histogram.unCount;
+		printf( "  <%9lluus %8u %.*s\n", 1ull << i, histogram.buckets[ i ], (int)unBar, "##################################################" );
+	}
+}
+
+static void usage( const char *pArgv0 )
+{
+	fprintf( stderr,
+		"usage: %s [options...]\n"
+		"\n"
+		"Commits buffers on a number of xdg toplevels at a fixed rate, to load\n"
+		"gamescope's commit path. Connects to $WAYLAND_DISPLAY, run gamescope\n"
+		"with --expose-wayland.\n"
+		"\n"
+		"Options:\n"
+		"  -n, --surfaces N       number of surfaces (default 1)\n"
+		"  -r, --rate HZ          commits per second per surface (default 60)\n"
+		"  --ramp HZ              raise the rate by HZ every second, stop once commits back up\n"
+		"  -d, --duration S       seconds to run for (default 10)\n"
+		"  -s, --size WxH         buffer size (default 1280x720)\n"
+		"  -b, --buffers N        buffers per surface (default 3)\n"
+		"  --dmabuf               use dmabufs from GBM instead of shm\n"
+		"  --device PATH          render node for --dmabuf (default /dev/dri/renderD128)\n",
+		pArgv0 );
+}
+
+static const struct option k_options[] = {
+	{ "surfaces", required_argument, nullptr, 'n' },
+	{ "rate", required_argument, nullptr, 'r' },
+	{ "ramp", required_argument, nullptr, 'R' },
+	{ "duration", required_argument, nullptr, 'd' },
+	{ "size", required_argument, nullptr, 's' },
+	{ "buffers", required_argument, nullptr, 'b' },
+	{ "dmabuf", no_argument, nullptr, 'D' },
+	{ "device", required_argument, nullptr, 'V' },
+	{ "help", no_argument, nullptr, 'h' },
+	{}
+};
+
+static bool parse_options( int argc, char **argv )
+{
+	int o;
+	while ( ( o = getopt_long( argc, argv, "n:r:d:s:b:h", k_options, nullptr ) ) != -1 )
+	{
+		switch ( o )
+		{
+			case 'n':
+				s_options.unSurfaces = std::max( atoi( optarg ), 1 );
+				break;
+			case 'r':
+				s_options.flRate = atof( optarg );
+				break;
+			case 'R':
+				s_options.flRampStep = atof( optarg );
+				break;
+			case 'd':
+				s_options.unDuration = atoi( optarg );
+				break;
+			case 's':
+				if ( sscanf( optarg, "%ux%u", &s_options.unWidth, &s_options.unHeight ) != 2 )
+					return false;
+				break;
+			case 'b':
+				s_options.unBufferCount = std::max( atoi( optarg ), 1 );
+				break;
+			case 'D':
+				s_options.bufferType = BufferType::DMABUF;
+				break;
+			case 'V':
+				s_options.pDevice = optarg;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return s_options.flRate > 0.0 && s_options.unWidth > 0 && s_options.unHeight > 0;
+}
+
+static void handle_signal( int sig )
+{
+	s_bRunning = 0;
+}
+
+int main( int argc, char **argv )
+{
+	if ( !parse_options( argc, argv ) )
+	{
+		usage( argv[0] );
+		return 1;
+	}
+
+#if !HAVE_GBM
+	if ( s_options.bufferType == BufferType::DMABUF )
+	{
+		fprintf( stderr, "Built without GBM, dmabufs are not available\n" );
+		return 1;
+	}
+#endif
+
+	s_display = wl_display_connect( nullptr );
+	if ( s_display == nullptr )
+	{
+		fprintf( stderr, "Failed to connect to the Wayland display\n" );
+		return 1;
+	}
+
+	struct wl_registry *registry = wl_display_get_registry( s_display );
+	wl_registry_add_listener( registry, &registry_listener, nullptr );
+	wl_display_roundtrip( s_display );
+	wl_display_roundtrip( s_display );
+
+	if ( s_compositor == nullptr || s_wmBase == nullptr || s_shm == nullptr )
+	{
+		fprintf( stderr, "Compositor is missing wl_compositor, wl_shm or xdg_wm_base\n" );
+		return 1;
+	}
+	if ( s_options.bufferType == BufferType::DMABUF && s_dmabuf == nullptr )
+	{
+		fprintf( stderr, "Compositor doesn't support zwp_linux_dmabuf_v1 version 3\n" );
+		return 1;
+	}
+	if ( s_presentation == nullptr )
+		fprintf( stderr, "No wp_presentation, only reporting commit and release rates\n" );
+
+	for ( uint32_t i = 0; i < s_options.unSurfaces; i++ )
+	{
+		Surface_t *surface = create_surface( i );
+		if ( surface == nullptr )
+			return 1;
+		s_surfaces.push_back( surface );
+	}
+
+	signal( SIGINT, handle_signal );
+	signal( SIGTERM, handle_signal );
+
+	// Wait for every surface to be configured before starting the clock
+	while ( s_bRunning && std::any_of( s_surfaces.begin(), s_surfaces.end(), []( Surface_t *s ) { return !s->bConfigured; } ) )
+	{
+		if ( wl_display_dispatch( s_display ) < 0 )
+			return 1;
+	}
+
+	double flRate = s_options.flRate;
+	uint64_t ulStart = get_time();
+	uint64_t ulEnd = ulStart + s_options.unDuration * 1'000'000'000ull;
+	uint64_t ulLastReport = ulStart;
+	uint64_t ulBaselineLatency = 0;
+	double flBackedUpRate = 0.0;
+
+	// Spread the surfaces' commits over the interval
+	for ( uint32_t i = 0; i < s_surfaces.size(); i++ )
+		s_surfaces[ i ]->ulNextCommit = ulStart + (uint64_t)( 1'000'000'000.0 / flRate ) * i / s_surfaces.size();
+
+	while ( s_bRunning )
+	{
+		uint64_t now = get_time();
+		if ( now >= ulEnd )
+			break;
+
+		uint64_t ulInterval = 1'000'000'000.0 / flRate;
+		uint64_t ulNextWake = std::min( ulEnd, ulLastReport + k_ulReportInterval );
+
+		for ( Surface_t *surface : s_surfaces )
+		{
+			if ( now >= surface->ulNextCommit )
+			{
+				commit_surface( surface, now );
+				surface->ulNextCommit += ulInterval;
+				// Fell behind ourselves, don't burst to catch up
+				if ( surface->ulNextCommit < now )
+					surface->ulNextCommit = now + ulInterval;
+			}
+			ulNextWake = std::min( ulNextWake, surface->ulNextCommit );
+		}
+
+		if ( now - ulLastReport >= k_ulReportInterval )
+		{
+			print_interval( flRate, ( now - ulLastReport ) / 1'000'000'000.0 );
+
+			// Commits back up when buffers stop coming back in time, or when
+			// they take much longer to show up than they did at the start.
+			uint64_t ulLatency = s_interval.presentLatency.percentile( 0.5f );
+			if ( ulBaselineLatency == 0 )
+				ulBaselineLatency = ulLatency;
+			bool bBackedUp = s_interval.unStarved > 0 || ( ulBaselineLatency && ulLatency > ulBaselineLatency * 4 );
+
+			s_total.merge( s_interval );
+			s_interval = Counters_t{};
+			ulLastReport = now;
+
+			if ( s_options.flRampStep > 0.0 )
+			{
+				if ( bBackedUp )
+				{
+					flBackedUpRate = flRate;
+					break;
+				}
+				flRate += s_options.flRampStep;
+			}
+		}
+
+		// Prepare to read before flushing, so no events get missed
+		while ( wl_display_prepare_read( s_display ) != 0 )
+			wl_display_dispatch_pending( s_display );
+		wl_display_flush( s_display );
+
+		now = get_time();
+		uint64_t ulTimeout = ulNextWake > now ? ulNextWake - now : 0;
+		struct timespec timeout = { (time_t)( ulTimeout / 1'000'000'000ull ), (long)( ulTimeout % 1'000'000'000ull ) };
+		struct pollfd fd = { wl_display_get_fd( s_display ), POLLIN, 0 };
+
+		if ( ppoll( &fd, 1, &timeout, nullptr ) > 0 && ( fd.revents & POLLIN ) )
+			wl_display_read_events( s_display );
+		else
+			wl_display_cancel_read( s_display );
+
+		if ( wl_display_dispatch_pending( s_display ) < 0 )
+		{
+			fprintf( stderr, "Lost the Wayland connection\n" );
+			return 1;
+		}
+	}
+
+	s_total.merge( s_interval );
+
+	double flSeconds = ( get_time() - ulStart ) / 1'000'000'000.0;
+	printf( "\n%u commits in %.1fs, %u presented, %u discarded, %u starved\n",
+		s_total.unCommits, flSeconds, s_total.unPresented, s_total.unDiscarded, s_total.unStarved );
+	print_histogram( "Present", s_total.presentLatency );
+	print_histogram( "Release", s_total.releaseLatency );
+
+	if ( s_options.flRampStep > 0.0 )
+	{
+		if ( flBackedUpRate > 0.0 )
+			printf( "Backed up at %.1f Hz per surface, %.1f commits/s in total\n", flBackedUpRate, flBackedUpRate * s_options.unSurfaces );
+		else
+			printf( "Didn't back up, reached %.1f Hz per surface\n", flRate );
+	}
+
+	wl_display_disconnect( s_display );
+	return 0;
+}
@@ -0,0 +1,274 @@
+// Reference reader for the frame limiter page
+//
+// Does what a limiter layer in a game would: maps $GAMESCOPE_LIMITER_FILE
+// (the same path gamescope was started with), and for every frame sleeps
+// until the present margin before the vblank it aims for, then reports the
+// present back so gamescope leaves limiting to it. There is no actual
+// rendering or presenting, --work stands in for the time a frame takes.
+//
+// Prints how far its wakeups landed from where it aimed once a second.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "gamescope_limiter.h"
+
+static const uint64_t k_ulReportInterval = 1'000'000'000;
+
+static struct
+{
+	uint32_t unAppID = 0;
+	uint32_t unDuration = 10;
+	uint64_t ulWork = 0;
+} s_options;
+
+static volatile sig_atomic_t s_bRunning = 1;
+
+static uint64_t get_time( void )
+{
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1'000'000'000ull + ts.tv_nsec;
+}
+
+static void sleep_until( uint64_t ulTime )
+{
+	struct timespec ts = {
+		.tv_sec = (time_t)( ulTime / 1'000'000'000ull ),
+		.tv_nsec = (long)( ulTime % 1'000'000'000ull ),
+	};
+	while ( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr ) == EINTR && s_bRunning )
+		;
+}
+
+// What a frame needs out of the page, read consistently
+struct Snapshot_t
+{
+	uint32_t unLimiterEnabled;
+	uint32_t unAppID;
+	uint64_t ulTargetInterval;
+	uint64_t ulRefreshInterval;
+	uint64_t ulNextVblank;
+	uint64_t ulPresentMargin;
+};
+
+// Seqlock read side: gamescope makes seq odd while it updates the page, so
+// retry until it is even and unchanged across the read.
+static Snapshot_t read_page( const gamescope_limiter_page_t *page )
+{
+	Snapshot_t snapshot;
+	while ( true )
+	{
+		uint32_t seq = __atomic_load_n( &page->seq, __ATOMIC_ACQUIRE );
+		if ( seq & 1 )
+			continue;
+
+		snapshot.unLimiterEnabled = __atomic_load_n( &page->limiter_enabled, __ATOMIC_RELAXED );
+		snapshot.unAppID = __atomic_load_n( &page->app_id, __ATOMIC_RELAXED );
+		snapshot.ulTargetInterval = __atomic_load_n( &page->target_interval_ns, __ATOMIC_RELAXED );
+		snapshot.ulRefreshInterval = __atomic_load_n( &page->refresh_interval_ns, __ATOMIC_RELAXED );
+		snapshot.ulNextVblank = __atomic_load_n( &page->next_vblank_ns, __ATOMIC_RELAXED );
+		snapshot.ulPresentMargin = __atomic_load_n( &page->present_margin_ns, __ATOMIC_RELAXED );
+
+		std::atomic_thread_fence( std::memory_order_acquire );
+		if ( __atomic_load_n( &page->seq, __ATOMIC_RELAXED ) == seq )
+			return snapshot;
+	}
+}
+
+// Tells gamescope we let a present through. It stops holding back frame
+// callbacks for client_app_id while client_present_ns stays recent.
+static void write_present( gamescope_limiter_page_t *page, uint64_t ulPresent )
+{
+	__atomic_store_n( &page->client_app_id, s_options.unAppID, __ATOMIC_RELAXED );
+	__atomic_store_n( &page->client_pid, (uint32_t)getpid(), __ATOMIC_RELAXED );
+	__atomic_store_n( &page->client_present_ns, ulPresent, __ATOMIC_RELEASE );
+}
+
+// When to wake for the next present: the margin ahead of the first vblank at
+// least ulInterval after the last present, and not in the past.
+static uint64_t next_wake( const Snapshot_t &snapshot, uint64_t ulInterval, uint64_t ulLastPresent, uint64_t now )
+{
+	uint64_t ulRefresh = std::max<uint64_t>( snapshot.ulRefreshInterval, 1 );
+	uint64_t ulVblank = snapshot.ulNextVblank ? snapshot.ulNextVblank : now;
+
+	// Half a refresh of slack, so a present that ran a little late doesn't
+	// cost a whole extra vblank
+	uint64_t ulEarliest = ulLastPresent + ulInterval;
+	ulEarliest = ulEarliest > ulRefresh / 2 ? ulEarliest - ulRefresh / 2 : 0;
+	ulEarliest = std::max( ulEarliest, now + snapshot.ulPresentMargin );
+
+	if ( ulVblank < ulEarliest )
+		ulVblank += ( ulEarliest - ulVblank + ulRefresh - 1 ) / ulRefresh * ulRefresh;
+
+	return ulVblank - snapshot.ulPresentMargin;
+}
+
+static void usage( const char *pArgv0 )
+{
+	fprintf( stderr,
+		"usage: %s [options...]\n"
+		"\n"
+		"Paces fake frames off the page gamescope shares with frame limiter\n"
+		"layers. Run gamescope and this with the same GAMESCOPE_LIMITER_FILE.\n"
+		"\n"
+		"Options:\n"
+		"  -a, --app-id ID        Steam app ID to present as (default $SteamAppId)\n"
+		"  -d, --duration S       seconds to run for (default 10)\n"
+		"  -w, --work MS          time each frame takes after its present (default 0)\n",
+		pArgv0 );
+}
+
+static const struct option k_options[] = {
+	{ "app-id", required_argument, nullptr, 'a' },
+	{ "duration", required_argument, nullptr, 'd' },
+	{ "work", required_argument, nullptr, 'w' },
+	{ "help", no_argument, nullptr, 'h' },
+	{}
+};
+
+static bool parse_options( int argc, char **argv )
+{
+	const char *pSteamAppID = getenv( "SteamAppId" );
+	if ( pSteamAppID )
+		s_options.unAppID = strtoul( pSteamAppID, nullptr, 10 );
+
+	int o;
+	while ( ( o = getopt_long( argc, argv, "a:d:w:h", k_options, nullptr ) ) != -1 )
+	{
+		switch ( o )
+		{
+			case 'a':
+				s_options.unAppID = strtoul( optarg, nullptr, 10 );
+				break;
+			case 'd':
+				s_options.unDuration = atoi( optarg );
+				break;
+			case 'w':
+				s_options.ulWork = atof( optarg ) * 1'000'000.0;
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+static void handle_signal( int sig )
+{
+	s_bRunning = 0;
+}
+
+int main( int argc, char **argv )
+{
+	if ( !parse_options( argc, argv ) )
+	{
+		usage( argv[0] );
+		return 1;
+	}
+
+	const char *pPath = getenv( "GAMESCOPE_LIMITER_FILE" );
+	if ( pPath == nullptr )
+	{
+		fprintf( stderr, "GAMESCOPE_LIMITER_FILE is not set\n" );
+		return 1;
+	}
+
+	int fd = open( pPath, O_RDWR | O_CLOEXEC );
+	if ( fd < 0 )
+	{
+		fprintf( stderr, "Failed to open %s: %s\n", pPath, strerror( errno ) );
+		return 1;
+	}
+
+	void *data = mmap( nullptr, sizeof( gamescope_limiter_page_t ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+	close( fd );
+	if ( data == MAP_FAILED )
+	{
+		fprintf( stderr, "Failed to map %s: %s\n", pPath, strerror( errno ) );
+		return 1;
+	}
+
+	gamescope_limiter_page_t *page = (gamescope_limiter_page_t *)data;
+	if ( page->magic != GAMESCOPE_LIMITER_MAGIC || page->version != GAMESCOPE_LIMITER_VERSION )
+	{
+		fprintf( stderr, "%s is not a version %u limiter page\n", pPath, GAMESCOPE_LIMITER_VERSION );
+		return 1;
+	}
+
+	signal( SIGINT, handle_signal );
+	signal( SIGTERM, handle_signal );
+
+	uint64_t ulStart = get_time();
+	uint64_t ulEnd = ulStart + s_options.unDuration * 1'000'000'000ull;
+	uint64_t ulLastReport = ulStart;
+	uint64_t ulLastPresent = 0;
+
+	uint32_t unPresents = 0;
+	uint32_t unUnlimited = 0;
+	uint64_t ulLateSum = 0;
+	uint64_t ulLateMax = 0;
+
+	while ( s_bRunning )
+	{
+		uint64_t now = get_time();
+		if ( now >= ulEnd )
+			break;
+
+		Snapshot_t snapshot = read_page( page );
+
+		// Until gamescope limits this app, present every vblank like a game
+		// with vsync on would.
+		bool bLimited = snapshot.unLimiterEnabled && snapshot.ulTargetInterval != 0 &&
+			snapshot.unAppID == s_options.unAppID;
+		if ( !bLimited )
+			unUnlimited++;
+
+		uint64_t ulWake = next_wake( snapshot, bLimited ? snapshot.ulTargetInterval : 0, ulLastPresent, now );
+		sleep_until( ulWake );
+
+		uint64_t ulPresent = get_time();
+		write_present( page, ulPresent );
+
+		uint64_t ulLate = ulPresent - ulWake;
+		ulLateSum += ulLate;
+		ulLateMax = std::max( ulLateMax, ulLate );
+		unPresents++;
+		ulLastPresent = ulPresent;
+
+		if ( s_options.ulWork )
+			sleep_until( ulPresent + s_options.ulWork );
+
+		now = get_time();
+		if ( now - ulLastReport >= k_ulReportInterval )
+		{
+			printf( "presents=%u unlimited=%u target_fps=%.1f wake_late_avg=%lluus wake_late_max=%lluus\n",
+				unPresents, unUnlimited,
+				snapshot.ulTargetInterval ? 1'000'000'000.0 / snapshot.ulTargetInterval : 0.0,
+				(unsigned long long)( ulLateSum / std::max<uint32_t>( unPresents, 1 ) / 1000 ),
+				(unsigned long long)( ulLateMax / 1000 ) );
+			fflush( stdout );
+
+			ulLastReport = now;
+			unPresents = 0;
+			unUnlimited = 0;
+			ulLateSum = 0;
+			ulLateMax = 0;
+		}
+	}
+
+	munmap( data, sizeof( gamescope_limiter_page_t ) );
+	return 0;
+}